@@ -0,0 +1,388 @@
+/* Benchmarks for the BST. Build and run with `make bench`.
+ *
+ * Every combination of mode, key stream and size is run in a child process of
+ * its own, so that the peak resident set size reported for it is its own and
+ * the allocator starts out fresh. Each prints one CSV line per operation:
+ *
+ * 	mode,stream,size,op,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,
+ * 	peak_rss_kb
+ *
+ * `add`, `contains` and `delete` time every call. `contains_many` looks the
+ * same keys up with `bst_contains_many` in batches of MANY_BATCH, counts every
+ * key as an operation, and reports the latency of a batch. `traverse` (an
+ * in-order `bst_execute`) and `balance` (`bst_balance`) time whole passes over
+ * the tree, count every element visited as an operation, and report the
+ * latency of a pass. The latencies include the cost of reading the clock (some
+ * tens of nanoseconds).
+ *
+ * Usage: bst_bench [size...]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "bst.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Passes made by `traverse` and `balance`. */
+#define PASSES		5
+
+/* Keys per `bst_contains_many`. */
+#define MANY_BATCH	256
+
+/* Exponent of the Zipfian distribution, as in YCSB. */
+#define ZIPF_THETA	0.99
+
+/* Plain trees degenerate into lists on sorted and adversarial streams, which
+ * makes every operation linear; larger sizes would take hours. */
+#define DEGENERATE_MAX	20000
+
+typedef struct {
+	const char*	name;
+	bst_mode_t	mode;
+} bench_mode_t;
+
+typedef enum {
+	STREAM_SORTED,
+	STREAM_RANDOM,
+	STREAM_ZIPF,
+	STREAM_ADVERSARIAL,
+} stream_t;
+
+static const bench_mode_t modes[] = {
+	{ "plain",	BST_PLAIN		},
+	{ "avl",	BST_AVL			},
+	{ "avl_slab",	BST_AVL | BST_SLAB	},
+	{ "btree",	BST_BTREE		},
+	{ "splay",	BST_SPLAY		},
+	{ "splay_lazy",	BST_SPLAY_LAZY		},
+	{ "compact",	BST_COMPACT		},
+	{ "compact_avl", BST_COMPACT | BST_AVL	},
+};
+
+static const char* const stream_names[] = {
+	"sorted", "random", "zipf", "adversarial",
+};
+
+typedef struct {
+	const char*	op;
+	size_t		ops;
+	double		seconds;
+	uint64_t	p50;
+	uint64_t	p99;
+	uint64_t	p999;
+} result_t;
+
+static volatile int64_t sink;
+
+
+
+/*==============================================================================
+	KEY STREAMS
+==============================================================================*/
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+/* xorshift64* */
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1du;
+}
+
+static void shuffle(int32_t* keys, size_t n)
+{
+	for (size_t i = n; i > 1; --i) {
+		size_t	j	= rng_next() % i;
+		int32_t	tmp	= keys[i - 1];
+		keys[i - 1]	= keys[j];
+		keys[j]		= tmp;
+	}
+}
+
+/* Fill `inserts` with the order in which the keys 0 .. n-1 are added, and
+ * `lookups` with the n keys that are then looked up:
+ *
+ * 	- sorted:	both ascending.
+ * 	- random:	a random permutation, and uniformly drawn keys.
+ * 	- zipf:		a random permutation, and keys drawn with Zipfian
+ * 			popularity, the most popular ones spread out at random.
+ * 	- adversarial:	both zigzagging between the ends (0, n-1, 1, n-2,
+ * 			...), which degenerates a plain tree and makes an AVL
+ * 			tree rotate all the time.
+ */
+static void stream_fill(stream_t stream, int32_t* inserts, int32_t* lookups,
+			size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		inserts[i] = (int32_t)i;
+	}
+
+	switch (stream) {
+	case STREAM_SORTED:
+		memcpy(lookups, inserts, n * sizeof *lookups);
+		break;
+
+	case STREAM_RANDOM:
+		shuffle(inserts, n);
+		for (size_t i = 0; i < n; ++i) {
+			lookups[i] = (int32_t)(rng_next() % n);
+		}
+		break;
+
+	case STREAM_ZIPF: {
+		double* cdf = malloc(n * sizeof *cdf);
+		double	sum = 0;
+
+		if (cdf == NULL) {
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < n; ++i) {
+			sum	+= 1.0 / pow((double)(i + 1), ZIPF_THETA);
+			cdf[i]	= sum;
+		}
+		/* The rank-r key is inserts[r] once shuffled. */
+		shuffle(inserts, n);
+		for (size_t i = 0; i < n; ++i) {
+			double	u	= (double)(rng_next() >> 11) /
+					  (double)(1ull << 53) * sum;
+			size_t	lo	= 0;
+			size_t	hi	= n - 1;
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+				if (cdf[mid] < u) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			lookups[i] = inserts[lo];
+		}
+		free(cdf);
+		break;
+	}
+
+	case STREAM_ADVERSARIAL:
+		for (size_t i = 0; i < n; ++i) {
+			inserts[i] = (int32_t)(i % 2 == 0 ? i / 2
+							  : n - 1 - i / 2);
+		}
+		memcpy(lookups, inserts, n * sizeof *lookups);
+		break;
+	}
+}
+
+
+
+/*==============================================================================
+	MEASUREMENT
+==============================================================================*/
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Sort the `count` latencies and summarize them. */
+static result_t summarize(const char* op, size_t ops, uint64_t total,
+			  uint64_t* lat, size_t count)
+{
+	result_t result = { op, ops, (double)total / 1e9, 0, 0, 0 };
+
+	qsort(lat, count, sizeof *lat, cmp_u64);
+	result.p50	= lat[(count - 1) * 500 / 1000];
+	result.p99	= lat[(count - 1) * 990 / 1000];
+	result.p999	= lat[(count - 1) * 999 / 1000];
+	return result;
+}
+
+static void sum_visit(void* data)
+{
+	sink += *(int32_t*)data;
+}
+
+/* Time every call of `op` on the keys in `keys`. */
+#define TIME_EACH(OP, KEYS, N, LAT, TOTAL)				\
+do {									\
+	uint64_t start_ = now_ns();					\
+	for (size_t i_ = 0; i_ < (N); ++i_) {				\
+		uint64_t t_ = now_ns();					\
+		OP(&(KEYS)[i_]);					\
+		(LAT)[i_] = now_ns() - t_;				\
+	}								\
+	(TOTAL) = now_ns() - start_;					\
+} while (0)
+
+
+
+/*==============================================================================
+	BENCHMARK
+==============================================================================*/
+
+static bst_t* tree;
+
+static void op_add(int32_t* key)	{ bst_add(tree, key); }
+static void op_contains(int32_t* key)	{ sink += bst_contains(tree, key); }
+static void op_delete(int32_t* key)	{ bst_delete(tree, key); }
+
+static void run(const bench_mode_t* mode, stream_t stream, size_t n)
+{
+	int32_t*	inserts	= malloc(n * sizeof *inserts);
+	int32_t*	lookups	= malloc(n * sizeof *lookups);
+	size_t		samples	= n > PASSES ? n : PASSES;
+	uint64_t*	lat	= malloc(samples * sizeof *lat);
+	result_t	results[6];
+	size_t		batches;
+	size_t		count	= 0;
+	uint64_t	total;
+	struct rusage	usage;
+
+	tree = bst_new(BST_COPIED, mode->mode, sizeof(int32_t), bst_cmp_int32,
+		       free, NULL);
+	if (inserts == NULL || lookups == NULL || lat == NULL || tree == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	stream_fill(stream, inserts, lookups, n);
+
+	TIME_EACH(op_add, inserts, n, lat, total);
+	results[count++] = summarize("add", n, total, lat, n);
+
+	TIME_EACH(op_contains, lookups, n, lat, total);
+	results[count++] = summarize("contains", n, total, lat, n);
+
+	total	= 0;
+	batches	= 0;
+	for (size_t i = 0; i < n; i += MANY_BATCH) {
+		size_t		len = n - i < MANY_BATCH ? n - i : MANY_BATCH;
+		uint64_t	t   = now_ns();
+		sink += bst_contains_many(tree, &lookups[i], len, NULL);
+		lat[batches]	= now_ns() - t;
+		total		+= lat[batches++];
+	}
+	results[count++] = summarize("contains_many", n, total, lat, batches);
+
+	total = 0;
+	for (size_t i = 0; i < PASSES; ++i) {
+		uint64_t t = now_ns();
+		bst_execute(tree, sum_visit, ORDER_IN);
+		lat[i]	= now_ns() - t;
+		total	+= lat[i];
+	}
+	results[count++] = summarize("traverse", PASSES * n, total, lat,
+				     PASSES);
+
+	/* A B-tree is always balanced; `bst_balance` does nothing. */
+	if (mode->mode != BST_BTREE) {
+		total = 0;
+		for (size_t i = 0; i < PASSES; ++i) {
+			uint64_t t = now_ns();
+			bst_balance(&tree);
+			lat[i]	= now_ns() - t;
+			total	+= lat[i];
+		}
+		results[count++] = summarize("balance", PASSES * n, total, lat,
+					     PASSES);
+	}
+
+	/* Deleted in insertion order, which for the adversarial stream keeps
+	 * removing the extremes. */
+	TIME_EACH(op_delete, inserts, n, lat, total);
+	results[count++] = summarize("delete", n, total, lat, n);
+
+	getrusage(RUSAGE_SELF, &usage);
+	for (size_t i = 0; i < count; ++i) {
+		result_t* r = &results[i];
+		printf("%s,%s,%zu,%s,%zu,%.6f,%.0f,%llu,%llu,%llu,%ld\n",
+		       mode->name, stream_names[stream], n, r->op, r->ops,
+		       r->seconds, r->seconds > 0 ? r->ops / r->seconds : 0,
+		       (unsigned long long)r->p50,
+		       (unsigned long long)r->p99,
+		       (unsigned long long)r->p999,
+		       usage.ru_maxrss);
+	}
+
+	bst_free(tree);
+	free(inserts);
+	free(lookups);
+	free(lat);
+}
+
+int main(int argc, char** argv)
+{
+	size_t	default_sizes[]	= { 1000, 10000, 100000, 1000000 };
+	size_t*	sizes		= default_sizes;
+	size_t	size_count	= sizeof default_sizes / sizeof *sizes;
+
+	if (argc > 1) {
+		size_count	= (size_t)argc - 1;
+		sizes		= malloc(size_count * sizeof *sizes);
+		if (sizes == NULL) {
+			return EXIT_FAILURE;
+		}
+		for (size_t i = 0; i < size_count; ++i) {
+			sizes[i] = strtoul(argv[i + 1], NULL, 10);
+			if (sizes[i] == 0) {
+				fprintf(stderr, "Invalid size: %s\n",
+					argv[i + 1]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	printf("mode,stream,size,op,ops,seconds,ops_per_sec,"
+	       "p50_ns,p99_ns,p999_ns,peak_rss_kb\n");
+	for (size_t m = 0; m < sizeof modes / sizeof *modes; ++m)
+	for (int s = STREAM_SORTED; s <= STREAM_ADVERSARIAL; ++s)
+	for (size_t i = 0; i < size_count; ++i) {
+		pid_t	pid;
+		int	status;
+
+		if ((modes[m].mode & ~BST_COMPACT) == BST_PLAIN &&
+		    sizes[i] > DEGENERATE_MAX &&
+		    (s == STREAM_SORTED || s == STREAM_ADVERSARIAL)) {
+			continue;
+		}
+		/* Output buffered before the fork would be printed twice. */
+		fflush(stdout);
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			rng_state += sizes[i] * 4 + (size_t)s;
+			run(&modes[m], (stream_t)s, sizes[i]);
+			fflush(stdout);
+			_exit(EXIT_SUCCESS);
+		}
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != EXIT_SUCCESS) {
+			fprintf(stderr, "%s/%s/%zu failed.\n", modes[m].name,
+				stream_names[s], sizes[i]);
+		}
+	}
+
+	if (sizes != default_sizes) {
+		free(sizes);
+	}
+	return EXIT_SUCCESS;
+}
@@ -1,9 +1,22 @@
 #include "bst.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define MALLOC_FAIL	"`malloc` failed.\n"
 
@@ -15,39 +28,392 @@ do {									    \
 	STATEMENT;							    \
 } while (0);
 
+/* Valid `bst_mode_t` flags. */
+#define BST_MODE_MASK	(BST_AVL | BST_SLAB | BST_RANKED | BST_BTREE |	\
+			 BST_CONCURRENT | BST_PERSISTENT | BST_SPLAY |	\
+			 BST_SPLAY_LAZY | BST_COMPACT)
+
+/* Either of the splaying modes. */
+#define BST_SPLAYING	(BST_SPLAY | BST_SPLAY_LAZY)
+
+/* The modes whose trees are not made of `node_t`. */
+#define BST_NODELESS	(BST_BTREE | BST_COMPACT)
+
+/* Links that readers of a BST_CONCURRENT tree may follow while the writer
+ * changes them are read with LOAD and written with PUBLISH (GCC/Clang atomic
+ * builtins), so that a reader sees either the old or the new link and, through
+ * the new one, a completely initialized node. */
+#define LOAD(LINK)		__atomic_load_n(&(LINK), __ATOMIC_ACQUIRE)
+#define PUBLISH(LINK, NODE)	__atomic_store_n(&(LINK), (NODE),	\
+						 __ATOMIC_RELEASE)
+
+/* The height and count of a published node are updated in place while such
+ * readers may load them. Nothing is ordered by them, so relaxed atomics
+ * suffice: a reader sees either the old or the new value. */
+#define LOAD_FIELD(FIELD)	__atomic_load_n(&(FIELD), __ATOMIC_RELAXED)
+#define STORE_FIELD(FIELD, VALUE)					\
+	__atomic_store_n(&(FIELD), (VALUE), __ATOMIC_RELAXED)
+
+#ifdef __GNUC__
+#define PREFETCH(ADDR)	__builtin_prefetch(ADDR)
+#else
+#define PREFETCH(ADDR)
+#endif
+
+/* Counters for `bst_stats`. Readers update them concurrently, so they are
+ * changed atomically; without BST_STATS, only the operand is evaluated, which
+ * the compiler then drops. */
+#ifdef BST_STATS
+#define STATS_ADD(BST, FIELD, N)					\
+	__atomic_fetch_add(&(BST)->stats.FIELD, (N), __ATOMIC_RELAXED)
+#define STATS_HEIGHT(BST, DEPTH)	stats_height(BST, DEPTH)
+#define STATS_REBUILT(BST)		stats_rebuilt(BST)
+#else
+#define STATS_ADD(BST, FIELD, N)	((void)(N))
+#define STATS_HEIGHT(BST, DEPTH)	((void)(DEPTH))
+#define STATS_REBUILT(BST)		((void)0)
+#endif
+
+/* Objects handed out by a slab are aligned like the strictest basic type. */
+typedef union {
+	long double	ld;
+	long long	ll;
+	void*		p;
+	void		(*fp)(void);
+} slab_align_t;
+
+typedef struct slab_chunk_t slab_chunk_t;
+
+struct slab_chunk_t {
+	slab_chunk_t*	next;
+	slab_align_t	objects[];
+};
+
+/* A per-tree bump allocator with a free list. Chunks grow geometrically and are
+ * only ever released all at once, by `slab_free`. */
+typedef struct {
+	slab_chunk_t*	chunks;
+	void*		free_list;
+	char*		cursor;
+	size_t		left;		/* Objects left at `cursor`. */
+	size_t		next_count;	/* Objects in the next chunk. */
+	size_t		obj_size;
+	size_t		bytes;		/* Taken by the chunks. */
+} slab_t;
+
+typedef struct btree_node_t btree_node_t;
+
+/* A node of a BST_COMPACT tree. `link[0]` and `link[1]` are the indices of the
+ * left and right child, 0 standing for none; with BST_AVL, the top bit of each
+ * is set if that subtree is the taller one. */
+typedef struct {
+	void*		data;
+	uint32_t	link[2];
+} compact_node_t;
+
+/* The nodes of a BST_COMPACT tree, which are only ever referred to by their
+ * index, so that the array may move when it grows. */
+typedef struct {
+	compact_node_t*	nodes;
+	uint32_t	root;
+	uint32_t	free;		/* Unused slots, linked by `link[0]`. */
+	uint32_t	used;		/* Slots handed out, slot 0 included. */
+	uint32_t	cap;
+} compact_t;
+
+/* A node that has been removed from a BST_CONCURRENT tree, but may still be
+ * seen by readers. */
+typedef struct {
+	node_t*	node;
+	bool	free_data;
+	bool	subtree;	/* Every node below `node` goes too. */
+} retired_t;
+
+#define RCU_STRIPES	16
+
+/* A reader count alone on its cache line. */
+typedef struct {
+	long	count;
+	char	pad[64 - sizeof(long)];
+} rcu_counter_t;
+
+/* Read-side bookkeeping for BST_CONCURRENT. Readers register in the counter
+ * of the current epoch's parity (on one of several stripes, so that they do
+ * not all contend for one cache line). To reclaim the retired nodes, the writer
+ * advances the epoch and waits for the counters of the old parity to drain:
+ * any reader that could have seen the nodes has then left. */
+typedef struct {
+	rcu_counter_t	readers[2][RCU_STRIPES];
+	unsigned	epoch;
+	char		pad[64];
+	pthread_mutex_t	writer;
+	retired_t*	retired;
+	size_t		len;
+	size_t		cap;
+} rcu_t;
+
+/* A Bloom filter over the keys of a tree: `hashes` bits, derived from `hash`,
+ * are set for every key added. It is rebuilt from the tree once more than
+ * `capacity` keys have been added to it, or once a quarter of them have been
+ * deleted. */
+typedef struct {
+	uint64_t*	bits;
+	size_t		mask;		/* Bits - 1; a power of two. */
+	unsigned	hashes;
+	uint64_t	(*hash)(const void* key);
+	double		fp_rate;
+	size_t		capacity;
+	size_t		count;		/* Keys added since it was built. */
+	size_t		deleted;	/* Keys deleted since it was built. */
+} filter_t;
+
+/* Key types recognized by their `cmp` function, see `bst_cmp_int32` etc. */
+typedef enum {
+	KIND_NONE,
+	KIND_INT32,
+	KIND_INT64,
+	KIND_UINT64,
+	KIND_DOUBLE,
+} key_kind_t;
+
 struct bst_t {
 	node_t*		root;
+	btree_node_t*	btree;		/* Replaces `root` for BST_BTREE. */
+	compact_t	compact;	/* Replaces `root` for BST_COMPACT. */
 	size_t		size;
 	size_t		elem_size;
+	size_t		key_size;	/* `elem_size`, unless a map. */
+	size_t		value_offset;	/* 0, unless a map. */
 	bst_type_t	type;
+	bst_mode_t	mode;
+	key_kind_t	kind;
 	int		(*cmp)(const void*, const void*);
 	void		(*data_free)(void*);
 	void		(*print)(void*);
+	slab_t		slab;		/* Only used for BST_SLAB. */
+	rcu_t*		rcu;		/* Only used for BST_CONCURRENT. */
+	filter_t*	filter;		/* Only set by `bst_filter`. */
+#ifdef BST_STATS
+	bst_stats_t	stats;		/* The counters; `height` is a bound. */
+#endif
+};
+
+/* An immutable copy of a BST with the elements stored by value in Eytzinger
+ * (breadth-first) order: the children of slot `k` are slots `2k` and `2k + 1`,
+ * and slot 0 is unused. For the built-in key kinds, the elements are instead
+ * stored in sorted order (again from slot 1) and indexed by an S-tree. */
+struct bst_frozen_t {
+	char*		elems;
+	size_t		size;
+	size_t		elem_size;
+	int		(*cmp)(const void*, const void*);
+	key_kind_t	kind;
+	char*		keys;		/* S-tree blocks, KIND_NONE excepted. */
+	char*		keys_raw;
+	size_t*		ranks;
+	size_t		blocks;
+	size_t		block_keys;
+	int		(*count_less)(const void* block, const void* key);
+	char*		map;		/* The file, if loaded by `bst_load`. */
+	size_t		map_size;
 };
 
 struct node_t {
 	void*	data;
 	node_t*	left;
 	node_t*	right;
+	int	height;		/* Only maintained for BST_AVL. */
+	unsigned refs;		/* Only maintained for BST_PERSISTENT. */
+	size_t	count;		/* Only maintained for BST_RANKED. */
 };
 
-static void	bst_free_recursive	(bst_t*, node_t*);
-static bool	bst_add_recursive	(bst_t*, node_t*, void* data);
-node_t*		bst_delete_recursive	(bst_t*, node_t*, void* data);
-static bool	bst_contains_recursive	(bst_t*, node_t*, void* data);
-static size_t	bst_height_recursive	(bst_t*, node_t*);
+/* An AVL tree of height 128 would need more nodes than fit in memory, so the
+ * path from the root to any node fits in an array of this size. */
+#define AVL_MAX_HEIGHT	128
+
+/* The most nodes a single `bst_add` or `bst_delete` retires with
+ * BST_CONCURRENT: the deleted node and its successor, and the two nodes of each
+ * of up to two rotations per level. Copying the path to the successor retires
+ * the path on top of this. */
+#define RCU_RETIRE_MAX	(2 + 4 * AVL_MAX_HEIGHT)
 
-static int	bst_to_array		(bst_t*, node_t*,
-					 void* arr[], int index);
+/* A growable stack used by the iterative traversals. It starts out in `local`
+ * and only moves to the heap for deep trees. */
+typedef struct {
+	node_t*	node;
+	size_t	state;
+} node_frame_t;
 
-static node_t*	bst_build_tree		(bst_t*, void* arr[],
-					 int first, int last);
+#define NODE_STACK_LOCAL	64
+
+typedef struct {
+	node_frame_t*	frames;
+	size_t		len;
+	size_t		cap;
+	node_frame_t	local[NODE_STACK_LOCAL];
+} node_stack_t;
+
+/* Tasks per thread for work split over subtrees; enough for stealing to even
+ * out subtrees of different sizes. */
+#define POOL_TASKS	16
+
+/* A piece of the in-order sequence of a tree: either a whole subtree, or just
+ * its root. */
+typedef struct {
+	node_t*	node;
+	bool	subtree;
+	size_t	offset;		/* Of its first element in an array. */
+} piece_t;
+
+static bst_t*	bst_new_like		(bst_t*);
+static void*	bst_insert		(bst_t*, const void* key,
+					 const void* value, bool replace,
+					 bool* added);
+static size_t	bst_free_nodes		(bst_t*, node_t*, bool free_data);
+static void	bst_retrace		(bst_t*, node_t** path[],
+					 size_t depth);
+static void	bst_recount		(bst_t*, const void* data,
+					 node_t* stop, bool increment);
+static bool	bst_delete_copy		(bst_t*, node_t* node, node_t** link,
+					 node_t** path[], size_t* depth);
+
+static size_t	bst_to_array		(bst_t*, node_t*, void* arr[]);
+
+static node_t*	bst_link_tree		(bst_t*, void* nodes[],
+					 size_t first, size_t end);
+static void	pool_run		(unsigned threads, size_t count,
+					 void (*run)(void* ctx, size_t task),
+					 void* ctx);
+static piece_t*	pool_pieces		(node_t* root, size_t target,
+					 size_t* count);
+static size_t	rebuild_flatten		(bst_t*, void* arr[],
+					 unsigned threads);
+static bool	rebuild_tree		(bst_t*, void* arr[], size_t size,
+					 unsigned threads);
+static void	rebuild_free		(bst_t*, node_t*);
+static size_t	rebuild_count		(bst_t*, node_t*);
 
 static void	bst_print_recursive	(bst_t*, node_t*,
 					 void (*print)(void*), int);
 
+static bool	sort_pointers		(void* arr[], size_t count,
+					 int (*cmp)(const void*, const void*),
+					 unsigned threads);
+
+static key_kind_t key_kind		(int (*cmp)(const void*, const void*),
+					 size_t elem_size);
+
+static bool	filter_excludes		(bst_t*, const void* key);
+static void	filter_add		(bst_t*, const void* key);
+static void	filter_added		(bst_t*);
+static void	filter_deleted		(bst_t*, size_t count);
+static bool	filter_build		(bst_t*, uint64_t (*hash)(const void*),
+					 double fp_rate);
+static bool	filter_rebuild		(bst_t*);
+static void	filter_free		(filter_t*);
+static node_t*	node_find		(bst_t*, const void* data);
+static int	key_cmp			(bst_t*, const void* a,
+					 const void* b);
+static node_t*	splay_find		(bst_t*, const void* key,
+					 size_t* depth);
+static bool	splay_due		(bst_t*, size_t depth);
+static void*	splay_insert		(bst_t*, const void* key,
+					 const void* value, bool replace,
+					 bool* added);
+static node_t*	splay_delete		(bst_t*, const void* data);
+static int	splay			(bst_t*, node_t** link,
+					 const void* key, size_t* depth);
+static void	splay_recount		(node_t* first, node_t* last,
+					 bool right);
+
+static void*	btree_insert		(bst_t*, const void* key,
+					 const void* value, bool replace,
+					 bool* added);
+static bool	btree_delete		(bst_t*, const void* data);
+static void*	btree_find		(bst_t*, const void* data);
+static size_t	btree_height		(btree_node_t*);
+static void	btree_free_nodes	(bst_t*, btree_node_t*);
+static void	btree_discard		(bst_t*);
+static void	btree_walk		(btree_node_t*, traversal_order_t,
+					 void (*visit)(void* ctx, void* data),
+					 void* ctx);
+static void	btree_print		(btree_node_t*, void (*print)(void*),
+					 int level);
+
+static void*	compact_insert		(bst_t*, const void* key,
+					 const void* value, bool replace,
+					 bool* added);
+static bool	compact_delete		(bst_t*, const void* data);
+static void*	compact_find		(bst_t*, const void* data);
+static size_t	compact_height		(bst_t*);
+static void	compact_free_nodes	(bst_t*);
+static size_t	compact_walk		(bst_t*, traversal_order_t,
+					 void (*visit)(void* ctx, void* data),
+					 void* ctx);
+static bool	compact_build		(bst_t*, void* arr[], size_t count,
+					 bool copy);
+static void**	compact_flatten		(bst_t*, size_t* size);
+static bst_t*	compact_balanced	(bst_t*);
+static void	compact_rebuild		(bst_t*);
+static void	compact_print		(bst_t*, uint32_t index,
+					 void (*print)(void*), int level);
+static void	nodeless_walk		(bst_t*, traversal_order_t,
+					 void (*visit)(void* ctx, void* data),
+					 void* ctx);
+
+static void	stack_init		(node_stack_t*);
+static bool	stack_push		(node_stack_t*, node_t*,
+					 size_t state);
+static bool	stack_pop		(node_stack_t*, node_t**,
+					 size_t* state);
+static void	stack_free		(node_stack_t*);
+
+static size_t	slab_round		(size_t size);
+static void	slab_init		(slab_t*, size_t obj_size);
+static bool	slab_reserve		(slab_t*, size_t count);
+static void*	slab_take		(slab_t*, size_t count);
+static void*	slab_alloc		(slab_t*);
+static void	slab_release		(slab_t*, void* obj);
+static void	slab_free		(slab_t*);
+
+static rcu_t*	rcu_new			(void);
+static unsigned	rcu_read_begin		(rcu_t*);
+static void	rcu_read_end		(rcu_t*, unsigned token);
+static bool	rcu_reserve		(rcu_t*, size_t retire);
+static bool	rcu_write_begin		(bst_t*, size_t retire);
+static void	rcu_write_end		(bst_t*);
+static void	rcu_retire		(rcu_t*, node_t*, bool free_data,
+					 bool subtree);
+static void	rcu_synchronize		(rcu_t*);
+static void	rcu_free		(bst_t*);
+
+static size_t	node_size		(bst_t*);
 static node_t*	node_new		(bst_t*, void* data);
+static node_t*	node_new_elem		(bst_t*, const void* key,
+					 const void* value);
+static bool	node_init		(bst_t*, node_t*, void* data);
+static bool	node_own		(bst_t*, node_t** link);
+static void	node_put		(bst_t*, node_t*);
 static void	node_free		(bst_t*, node_t*);
+static void	node_release		(bst_t*, node_t*, bool free_data);
+static node_t*	node_clone		(node_t*);
+static node_t*	node_fix		(bst_t*, node_t*);
+static size_t	node_count		(node_t*);
+static int	node_height		(node_t*);
+
+static void	elem_set		(bst_t*, void* elem, const void* key,
+					 const void* value);
+static void*	elem_new		(bst_t*, const void* key,
+					 const void* value);
+static void	elem_free		(bst_t*, void* data);
+static void	elem_replace		(bst_t*, void** slot, const void* key,
+					 const void* value);
+
+#ifdef BST_STATS
+static size_t	btree_bytes		(btree_node_t*);
+static void	stats_height		(bst_t*, size_t depth);
+static void	stats_rebuilt		(bst_t*);
+#endif
 
 
 /*==============================================================================
@@ -55,51 +421,210 @@ static void	node_free		(bst_t*, node_t*);
 ==============================================================================*/
 
 bst_t* bst_new(	bst_type_t	type,
+		bst_mode_t	mode,
 		size_t		elem_size,
 		int		(*cmp)(const void*, const void*),
 		void		(*data_free)(void* data),
 		void		(*print)(void* data))
 {
-	bst_t* bst = malloc(sizeof *bst);
+	bst_t* bst;
 
-	if (bst == NULL) {
-		ERROR(return NULL, MALLOC_FAIL);
-	}
 	if (type != BST_COPIED && type != BST_POINTED) {
 		ERROR(return NULL, "Invalid `type` argument.\n");
 	}
+	if ((mode & ~BST_MODE_MASK) != 0) {
+		ERROR(return NULL, "Invalid `mode` argument.\n");
+	}
+	if ((mode & BST_BTREE) && mode != BST_BTREE) {
+		ERROR(return NULL,
+			"BST_BTREE can not be combined with other modes.\n");
+	}
+	if ((mode & BST_CONCURRENT) && (mode & BST_SLAB)) {
+		ERROR(return NULL,
+			"BST_CONCURRENT can not be combined with BST_SLAB.\n");
+	}
+	if ((mode & BST_PERSISTENT) && (mode & (BST_SLAB | BST_CONCURRENT))) {
+		ERROR(return NULL, "BST_PERSISTENT can not be combined with "
+				   "BST_SLAB or BST_CONCURRENT.\n");
+	}
+	if ((mode & BST_PERSISTENT) && data_free != NULL &&
+	    !(type == BST_COPIED && data_free == free)) {
+		ERROR(return NULL, "BST_PERSISTENT shares elements between "
+				   "trees: `data_free` must be NULL.\n");
+	}
+	if ((mode & BST_COMPACT) && (mode & ~(BST_COMPACT | BST_AVL))) {
+		ERROR(return NULL, "BST_COMPACT can only be combined with "
+				   "BST_AVL.\n");
+	}
+	if ((mode & BST_SPLAYING) &&
+	    (mode & (BST_AVL | BST_CONCURRENT | BST_PERSISTENT))) {
+		ERROR(return NULL, "BST_SPLAY can not be combined with "
+				   "BST_AVL, BST_CONCURRENT or "
+				   "BST_PERSISTENT.\n");
+	}
 	if (cmp == NULL) {
 		ERROR(return NULL, "`cmp` argument may not be NULL.\n");
 	}
+	/* Only once the arguments are known to be valid, so that rejecting
+	 * them leaks nothing. */
+	if ((bst = malloc(sizeof *bst)) == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
 
 	bst->root	= NULL;
+	bst->btree	= NULL;
+	bst->compact	= (compact_t){ NULL, 0, 0, 0, 0 };
 	bst->size	= 0;
 	bst->elem_size	= elem_size;
+	bst->key_size	= elem_size;
+	bst->value_offset = 0;
 	bst->type	= type;
+	bst->mode	= mode;
+	bst->kind	= key_kind(cmp, elem_size);
 	bst->cmp	= cmp;
 	bst->data_free	= data_free;
 	bst->print	= print;
+	bst->rcu	= NULL;
+	bst->filter	= NULL;
+#ifdef BST_STATS
+	memset(&bst->stats, 0, sizeof bst->stats);
+#endif
 
+	if ((mode & BST_CONCURRENT) && (bst->rcu = rcu_new()) == NULL) {
+		free(bst);
+		return NULL;
+	}
+	/* The copies live in the nodes, so freeing them one by one with `free`
+	 * would corrupt the heap. */
+	if ((mode & (BST_SLAB | BST_PERSISTENT)) && type == BST_COPIED &&
+	    data_free == free) {
+		bst->data_free = NULL;
+	}
+	if (mode & BST_SLAB) {
+		slab_init(&bst->slab, node_size(bst));
+	}
+
+	return bst;
+}
+
+/* The alignment a type of `size` bytes may need: the largest power of two
+ * dividing it, up to that of the strictest basic type. */
+static size_t size_align(size_t size)
+{
+	size_t align = 1;
+
+	while (align < sizeof(slab_align_t) && size % (align * 2) == 0) {
+		align *= 2;
+	}
+	return align;
+}
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+bst_t* bst_new_map(	bst_mode_t	mode,
+			size_t		key_size,
+			size_t		value_size,
+			int		(*cmp)(const void*, const void*),
+			void		(*print)(void* data))
+{
+	if (key_size == 0) {
+		ERROR(return NULL, "`key_size` argument may not be 0.\n");
+	}
+
+	/* The value follows the key, both aligned as their sizes suggest, and
+	 * the element is padded so that arrays of them keep that alignment. */
+	size_t	key_align	= size_align(key_size);
+	size_t	value_align	= size_align(value_size);
+	size_t	elem_align	= key_align > value_align ? key_align
+							  : value_align;
+	size_t	value_offset	= round_up(key_size, value_align);
+	size_t	elem_size	= round_up(value_offset + value_size,
+					   elem_align);
+	bst_t*	bst		= bst_new(BST_COPIED, mode, elem_size, cmp,
+					  free, print);
+
+	if (bst != NULL) {
+		bst->key_size		= key_size;
+		bst->value_offset	= value_offset;
+		bst->kind		= key_kind(cmp, key_size);
+	}
 	return bst;
 }
 
+void* bst_value(bst_t* bst, void* data)
+{
+	if (bst == NULL || data == NULL) {
+		ERROR(return NULL, "`bst` or `data` argument is NULL.\n");
+	}
+	return (char*)data + bst->value_offset;
+}
+
+/* An empty tree configured like `bst`. */
+static bst_t* bst_new_like(bst_t* bst)
+{
+	bst_t* new_bst = bst_new(bst->type, bst->mode, bst->elem_size,
+				 bst->cmp, bst->data_free, bst->print);
+
+	if (new_bst != NULL) {
+		new_bst->key_size	= bst->key_size;
+		new_bst->value_offset	= bst->value_offset;
+		new_bst->kind		= bst->kind;
+	}
+	return new_bst;
+}
+
 void bst_free(bst_t* bst)
 {
 	if (bst == NULL) {
 		ERROR(return, "`bst` argument is NULL: nothing to free.\n");
 	}
-	bst_free_recursive(bst, bst->root);
+	if (bst->rcu != NULL) {
+		rcu_free(bst);
+	}
+	filter_free(bst->filter);
+	if (bst->mode & BST_BTREE) {
+		btree_free_nodes(bst, bst->btree);
+	} else if (bst->mode & BST_COMPACT) {
+		compact_free_nodes(bst);
+	}
+	/* Nodes still shared with other trees must stay. */
+	else if (bst->mode & BST_PERSISTENT) {
+		node_put(bst, bst->root);
+	}
+	/* With nothing to call per element, the nodes need not be visited. */
+	else if (!(bst->mode & BST_SLAB) || bst->data_free != NULL) {
+		bst_free_nodes(bst, bst->root, true);
+	}
+	if (bst->mode & BST_SLAB) {
+		slab_free(&bst->slab);
+	}
 	free(bst);
 }
 
-static void bst_free_recursive(bst_t* bst, node_t* node)
+/* Destroy the tree by rotating left children up until the root has none, so
+ * that no stack is needed however deep the tree is. The data is only freed if
+ * `free_data` is true. Return the number of nodes freed. */
+static size_t bst_free_nodes(bst_t* bst, node_t* node, bool free_data)
 {
-	if (node == NULL) {
-		return;
+	size_t count = 0;
+
+	while (node != NULL) {
+		if (node->left != NULL) {
+			node_t* left	= node->left;
+			node->left	= left->right;
+			left->right	= node;
+			node		= left;
+		} else {
+			node_t* right	= node->right;
+			node_release(bst, node, free_data);
+			node		= right;
+			count		+= 1;
+		}
 	}
-	bst_free_recursive(bst, node->left);
-	bst_free_recursive(bst, node->right);
-	node_free(bst, node);
+	return count;
 }
 
 bool bst_add(bst_t* bst, void* data)
@@ -112,48 +637,227 @@ bool bst_add(bst_t* bst, void* data)
 		ERROR(return false,
 			"`data` argument is NULL: nothing to add.\n");
 	}
-	if (bst->root == NULL) {
-		bst->root = node_new(bst, data);
-		bst->size += 1;
-		return true;
+	if (bst->value_offset != 0) {
+		ERROR(return false, "`bst` is a map: use `bst_upsert` or "
+				    "`bst_get_or_insert`.\n");
 	}
-	return bst_add_recursive(bst, bst->root, data);
+
+	bool added;
+
+	bst_insert(bst, data, NULL, false, &added);
+	return added;
 }
 
-static bool bst_add_recursive(bst_t* bst, node_t* node, void* data)
+void* bst_find(bst_t* bst, const void* key)
 {
-	int cmp_result = bst->cmp(data, node->data);
-	if (cmp_result == 0) {	/* Base case */
-		printf("Node already exists inside the BST. Doing nothing.\n");
-		return false;
-	} else if (cmp_result < 0) {
-		if (node->left == NULL) {
-			node->left = node_new(bst, data);
-			bst->size += 1;
-			return true;
-		} else {
-			return bst_add_recursive(bst, node->left, data);
+	if (bst == NULL) {
+		ERROR(return NULL,
+			"`bst` argument is NULL: nothing to search.\n");
+	}
+	if (key == NULL) {
+		ERROR(return NULL,
+			"`key` argument is NULL: nothing to search for.\n");
+	}
+
+	void* elem = NULL;
+
+	if (bst->mode & BST_BTREE) {
+		if (!filter_excludes(bst, key)) {
+			elem = btree_find(bst, key);
+		}
+	} else if (bst->mode & BST_COMPACT) {
+		if (!filter_excludes(bst, key)) {
+			elem = compact_find(bst, key);
 		}
 	} else {
-		if (node->right == NULL) {
-			node->right = node_new(bst, data);
-			bst->size += 1;
-			return true;
-		} else {
-			return bst_add_recursive(bst, node->right, data);
+		unsigned token = bst_read_begin(bst);
+
+		if (!filter_excludes(bst, key)) {
+			node_t* node = node_find(bst, key);
+			elem = node == NULL ? NULL : node->data;
+		}
+		bst_read_end(bst, token);
+	}
+	return elem == NULL ? NULL : (char*)elem + bst->value_offset;
+}
+
+void* bst_upsert(bst_t* bst, const void* key, const void* value)
+{
+	if (bst == NULL || key == NULL) {
+		ERROR(return NULL, "`bst` or `key` argument is NULL.\n");
+	}
+	if (bst->value_offset != 0 && value == NULL) {
+		ERROR(return NULL, "`value` argument is NULL.\n");
+	}
+
+	bool	added;
+	void*	elem = bst_insert(bst, key, value, true, &added);
+
+	return elem == NULL ? NULL : (char*)elem + bst->value_offset;
+}
+
+void* bst_get_or_insert(bst_t*		bst,
+			const void*	key,
+			const void*	value,
+			bool*		inserted)
+{
+	bool added = false;
+
+	if (inserted != NULL) {
+		*inserted = false;
+	}
+	if (bst == NULL || key == NULL) {
+		ERROR(return NULL, "`bst` or `key` argument is NULL.\n");
+	}
+	if (bst->value_offset != 0 && value == NULL) {
+		ERROR(return NULL, "`value` argument is NULL.\n");
+	}
+
+	void* elem = bst_insert(bst, key, value, false, &added);
+
+	if (inserted != NULL) {
+		*inserted = added;
+	}
+	return elem == NULL ? NULL : (char*)elem + bst->value_offset;
+}
+
+static void* bst_add_node(bst_t*, const void* key, const void* value,
+			  bool replace, bool* added);
+static void* bst_replace(bst_t*, node_t** link, const void* key,
+			 const void* value);
+
+/* Add `key` (with `value`, for a map) unless it is there already, in which
+ * case its element is replaced if `replace` is true. Return the element of
+ * `key` in the tree, or NULL if memory ran out. */
+static void* bst_insert(bst_t*		bst,
+			const void*	key,
+			const void*	value,
+			bool		replace,
+			bool*		added)
+{
+	void* elem;
+
+	*added = false;
+	if (!rcu_write_begin(bst, RCU_RETIRE_MAX)) {
+		return NULL;
+	}
+	/* Before the key can be found, so that readers never miss it. */
+	filter_add(bst, key);
+	if (bst->mode & BST_BTREE) {
+		elem = btree_insert(bst, key, value, replace, added);
+	} else if (bst->mode & BST_COMPACT) {
+		elem = compact_insert(bst, key, value, replace, added);
+	} else if (bst->mode & BST_SPLAYING) {
+		elem = splay_insert(bst, key, value, replace, added);
+	} else {
+		elem = bst_add_node(bst, key, value, replace, added);
+	}
+	if (*added) {
+		filter_added(bst);
+	}
+	rcu_write_end(bst);
+	return elem;
+}
+
+static void* bst_add_node(bst_t*	bst,
+			  const void*	key,
+			  const void*	value,
+			  bool		replace,
+			  bool*		added)
+{
+	node_t**	path[AVL_MAX_HEIGHT];
+	size_t		depth	= 0;
+	bool		avl	= bst->mode & BST_AVL;
+	bool		ranked	= bst->mode & BST_RANKED;
+	node_t**	link	= &bst->root;
+	node_t*		node;
+	void*		elem;
+	size_t		cmps	= 0;
+
+	/* With BST_RANKED, every node passed will get a new descendant; this
+	 * is undone if the key turns out to be there already. */
+	while ((node = *link) != NULL) {
+		if (!node_own(bst, link)) {
+			if (ranked) {
+				bst_recount(bst, key, node, false);
+			}
+			return NULL;
+		}
+		node = *link;
+
+		int cmp_result = bst->cmp(key, node->data);
+		cmps += 1;
+		if (cmp_result == 0) {
+			if (ranked) {
+				bst_recount(bst, key, node, false);
+			}
+			STATS_ADD(bst, adds, 1);
+			STATS_ADD(bst, add_comparisons, cmps);
+			if (replace) {
+				return bst_replace(bst, link, key, value);
+			}
+			return node->data;
 		}
+		if (avl) {
+			path[depth++] = link;
+		}
+		if (ranked) {
+			STORE_FIELD(node->count, node->count + 1);
+		}
+		link = cmp_result < 0 ? &node->left : &node->right;
+	}
+
+	if ((node = node_new_elem(bst, key, value)) == NULL) {
+		if (ranked) {
+			bst_recount(bst, key, NULL, false);
+		}
+		return NULL;
 	}
+	/* Rotations may copy the node, but not its data. */
+	elem = node->data;
+	PUBLISH(*link, node);
+	bst->size += 1;
+	bst_retrace(bst, path, depth);
+	STATS_ADD(bst, adds, 1);
+	STATS_ADD(bst, add_comparisons, cmps);
+	STATS_HEIGHT(bst, cmps + 1);
+	*added = true;
+	return elem;
 }
 
-static node_t* smallest_subnode(node_t* node)
+/* Replace the element of the node at `link`. With BST_CONCURRENT, readers may
+ * be reading it, so the node is replaced by a new one instead. */
+static void* bst_replace(bst_t*		bst,
+			 node_t**	link,
+			 const void*	key,
+			 const void*	value)
 {
-	node_t* current = node;
-	while (current->left != NULL) {
-		current = current->left;
+	node_t* node = *link;
+
+	if (bst->type == BST_POINTED && node->data == key) {
+		return node->data;
+	}
+	if (bst->rcu == NULL) {
+		elem_replace(bst, &node->data, key, value);
+		return node->data;
 	}
-	return current;
+
+	node_t* copy = node_new_elem(bst, key, value);
+
+	if (copy == NULL) {
+		return NULL;
+	}
+	copy->left	= node->left;
+	copy->right	= node->right;
+	copy->height	= node->height;
+	copy->count	= node->count;
+	PUBLISH(*link, copy);
+	rcu_retire(bst->rcu, node, true, false);
+	return copy->data;
 }
 
+static node_t* bst_delete_node(bst_t* bst, void* data);
+
 node_t* bst_delete(bst_t* bst, void* data)
 {
 	if (bst == NULL) {
@@ -164,42 +868,232 @@ node_t* bst_delete(bst_t* bst, void* data)
 		ERROR(return NULL,
 			"`data` argument is NULL: nothing to delete.\n");
 	}
-	return bst_delete_recursive(bst, bst->root, data);
+	if (bst->mode & BST_NODELESS) {
+		if (bst->mode & BST_BTREE ? btree_delete(bst, data)
+					  : compact_delete(bst, data)) {
+			filter_deleted(bst, 1);
+		}
+		return NULL;
+	}
+	if (!rcu_write_begin(bst, RCU_RETIRE_MAX)) {
+		return bst->root;
+	}
+
+	size_t	size = bst->size;
+	node_t*	root = bst->mode & BST_SPLAYING ? splay_delete(bst, data)
+					       : bst_delete_node(bst, data);
+
+	if (bst->size < size) {
+		filter_deleted(bst, 1);
+	}
+	rcu_write_end(bst);
+	return root;
 }
 
-node_t* bst_delete_recursive(bst_t* bst, node_t* node, void* data)
+static node_t* bst_delete_node(bst_t* bst, void* data)
 {
+	node_t**	path[AVL_MAX_HEIGHT];
+	size_t		depth	= 0;
+	bool		avl	= bst->mode & BST_AVL;
+	bool		ranked	= bst->mode & BST_RANKED;
+	node_t**	link	= &bst->root;
+	node_t*		node;
+	size_t		cmps	= 0;
+
+	/* Counted down optimistically, as in `bst_add`. The node to delete is
+	 * made this tree's own too, so that it can be freed. */
+	while ((node = *link) != NULL) {
+		if (!node_own(bst, link)) {
+			if (ranked) {
+				bst_recount(bst, data, node, true);
+			}
+			return bst->root;
+		}
+		node = *link;
+
+		int cmp_result = bst->cmp(data, node->data);
+		cmps += 1;
+		if (cmp_result == 0) {
+			break;
+		}
+		if (avl) {
+			path[depth++] = link;
+		}
+		if (ranked) {
+			STORE_FIELD(node->count, node->count - 1);
+		}
+		link = cmp_result < 0 ? &node->left : &node->right;
+	}
+	STATS_ADD(bst, deletes, 1);
+	STATS_ADD(bst, delete_comparisons, cmps);
 	if (node == NULL) {
-		return node;
+		if (ranked) {
+			bst_recount(bst, data, NULL, true);
+		}
+		return bst->root;
+	}
+
+	/* The node is replaced by its in-order successor, which is relinked
+	 * rather than copied, so that the data being freed is always the data
+	 * that belonged to the deleted node. */
+	if (node->left == NULL) {
+		PUBLISH(*link, node->right);
+	} else if (node->right == NULL) {
+		PUBLISH(*link, node->left);
+	} else if (bst->rcu != NULL) {
+		if (!bst_delete_copy(bst, node, link, path, &depth)) {
+			if (ranked) {
+				bst_recount(bst, data, node, true);
+			}
+			return bst->root;
+		}
+	} else {
+		size_t		top	 = depth;
+		node_t**	min_link = &node->right;
+		node_t*		min;
+
+		for (; *min_link != NULL; min_link = &(*min_link)->left) {
+			if (!node_own(bst, min_link)) {
+				if (ranked) {
+					bst_recount(bst, data, node, true);
+				}
+				return bst->root;
+			}
+		}
+		min_link = &node->right;
+
+		if (avl) {
+			path[depth++] = link;
+		}
+		while ((*min_link)->left != NULL) {
+			if (avl) {
+				path[depth++] = min_link;
+			}
+			if (ranked) {
+				(*min_link)->count -= 1;
+			}
+			min_link = &(*min_link)->left;
+		}
+		min		= *min_link;
+		*min_link	= min->right;
+		min->left	= node->left;
+		min->right	= node->right;
+		min->height	= node->height;
+		min->count	= node->count - 1;
+		*link		= min;
+
+		/* The path went through the deleted node. */
+		if (avl && depth > top + 1) {
+			path[top + 1] = &min->right;
+		}
 	}
 
-	int cmp_result = bst->cmp(data, node->data);
+	node_free(bst, node);
+	bst->size -= 1;
+	bst_retrace(bst, path, depth);
+	return bst->root;
+}
+
+/* With BST_CONCURRENT, readers that have passed the deleted node may be on
+ * their way down to its successor, so the successor can not be unlinked in
+ * place. Instead, the path from the right child of `node` down to it is copied
+ * without it, and a copy of the successor on top of that path takes the place
+ * of `node` in a single store. The original path is retired. For BST_AVL, the
+ * links of the new path are recorded in `path`. Returns false, leaving the tree
+ * untouched, if memory ran out. */
+static bool bst_delete_copy(bst_t*	bst,
+			    node_t*	node,
+			    node_t**	link,
+			    node_t**	path[],
+			    size_t*	depth)
+{
+	bool		avl	= bst->mode & BST_AVL;
+	size_t		len	= 0;
+	size_t		made	= 0;
+	node_t*		min;
+	node_t*		succ;
+	node_t*		old;
+	node_t**	tail;
+
+	for (min = node->right; min->left != NULL; min = min->left) {
+		len += 1;
+	}
+	if (!rcu_reserve(bst->rcu, RCU_RETIRE_MAX + len) ||
+	    (succ = node_clone(min)) == NULL) {
+		return false;
+	}
+	succ->left	= node->left;
+	succ->height	= node->height;
+	succ->count	= node->count - 1;
+	tail		= &succ->right;
+	if (avl) {
+		path[(*depth)++] = link;
+	}
 
-	if (cmp_result == 0) {
-		if (node->left == NULL) {
-			node_t* tmp = node->right;
-			node_free(bst, node);
-			return tmp;
-		} else if (node->right == NULL) {
-			node_t* tmp = node->left;
-			node_free(bst, node);
-			return tmp;
+	for (old = node->right; old != min; old = old->left) {
+		node_t* copy = node_clone(old);
+		if (copy == NULL) {
+			for (old = succ->right; made-- > 0; ) {
+				node_t* left = old->left;
+				free(old);
+				old = left;
+			}
+			free(succ);
+			return false;
 		}
-		node_t* tmp = smallest_subnode(node->right);
+		copy->count	-= 1;
+		*tail		= copy;
+		made		+= 1;
+		if (avl) {
+			path[(*depth)++] = tail;
+		}
+		tail		= &copy->left;
+	}
+	*tail = min->right;
+	PUBLISH(*link, succ);
+
+	for (old = node->right; old != min; old = old->left) {
+		rcu_retire(bst->rcu, old, false, false);
+	}
+	rcu_retire(bst->rcu, min, false, false);
+	return true;
+}
 
-		if (bst->type == BST_POINTED) {
-			node->data = tmp->data;
-		} else if (bst->type == BST_COPIED) {
-			memcpy(node->data, tmp->data, bst->elem_size);
+/* Walk back up the links in `path`, restoring the invariants of every subtree
+ * on the way. Stops early once a subtree turns out to have kept its height,
+ * since nothing above it can have changed then. */
+static void bst_retrace(bst_t* bst, node_t** path[], size_t depth)
+{
+	while (depth > 0) {
+		node_t**	link	= path[--depth];
+		int		height	= (*link)->height;
+
+		PUBLISH(*link, node_fix(bst, *link));
+		if ((*link)->height == height) {
+			break;
 		}
+	}
+}
 
-		node->right = bst_delete_recursive(bst, node->right, tmp->data);
-	} else if (cmp_result < 0) {
-		node->left = bst_delete_recursive(bst, node->left, data);
-	} else {
-		node->right = bst_delete_recursive(bst, node->right, data);
+/* Adjust the counts of the nodes on the search path for `data` down to, but not
+ * including, `stop`. Undoes the counting done on the way down by an add or a
+ * delete that turned out to leave the tree unchanged. */
+static void bst_recount(bst_t*		bst,
+			const void*	data,
+			node_t*		stop,
+			bool		increment)
+{
+	node_t* node = bst->root;
+
+	while (node != stop) {
+		if (increment) {
+			STORE_FIELD(node->count, node->count + 1);
+		} else {
+			STORE_FIELD(node->count, node->count - 1);
+		}
+		node = bst->cmp(data, node->data) < 0 ? node->left
+						      : node->right;
 	}
-	return node;
 }
 
 bool bst_contains(bst_t* bst, void* data)
@@ -212,37 +1106,36 @@ bool bst_contains(bst_t* bst, void* data)
 		ERROR(return false,
 			"`data` argument is NULL: nothing to search for.\n");
 	}
-	return bst_contains_recursive(bst, bst->root, data);
-}
 
-bool bst_contains_recursive(bst_t* bst, node_t* node, void* data)
-{
-	int cmp_result = bst->cmp(data, node->data);
-	if (cmp_result == 0) {
-		goto succ;
-	} else if (cmp_result < 0) {
-		if (node->left == NULL) {
-			goto fail;
-		} else {
-			return bst_contains_recursive(bst, node->left, data);
-		}
-	} else {
-		if (node->right == NULL) {
-			goto fail;
-		} else {
-			return bst_contains_recursive(bst, node->right, data);
+	if (bst->mode & BST_NODELESS) {
+		if (!filter_excludes(bst, data) &&
+		    (bst->mode & BST_BTREE ? btree_find(bst, data)
+					   : compact_find(bst, data)) != NULL) {
+			goto succ;
 		}
+		goto fail;
 	}
-succ:	if (bst->print != NULL) {
-		bst->print(data);
-		printf(" exists in the tree.\n");
+
+	unsigned	token = bst_read_begin(bst);
+	bool		found = !filter_excludes(bst, data) &&
+				node_find(bst, data) != NULL;
+
+	bst_read_end(bst, token);
+	if (found) {
+		goto succ;
 	}
-	return true;
-fail:	if (bst->print != NULL) {
+
+fail:
+	if (bst->print != NULL) {
 		bst->print(data);
 		printf(" does not exist in the tree.\n");
 	}
 	return false;
+succ:	if (bst->print != NULL) {
+		bst->print(data);
+		printf(" exists in the tree.\n");
+	}
+	return true;
 }
 
 inline size_t bst_size(bst_t* bst)
@@ -258,34 +1151,73 @@ size_t bst_height(bst_t* bst)
 	if (bst == NULL) {
 		ERROR(return 0, "`bst` argument is NULL.\n");
 	}
-	return bst_height_recursive(bst, bst->root);
-}
+	if (bst->mode & BST_BTREE) {
+		return btree_height(bst->btree);
+	}
+	if (bst->mode & BST_COMPACT) {
+		return compact_height(bst);
+	}
 
-static inline int max(const int a, const int b)
-{
-	return a > b ? a : b;
-}
+	unsigned	token	= bst_read_begin(bst);
+	node_t*		node	= LOAD(bst->root);
+	size_t		height	= 0;
 
-static size_t bst_height_recursive(bst_t* bst, node_t* node)
-{
-	if (node == NULL) {
-		return 0;
-	} else {
-		return 1 + max(	bst_height_recursive(bst, node->left),
-				bst_height_recursive(bst, node->right));
+	if (bst->mode & BST_AVL) {
+		height = (size_t)node_height(node);
+		bst_read_end(bst, token);
+		return height;
+	}
+
+	node_stack_t	stack;
+	size_t		depth;
+	bool		pushed;
+
+	stack_init(&stack);
+	pushed = node == NULL || stack_push(&stack, node, 1);
+	while (pushed && stack_pop(&stack, &node, &depth)) {
+		node_t* left	= LOAD(node->left);
+		node_t* right	= LOAD(node->right);
+		if (depth > height) {
+			height = depth;
+		}
+		pushed	= (left == NULL ||
+			   stack_push(&stack, left, depth + 1)) &&
+			  (right == NULL ||
+			   stack_push(&stack, right, depth + 1));
+	}
+	/* A partial walk would understate the height. */
+	if (!pushed) {
+		height = 0;
 	}
+	stack_free(&stack);
+	bst_read_end(bst, token);
+	return height;
+}
+
+static inline int max(const int a, const int b)
+{
+	return a > b ? a : b;
 }
 
 static void
-bst_execute_preorder_recursive  (bst_t*, node_t*, void (*execute)(void*));
+bst_execute_preorder  (bst_t*, node_t*, void (*execute)(void*));
 
 static void
-bst_execute_inorder_recursive   (bst_t*, node_t*, void (*execute)(void*));
+bst_execute_inorder   (bst_t*, node_t*, void (*execute)(void*));
 
 static void
-bst_execute_postorder_recursive (bst_t*, node_t*, void (*execute)(void*));
+bst_execute_postorder (bst_t*, node_t*, void (*execute)(void*));
+
+#define BST_EXECUTE(ORDER) bst_execute_ ## ORDER
 
-#define BST_EXECUTE(ORDER) bst_execute_ ## ORDER ## _recursive
+typedef struct {
+	void (*execute)(void* data);
+} execute_ctx_t;
+
+static void execute_visit(void* ctx, void* data)
+{
+	((execute_ctx_t*)ctx)->execute(data);
+}
 
 void bst_execute(bst_t*			bst,
 		 void			(*execute)(void* data),
@@ -301,107 +1233,706 @@ void bst_execute(bst_t*			bst,
 	if (order != ORDER_PRE && order != ORDER_IN && order != ORDER_POST) {
 		ERROR(return, "Invalid `order` argument.\n");
 	}
+	if (bst->mode & BST_NODELESS) {
+		execute_ctx_t ctx = { execute };
+		nodeless_walk(bst, order, execute_visit, &ctx);
+		return;
+	}
+
+	unsigned	token	= bst_read_begin(bst);
+	node_t*		root	= LOAD(bst->root);
+
 	switch (order) {
-	case ORDER_PRE:	 BST_EXECUTE(preorder)	(bst, bst->root, execute);break;
-	case ORDER_IN:	 BST_EXECUTE(inorder)	(bst, bst->root, execute);break;
-	case ORDER_POST: BST_EXECUTE(postorder)	(bst, bst->root, execute);break;
+	case ORDER_PRE:	 BST_EXECUTE(preorder)	(bst, root, execute);break;
+	case ORDER_IN:	 BST_EXECUTE(inorder)	(bst, root, execute);break;
+	case ORDER_POST: BST_EXECUTE(postorder)	(bst, root, execute);break;
 	}
+	bst_read_end(bst, token);
 }
 
 static void
-bst_execute_preorder_recursive(	bst_t*	bst,
-				node_t* node,
-				void	(*execute)(void*))
+bst_execute_preorder(	bst_t*	bst,
+			node_t* node,
+			void	(*execute)(void*))
 {
-	if (node == NULL) {
-		return;
+	node_stack_t	stack;
+	size_t		unused;
+
+	(void)bst;
+	stack_init(&stack);
+	if (node != NULL) {
+		stack_push(&stack, node, 0);
+	}
+	while (stack_pop(&stack, &node, &unused)) {
+		node_t* left	= LOAD(node->left);
+		node_t* right	= LOAD(node->right);
+		execute(node->data);
+		if (right != NULL) {
+			stack_push(&stack, right, 0);
+		}
+		if (left != NULL) {
+			stack_push(&stack, left, 0);
+		}
 	}
-	execute(node->data);
-	bst_execute_preorder_recursive(bst, node->left, execute);
-	bst_execute_preorder_recursive(bst, node->right, execute);
+	stack_free(&stack);
 }
 
 static void
-bst_execute_inorder_recursive(	bst_t*	bst,
-				node_t*	node,
-				void	(*execute)(void*))
+bst_execute_inorder(	bst_t*	bst,
+			node_t*	node,
+			void	(*execute)(void*))
 {
-	if (node == NULL) {
-		return;
+	node_stack_t	stack;
+	size_t		unused;
+
+	(void)bst;
+	stack_init(&stack);
+	for (;;) {
+		while (node != NULL) {
+			stack_push(&stack, node, 0);
+			node = LOAD(node->left);
+		}
+		if (!stack_pop(&stack, &node, &unused)) {
+			break;
+		}
+		execute(node->data);
+		node = LOAD(node->right);
 	}
-	bst_execute_preorder_recursive(bst, node->left, execute);
-	execute(node->data);
-	bst_execute_preorder_recursive(bst, node->right, execute);
+	stack_free(&stack);
 }
 
+/* Every node is pushed twice: first to schedule its children (state 0), then
+ * to be visited once they are done (state 1). */
 static void
-bst_execute_postorder_recursive(bst_t*	bst,
-				node_t*	node,
-				void	(*execute)(void*))
+bst_execute_postorder(	bst_t*	bst,
+			node_t*	node,
+			void	(*execute)(void*))
 {
-	if (node == NULL) {
+	node_stack_t	stack;
+	size_t		state;
+
+	(void)bst;
+	stack_init(&stack);
+	if (node != NULL) {
+		stack_push(&stack, node, 0);
+	}
+	while (stack_pop(&stack, &node, &state)) {
+		if (state == 1) {
+			execute(node->data);
+			continue;
+		}
+		node_t* left	= LOAD(node->left);
+		node_t* right	= LOAD(node->right);
+		stack_push(&stack, node, 1);
+		if (right != NULL) {
+			stack_push(&stack, right, 0);
+		}
+		if (left != NULL) {
+			stack_push(&stack, left, 0);
+		}
+	}
+	stack_free(&stack);
+}
+
+/* The results of `execute` for one piece, kept until they can be emitted in
+ * order. `done` is false if the buffer could not grow: the calling thread then
+ * finishes the piece from element `len` on. */
+typedef struct {
+	void**	results;
+	size_t	len;
+	size_t	cap;
+	bool	done;
+} chunk_t;
+
+typedef struct {
+	piece_t*	pieces;
+	chunk_t*	chunks;		/* NULL unless results are emitted. */
+	void*		(*execute)(void* data);
+	void		(*emit)(void* result);
+} parallel_t;
+
+/* Call `visit(ctx, data)` on the elements of `piece` in order, skipping the
+ * first `skip` of them, until it returns false. Return whether it never did. */
+static bool piece_walk(piece_t* piece, size_t skip,
+		       bool (*visit)(void* ctx, void* data), void* ctx)
+{
+	node_stack_t	stack;
+	node_t*		node	= piece->node;
+	size_t		unused;
+	bool		done	= true;
+
+	if (!piece->subtree) {
+		return skip > 0 || visit(ctx, node->data);
+	}
+	stack_init(&stack);
+	for (;;) {
+		while (node != NULL) {
+			stack_push(&stack, node, 0);
+			node = LOAD(node->left);
+		}
+		if (!stack_pop(&stack, &node, &unused)) {
+			break;
+		}
+		if (skip > 0) {
+			skip -= 1;
+		} else if (!visit(ctx, node->data)) {
+			done = false;
+			break;
+		}
+		node = LOAD(node->right);
+	}
+	stack_free(&stack);
+	return done;
+}
+
+/* Call `execute` on `data` and, in ordered mode, emit the result. */
+static bool parallel_emit(void* ctx, void* data)
+{
+	parallel_t*	parallel = ctx;
+	void*		result	 = parallel->execute(data);
+
+	if (parallel->emit != NULL) {
+		parallel->emit(result);
+	}
+	return true;
+}
+
+static bool parallel_buffer(void* ctx, void* data)
+{
+	chunk_t* chunk = ctx;
+
+	if (chunk->len == chunk->cap) {
+		size_t	cap	= chunk->cap == 0 ? 64 : chunk->cap * 2;
+		void**	results	= realloc(chunk->results,
+					  cap * sizeof *results);
+		if (results == NULL) {
+			return false;
+		}
+		chunk->results	= results;
+		chunk->cap	= cap;
+	}
+	chunk->results[chunk->len++] = data;
+	return true;
+}
+
+/* Buffers `data` rather than its result, so that `execute` is not called on
+ * an element for which there is no room. */
+static void parallel_run(void* ctx, size_t task)
+{
+	parallel_t*	parallel = ctx;
+	piece_t*	piece	 = &parallel->pieces[task];
+	chunk_t*	chunk;
+
+	if (parallel->chunks == NULL) {
+		piece_walk(piece, 0, parallel_emit, parallel);
+		return;
+	}
+	chunk		= &parallel->chunks[task];
+	chunk->done	= piece_walk(piece, 0, parallel_buffer, chunk);
+	for (size_t i = 0; i < chunk->len; ++i) {
+		chunk->results[i] = parallel->execute(chunk->results[i]);
+	}
+}
+
+static void parallel_emit_walk(void* ctx, void* data)
+{
+	parallel_emit(ctx, data);
+}
+
+void bst_execute_parallel(bst_t*	bst,
+			  void*		(*execute)(void* data),
+			  void		(*emit)(void* result),
+			  unsigned	threads)
+{
+	if (bst == NULL) {
+		ERROR(return, "`bst` argument is NULL.\n");
+	}
+	if (execute == NULL) {
+		ERROR(return,	"`execute` argument is NULL: no function to "
+				"execute.\n");
+	}
+
+	parallel_t	parallel = { NULL, NULL, execute, emit };
+	piece_t		whole;
+	size_t		count	 = 0;
+
+	if (bst->mode & BST_NODELESS) {
+		nodeless_walk(bst, ORDER_IN, parallel_emit_walk, &parallel);
+		return;
+	}
+	unsigned token = bst_read_begin(bst);
+
+	whole = (piece_t){ LOAD(bst->root), true, 0 };
+	if (threads > 1 && whole.node != NULL) {
+		parallel.pieces = pool_pieces(whole.node,
+					      (size_t)threads * POOL_TASKS,
+					      &count);
+	}
+	if (parallel.pieces != NULL && emit != NULL) {
+		parallel.chunks = calloc(count, sizeof *parallel.chunks);
+		if (parallel.chunks == NULL) {
+			free(parallel.pieces);
+			parallel.pieces = NULL;
+		}
+	}
+	if (parallel.pieces == NULL) {
+		if (whole.node != NULL) {
+			piece_walk(&whole, 0, parallel_emit, &parallel);
+		}
+		bst_read_end(bst, token);
 		return;
 	}
-	bst_execute_preorder_recursive(bst, node->left, execute);
-	bst_execute_preorder_recursive(bst, node->right, execute);
-	execute(node->data);
+
+	pool_run(threads, count, parallel_run, &parallel);
+	for (size_t i = 0; parallel.chunks != NULL && i < count; ++i) {
+		chunk_t* chunk = &parallel.chunks[i];
+		for (size_t j = 0; j < chunk->len; ++j) {
+			emit(chunk->results[j]);
+		}
+		if (!chunk->done) {
+			piece_walk(&parallel.pieces[i], chunk->len,
+				   parallel_emit, &parallel);
+		}
+		free(chunk->results);
+	}
+	bst_read_end(bst, token);
+	free(parallel.chunks);
+	free(parallel.pieces);
+}
+
+typedef struct {
+	bst_t*	bst;
+	bool	failed;
+} add_ctx_t;
+
+static void add_visit(void* ctx, void* data)
+{
+	add_ctx_t*	add = ctx;
+	bst_t*		bst = add->bst;
+	bool		added;
+
+	if (!add->failed && bst_insert(bst, data, (char*)data +
+				       bst->value_offset, false,
+				       &added) == NULL) {
+		add->failed = true;
+	}
 }
 
 bst_t* bst_balanced(bst_t* bst)
 {
-	if (bst == NULL || bst->root == NULL) {
+	return bst_balanced_parallel(bst, 1);
+}
+
+bst_t* bst_balanced_parallel(bst_t* bst, unsigned threads)
+{
+	if (bst == NULL || bst->size == 0) {
 		printf("Nothing to balance.\n");
 		return NULL;
 	}
+	/* A B-tree is always balanced; this just makes a copy. */
+	if (bst->mode & BST_BTREE) {
+		add_ctx_t add = { bst_new_like(bst), false };
+		if (add.bst == NULL) {
+			return NULL;
+		}
+		btree_walk(bst->btree, ORDER_IN, add_visit, &add);
+		if (add.failed) {
+			btree_discard(add.bst);
+			bst_free(add.bst);
+			return NULL;
+		}
+		return add.bst;
+	}
+	if (bst->mode & BST_COMPACT) {
+		return compact_balanced(bst);
+	}
 
-	void*	arr[bst->size];
-	int	last_index;
+	void**	arr;
+	size_t	size;
 	bst_t*	new_bst;
 
-	last_index	= bst_to_array(bst, bst->root, arr, 0) - 1;
+	/* With BST_CONCURRENT, writers are held off until the copy is built:
+	 * the elements are only copied into the new nodes then, and a delete
+	 * could free them before. */
+	if (!rcu_write_begin(bst, 0)) {
+		return NULL;
+	}
+
+	/* Heap-allocated; a VLA of `bst->size` pointers overflows the stack
+	 * for large trees. */
+	arr = malloc(bst->size * sizeof *arr);
+	if (arr == NULL) {
+		rcu_write_end(bst);
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+
+	if (threads > 1) {
+		size = rebuild_flatten(bst, arr, threads);
+	} else {
+		size = bst_to_array(bst, bst->root, arr);
+	}
 
-	new_bst		= bst_new(bst->type,
-				  bst->elem_size,
-				  bst->cmp,
-				  bst->data_free,
-				  bst->print);
+	if ((new_bst = bst_new_like(bst)) == NULL) {
+		rcu_write_end(bst);
+		free(arr);
+		return NULL;
+	}
 
-	new_bst->root		= bst_build_tree(bst, arr, 0, last_index);
-	new_bst->size		= bst->size;
+	if (!rebuild_tree(new_bst, arr, size, threads > 1 ? threads : 1)) {
+		rcu_write_end(bst);
+		free(arr);
+		bst_free(new_bst);
+		return NULL;
+	}
+	rcu_write_end(bst);
+	new_bst->size		= size;
 	new_bst->cmp		= bst->cmp;
 	new_bst->data_free	= bst->data_free;
 	new_bst->print		= bst->print;
+	STATS_REBUILT(new_bst);
 
+	free(arr);
 	return new_bst;
 }
 
-static int
-bst_to_array(	bst_t*	bst,
-		node_t*	node,
-		void*	arr[],
-		int	index)
+bst_t* bst_snapshot(bst_t* bst)
+{
+	if (bst == NULL) {
+		ERROR(return NULL, "`bst` argument is NULL.\n");
+	}
+	if (!(bst->mode & BST_PERSISTENT)) {
+		ERROR(return NULL, "`bst` is not BST_PERSISTENT.\n");
+	}
+
+	bst_t* snapshot = bst_new_like(bst);
+
+	if (snapshot == NULL) {
+		return NULL;
+	}
+	if (bst->root != NULL) {
+		__atomic_add_fetch(&bst->root->refs, 1, __ATOMIC_RELAXED);
+	}
+	snapshot->root = bst->root;
+	snapshot->size = bst->size;
+#ifdef BST_STATS
+	snapshot->stats.height		= bst->stats.height;
+	snapshot->stats.max_height	= bst->stats.max_height;
+#endif
+	return snapshot;
+}
+
+static void	bst_balance_concurrent	(bst_t*);
+static void	bst_balance_persistent	(bst_t*);
+static void	bst_tree_to_vine	(node_t* pseudo_root);
+static void	bst_vine_to_tree	(node_t* pseudo_root, size_t size);
+static void	bst_fix_recursive	(bst_t*, node_t*);
+
+/* Day-Stout-Warren: the tree is first flattened into a right-leaning "vine" by
+ * right rotations, and then folded back into a complete tree by repeated left
+ * rotations along the vine. Both phases reuse the existing nodes and only need
+ * a pseudo-root on the stack. */
+void bst_balance(bst_t** bst)
+{
+	if (bst == NULL || *bst == NULL) {
+		ERROR(return, "`bst` argument is NULL: nothing to balance.\n");
+	}
+	if ((*bst)->mode & BST_BTREE) {
+		return;
+	}
+	if ((*bst)->mode & BST_COMPACT) {
+		compact_rebuild(*bst);
+		return;
+	}
+	if ((*bst)->rcu != NULL) {
+		bst_balance_concurrent(*bst);
+		return;
+	}
+	if ((*bst)->mode & BST_PERSISTENT) {
+		bst_balance_persistent(*bst);
+		return;
+	}
+
+	node_t pseudo_root = { .data = NULL, .left = NULL, .right = NULL };
+
+	pseudo_root.right = (*bst)->root;
+	bst_tree_to_vine(&pseudo_root);
+	bst_vine_to_tree(&pseudo_root, (*bst)->size);
+	(*bst)->root = pseudo_root.right;
+
+	/* The result has logarithmic height, so recursing here is safe. */
+	if ((*bst)->mode & (BST_AVL | BST_RANKED)) {
+		bst_fix_recursive(*bst, (*bst)->root);
+	}
+	STATS_ADD(*bst, rebuilds, 1);
+	STATS_REBUILT(*bst);
+}
+
+/* Readers may be walking the nodes, so instead of relinking them, a balanced
+ * copy of the node structure is built and published in one step. The copies
+ * share the data of the old nodes, which are freed once no reader can see
+ * them anymore. */
+static void bst_balance_concurrent(bst_t* bst)
+{
+	void**	arr;
+	node_t*	old;
+	size_t	size;
+
+	if (!rcu_write_begin(bst, 1)) {
+		return;
+	}
+	size	= bst->size;
+	arr	= malloc(size * sizeof *arr);
+	if (arr == NULL) {
+		rcu_write_end(bst);
+		ERROR(return, MALLOC_FAIL);
+	}
+	bst_to_array(bst, bst->root, arr);
+	for (size_t i = 0; i < size; ++i) {
+		node_t* node = malloc(sizeof *node);
+		if (node == NULL) {
+			while (i-- > 0) {
+				free(arr[i]);
+			}
+			free(arr);
+			rcu_write_end(bst);
+			ERROR(return, MALLOC_FAIL);
+		}
+		node->data	= arr[i];
+		node->height	= 1;
+		node->count	= 1;
+		arr[i]		= node;
+	}
+
+	old = bst->root;
+	PUBLISH(bst->root, bst_link_tree(bst, arr, 0, size));
+	if (old != NULL) {
+		rcu_retire(bst->rcu, old, false, true);
+	}
+	STATS_ADD(bst, rebuilds, 1);
+	STATS_REBUILT(bst);
+	free(arr);
+	rcu_write_end(bst);
+}
+
+/* The nodes may be shared with other trees, so the balanced tree is built from
+ * new nodes, and the old ones are released. */
+static void bst_balance_persistent(bst_t* bst)
+{
+	void**	arr;
+	node_t*	old	= bst->root;
+
+	if (old == NULL) {
+		return;
+	}
+	if ((arr = malloc(bst->size * sizeof *arr)) == NULL) {
+		ERROR(return, MALLOC_FAIL);
+	}
+	bst_to_array(bst, old, arr);
+	bst->root = NULL;
+	if (rebuild_tree(bst, arr, bst->size, 1)) {
+		node_put(bst, old);
+		STATS_ADD(bst, rebuilds, 1);
+		STATS_REBUILT(bst);
+	} else {
+		bst->root = old;
+	}
+	free(arr);
+}
+
+static void bst_tree_to_vine(node_t* pseudo_root)
+{
+	node_t* tail = pseudo_root;
+	node_t* rest = tail->right;
+
+	while (rest != NULL) {
+		if (rest->left == NULL) {
+			tail = rest;
+			rest = rest->right;
+		} else {
+			node_t* tmp	= rest->left;
+			rest->left	= tmp->right;
+			tmp->right	= rest;
+			rest		= tmp;
+			tail->right	= tmp;
+		}
+	}
+}
+
+static void bst_compress(node_t* pseudo_root, size_t count)
+{
+	node_t* scanner = pseudo_root;
+
+	for (size_t i = 0; i < count; ++i) {
+		node_t* child	= scanner->right;
+		scanner->right	= child->right;
+		scanner		= scanner->right;
+		child->right	= scanner->left;
+		scanner->left	= child;
+	}
+}
+
+static void bst_vine_to_tree(node_t* pseudo_root, size_t size)
+{
+	size_t full = 1;
+
+	while (full * 2 <= size + 1) {
+		full *= 2;
+	}
+	full -= 1;
+
+	/* Nodes that do not fit into the largest complete tree become the
+	 * bottom level. */
+	bst_compress(pseudo_root, size - full);
+	for (size = full; size > 1; size /= 2) {
+		bst_compress(pseudo_root, size / 2);
+	}
+}
+
+static void bst_fix_recursive(bst_t* bst, node_t* node)
 {
 	if (node == NULL) {
-		return index;
+		return;
+	}
+	bst_fix_recursive(bst, node->left);
+	bst_fix_recursive(bst, node->right);
+	node_fix(bst, node);
+}
+
+static bool bst_fill(bst_t* bst, void* base, size_t count, unsigned threads);
+
+bool bst_from_array(bst_t* bst, void* base, size_t count, unsigned threads)
+{
+	if (bst == NULL) {
+		ERROR(return false,
+			"`bst` argument is NULL: nothing to build.\n");
+	}
+	if (base == NULL && count > 0) {
+		ERROR(return false,
+			"`base` argument is NULL: nothing to add.\n");
+	}
+	if (bst->value_offset != 0) {
+		ERROR(return false, "`bst` is a map: use `bst_upsert`.\n");
+	}
+	if (!rcu_write_begin(bst, 0)) {
+		return false;
+	}
+
+	bool filled = bst_fill(bst, base, count, threads);
+
+	if (filled && bst->filter != NULL) {
+		filled = filter_rebuild(bst);
+	}
+	rcu_write_end(bst);
+	return filled;
+}
+
+static bool bst_fill(bst_t* bst, void* base, size_t count, unsigned threads)
+{
+	if (bst->size != 0) {
+		ERROR(return false, "`bst` must be empty.\n");
+	}
+	if (count == 0) {
+		return true;
+	}
+
+	void**	arr = malloc(count * sizeof *arr);
+	size_t	unique;
+
+	if (arr == NULL) {
+		ERROR(return false, MALLOC_FAIL);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		arr[i] = (char*)base + i * bst->elem_size;
+	}
+	if (!sort_pointers(arr, count, bst->cmp, threads)) {
+		free(arr);
+		return false;
+	}
+
+	/* The sort is stable, so the first of several equal elements wins,
+	 * just like with repeated calls to `bst_add`. */
+	unique = 1;
+	for (size_t i = 1; i < count; ++i) {
+		if (bst->cmp(arr[i], arr[unique - 1]) != 0) {
+			arr[unique++] = arr[i];
+		}
+	}
+
+	if (bst->mode & BST_BTREE) {
+		for (size_t i = 0; i < unique; ++i) {
+			bool added;
+			if (btree_insert(bst, arr[i], NULL, false,
+					 &added) == NULL) {
+				btree_discard(bst);
+				free(arr);
+				return false;
+			}
+		}
+		free(arr);
+		return true;
+	}
+	if (bst->mode & BST_COMPACT) {
+		bool built = compact_build(bst, arr, unique, true);
+		if (built) {
+			bst->size = unique;
+			STATS_REBUILT(bst);
+		}
+		free(arr);
+		return built;
+	}
+	if (!rebuild_tree(bst, arr, unique, 1)) {
+		free(arr);
+		return false;
+	}
+	bst->size = unique;
+	STATS_REBUILT(bst);
+
+	free(arr);
+	return true;
+}
+
+/* Store the data of the subtree rooted at `node` in `arr`, in order, and return
+ * the number of elements stored. */
+static size_t bst_to_array(bst_t* bst, node_t* node, void* arr[])
+{
+	node_stack_t	stack;
+	size_t		index = 0;
+	size_t		unused;
+
+	(void)bst;
+	stack_init(&stack);
+	for (;;) {
+		while (node != NULL) {
+			stack_push(&stack, node, 0);
+			node = node->left;
+		}
+		if (!stack_pop(&stack, &node, &unused)) {
+			break;
+		}
+		arr[index++] = node->data;
+		node = node->right;
 	}
-	index	   = bst_to_array(bst, node->left, arr, index);
-	arr[index] = node->data;
-	index	   = bst_to_array(bst, node->right, arr, index + 1);
+	stack_free(&stack);
 	return index;
 }
 
-static node_t* bst_build_tree(bst_t* bst, void* arr[], int first, int last)
+/* Link the nodes in [first, end) of `nodes`, which are in order, into a
+ * balanced tree. */
+static node_t* bst_link_tree(bst_t*	bst,
+			     void*	nodes[],
+			     size_t	first,
+			     size_t	end)
 {
-	if (first > last) {
+	if (first >= end) {
 		return NULL;
 	}
-	int		mid;
+	size_t		mid;
 	node_t*		mid_node;
-	mid		= (first + last) / 2;
-	mid_node	= node_new(bst, arr[mid]);
-	mid_node->left	= bst_build_tree(bst, arr, first, mid - 1);
-	mid_node->right	= bst_build_tree(bst, arr, mid + 1, last);
-	return mid_node;
+	mid		= first + (end - first - 1) / 2;
+	mid_node	= nodes[mid];
+	mid_node->left	= bst_link_tree(bst, nodes, first, mid);
+	mid_node->right	= bst_link_tree(bst, nodes, mid + 1, end);
+	return node_fix(bst, mid_node);
 }
 
 void bst_print(bst_t* bst, void (*print)(void* data))
@@ -414,6 +1945,14 @@ void bst_print(bst_t* bst, void (*print)(void* data))
 				"can not print values.\n");
 	}
 	printf("Printing the BST:\n");
+	if (bst->mode & BST_BTREE) {
+		btree_print(bst->btree, print, 0);
+		return;
+	}
+	if (bst->mode & BST_COMPACT) {
+		compact_print(bst, bst->compact.root, print, 0);
+		return;
+	}
 	bst_print_recursive(bst, bst->root, print, 0);
 }
 
@@ -441,53 +1980,4844 @@ bst_print_recursive(bst_t*	bst,
 
 
 /*==============================================================================
-	NODE
+	ORDER STATISTICS
 ==============================================================================*/
 
-static node_t* node_new(bst_t* bst, void* data)
+/* Return the number of elements smaller than `key`, or not greater than `key`
+ * if `inclusive` is true. */
+static size_t bst_rank_bound(bst_t* bst, const void* key, bool inclusive)
 {
-	node_t*	node = malloc(sizeof *node);
-	
-	if (node == NULL) {
-		ERROR(return NULL, MALLOC_FAIL);
+	node_t*	node = LOAD(bst->root);
+	size_t	rank = 0;
+
+	while (node != NULL) {
+		int cmp_result = bst->cmp(key, node->data);
+		if (cmp_result > 0 || (cmp_result == 0 && inclusive)) {
+			rank += node_count(LOAD(node->left)) + 1;
+			node  = LOAD(node->right);
+		} else {
+			node  = LOAD(node->left);
+		}
 	}
+	return rank;
+}
 
+size_t bst_rank(bst_t* bst, const void* key)
+{
+	if (bst == NULL) {
+		ERROR(return 0, "`bst` argument is NULL.\n");
+	}
+	if (key == NULL) {
+		ERROR(return 0, "`key` argument is NULL.\n");
+	}
+	if (!(bst->mode & BST_RANKED)) {
+		ERROR(return 0, "`bst` was not created with BST_RANKED.\n");
+	}
+
+	unsigned	token	= bst_read_begin(bst);
+	size_t		rank	= bst_rank_bound(bst, key, false);
+
+	bst_read_end(bst, token);
+	return rank;
+}
+
+void* bst_select(bst_t* bst, size_t k)
+{
+	if (bst == NULL) {
+		ERROR(return NULL, "`bst` argument is NULL.\n");
+	}
+	if (!(bst->mode & BST_RANKED)) {
+		ERROR(return NULL,
+			"`bst` was not created with BST_RANKED.\n");
+	}
+
+	unsigned	token	= bst_read_begin(bst);
+	node_t*		node	= LOAD(bst->root);
+
+	while (node != NULL) {
+		node_t*	child	= LOAD(node->left);
+		size_t	left	= node_count(child);
+		if (k < left) {
+			node = child;
+		} else if (k == left) {
+			break;
+		} else {
+			k   -= left + 1;
+			node = LOAD(node->right);
+		}
+	}
+	bst_read_end(bst, token);
+	return node == NULL ? NULL : node->data;
+}
+
+size_t bst_count_range(bst_t* bst, const void* lo, const void* hi)
+{
+	if (bst == NULL) {
+		ERROR(return 0, "`bst` argument is NULL.\n");
+	}
+	if (lo == NULL || hi == NULL) {
+		ERROR(return 0, "`lo` and `hi` may not be NULL.\n");
+	}
+	if (!(bst->mode & BST_RANKED)) {
+		ERROR(return 0, "`bst` was not created with BST_RANKED.\n");
+	}
+	if (bst->cmp(lo, hi) > 0) {
+		return 0;
+	}
+
+	unsigned	token	= bst_read_begin(bst);
+	size_t		count	= bst_rank_bound(bst, hi, true) -
+				  bst_rank_bound(bst, lo, false);
+
+	bst_read_end(bst, token);
+	return count;
+}
+
+
+
+/*==============================================================================
+	SET OPERATIONS
+==============================================================================*/
+
+typedef enum { SET_UNION, SET_INTERSECTION, SET_DIFFERENCE, } set_op_t;
+
+/* The merge, cut into ranges that are merged independently: range `t` takes
+ * the elements from `a_cuts[t]` and `b_cuts[t]` on, and is written from
+ * `a_cuts[t] + b_cuts[t]` on, which leaves room for all of them. */
+typedef struct {
+	bst_t*		bst;
+	set_op_t	op;
+	void**		a;
+	void**		b;
+	void**		out;
+	size_t*		a_cuts;
+	size_t*		b_cuts;
+	size_t*		lens;		/* Written by each range. */
+} set_merge_t;
+
+static void array_visit(void* ctx, void* data)
+{
+	void*** end = ctx;
+
+	*(*end)++ = data;
+}
+
+/* Return the elements of `bst` in order in a new array, flattened on up to
+ * `threads` threads, and set `size` to their number. Writers must be held off
+ * for as long as the elements are used. */
+static void** set_flatten(bst_t* bst, size_t* size, unsigned threads)
+{
+	void** arr;
+
+	/* One more, so that an empty tree gives an array, too. */
+	if ((arr = malloc((bst->size + 1) * sizeof *arr)) == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	if (bst->mode & BST_NODELESS) {
+		void** end = arr;
+		nodeless_walk(bst, ORDER_IN, array_visit, &end);
+		*size = (size_t)(end - arr);
+	} else if (threads > 1) {
+		*size = rebuild_flatten(bst, arr, threads);
+	} else {
+		*size = bst_to_array(bst, bst->root, arr);
+	}
+	return arr;
+}
+
+/* Merge the sorted arrays `a` and `b` into `out` as `op` says, keeping the
+ * element of `a` where both have a key, and return the number written. */
+static size_t set_merge(bst_t*		bst,
+			set_op_t	op,
+			void*		a[],
+			size_t		a_len,
+			void*		b[],
+			size_t		b_len,
+			void*		out[])
+{
+	size_t i = 0, j = 0, len = 0;
+
+	while (i < a_len && j < b_len) {
+		int cmp_result = key_cmp(bst, a[i], b[j]);
+		if (cmp_result < 0) {
+			if (op != SET_INTERSECTION) {
+				out[len++] = a[i];
+			}
+			i += 1;
+		} else if (cmp_result > 0) {
+			if (op == SET_UNION) {
+				out[len++] = b[j];
+			}
+			j += 1;
+		} else {
+			if (op != SET_DIFFERENCE) {
+				out[len++] = a[i];
+			}
+			i += 1;
+			j += 1;
+		}
+	}
+	if (op != SET_INTERSECTION) {
+		memcpy(out + len, a + i, (a_len - i) * sizeof *out);
+		len += a_len - i;
+	}
+	if (op == SET_UNION) {
+		memcpy(out + len, b + j, (b_len - j) * sizeof *out);
+		len += b_len - j;
+	}
+	return len;
+}
+
+static void set_merge_run(void* ctx, size_t task)
+{
+	set_merge_t*	merge	= ctx;
+	size_t		a_first	= merge->a_cuts[task];
+	size_t		b_first	= merge->b_cuts[task];
+
+	merge->lens[task] = set_merge(merge->bst, merge->op,
+				      merge->a + a_first,
+				      merge->a_cuts[task + 1] - a_first,
+				      merge->b + b_first,
+				      merge->b_cuts[task + 1] - b_first,
+				      merge->out + a_first + b_first);
+}
+
+/* The index of the first of the `len` elements of `arr` not less than `key`. */
+static size_t set_lower_bound(bst_t* bst, void* arr[], size_t len,
+			      const void* key)
+{
+	size_t lo = 0, hi = len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (key_cmp(bst, arr[mid], key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Like `set_merge`, on up to `threads` threads. The larger array is cut into
+ * equal ranges, and the other one where the first key of each range would go,
+ * so that equal keys end up in the same range. The ranges are merged in
+ * parallel, and then moved together. */
+static size_t set_merge_parallel(bst_t*		bst,
+				 set_op_t	op,
+				 void*		a[],
+				 size_t		a_len,
+				 void*		b[],
+				 size_t		b_len,
+				 void*		out[],
+				 unsigned	threads)
+{
+	size_t	count		= (size_t)threads * POOL_TASKS;
+	bool	by_a		= a_len >= b_len;
+	void**	big		= by_a ? a : b;
+	void**	small		= by_a ? b : a;
+	size_t	big_len		= by_a ? a_len : b_len;
+	size_t	small_len	= by_a ? b_len : a_len;
+	size_t*	cuts		= malloc((3 * count + 2) * sizeof *cuts);
+	size_t	len		= 0;
+
+	if (cuts == NULL || big_len < count) {
+		free(cuts);
+		return set_merge(bst, op, a, a_len, b, b_len, out);
+	}
+
+	set_merge_t	merge		= { bst, op, a, b, out, cuts,
+					    cuts + count + 1,
+					    cuts + 2 * count + 2 };
+	size_t*		big_cuts	= by_a ? merge.a_cuts : merge.b_cuts;
+	size_t*		small_cuts	= by_a ? merge.b_cuts : merge.a_cuts;
+
+	big_cuts[0]		= 0;
+	small_cuts[0]		= 0;
+	big_cuts[count]		= big_len;
+	small_cuts[count]	= small_len;
+	for (size_t t = 1; t < count; ++t) {
+		big_cuts[t]	= big_len * t / count;
+		small_cuts[t]	= set_lower_bound(bst, small, small_len,
+						  big[big_cuts[t]]);
+	}
+	pool_run(threads, count, set_merge_run, &merge);
+
+	for (size_t t = 0; t < count; ++t) {
+		memmove(out + len, out + merge.a_cuts[t] + merge.b_cuts[t],
+			merge.lens[t] * sizeof *out);
+		len += merge.lens[t];
+	}
+	free(cuts);
+	return len;
+}
+
+/* Free what `set_build` allocated, and return NULL. */
+static bst_t* set_fail(void** a, void** b, void** out, bst_t* result)
+{
+	free(a);
+	free(b);
+	free(out);
+	if (result != NULL) {
+		bst_free(result);
+	}
+	return NULL;
+}
+
+/* Take the writer locks of `a` and `b` (once if they are the same tree) in
+ * address order, so that two calls with the trees swapped can not deadlock. */
+static bool set_write_begin(bst_t* a, bst_t* b)
+{
+	bst_t* first	= (uintptr_t)a < (uintptr_t)b ? a : b;
+	bst_t* second	= first == a ? b : a;
+
+	if (!rcu_write_begin(first, 0)) {
+		return false;
+	}
+	if (second != first && !rcu_write_begin(second, 0)) {
+		rcu_write_end(first);
+		return false;
+	}
+	return true;
+}
+
+static void set_write_end(bst_t* a, bst_t* b)
+{
+	rcu_write_end(a);
+	if (b != a) {
+		rcu_write_end(b);
+	}
+}
+
+/* Build the result of `set_combine`, with the writers of `a` and `b` held off:
+ * until it is built, the elements of the result are those of the trees. */
+static bst_t* set_build(bst_t* a, bst_t* b, set_op_t op, unsigned threads)
+{
+	size_t	a_len	= 0;
+	size_t	b_len	= 0;
+	void**	a_arr	= set_flatten(a, &a_len, threads);
+	void**	b_arr	= NULL;
+	void**	out	= NULL;
+	bst_t*	result	= NULL;
+	size_t	len;
+
+	if (a_arr == NULL) {
+		return NULL;
+	}
+	/* Nothing can be kept from `b` unless both are. */
+	if ((op == SET_UNION || a_len > 0) &&
+	    (b_arr = set_flatten(b, &b_len, threads)) == NULL) {
+		return set_fail(a_arr, b_arr, out, result);
+	}
+	if ((out = malloc((a_len + b_len + 1) * sizeof *out)) == NULL) {
+		ERROR(return set_fail(a_arr, b_arr, out, result), MALLOC_FAIL);
+	}
+	if ((result = bst_new_like(a)) == NULL) {
+		return set_fail(a_arr, b_arr, out, result);
+	}
+
+	if (threads > 1) {
+		len = set_merge_parallel(a, op, a_arr, a_len, b_arr, b_len,
+					 out, threads);
+	} else {
+		len = set_merge(a, op, a_arr, a_len, b_arr, b_len, out);
+	}
+	free(a_arr);
+	free(b_arr);
+	a_arr = b_arr = NULL;
+
+	if (result->mode & BST_BTREE) {
+		for (size_t i = 0; i < len; ++i) {
+			bool added;
+			if (btree_insert(result, out[i], (char*)out[i] +
+					 result->value_offset, false,
+					 &added) == NULL) {
+				return set_fail(a_arr, b_arr, out, result);
+			}
+		}
+	} else if (result->mode & BST_COMPACT) {
+		if (!compact_build(result, out, len, true)) {
+			return set_fail(a_arr, b_arr, out, result);
+		}
+		result->size = len;
+		STATS_REBUILT(result);
+	} else if (len > 0) {
+		if (!rebuild_tree(result, out, len, threads > 1 ? threads
+								 : 1)) {
+			return set_fail(a_arr, b_arr, out, result);
+		}
+		result->size = len;
+		STATS_REBUILT(result);
+	}
+	free(out);
+	return result;
+}
+
+static bst_t* set_combine(bst_t* a, bst_t* b, set_op_t op, unsigned threads)
+{
+	if (a == NULL || b == NULL) {
+		ERROR(return NULL, "`a` or `b` argument is NULL.\n");
+	}
+	if (a->cmp != b->cmp || a->elem_size != b->elem_size ||
+	    a->key_size != b->key_size) {
+		ERROR(return NULL, "`a` and `b` hold different elements.\n");
+	}
+
+	bst_t* result;
+
+	if (!set_write_begin(a, b)) {
+		return NULL;
+	}
+	result = set_build(a, b, op, threads);
+	set_write_end(a, b);
+	return result;
+}
+
+bst_t* bst_union(bst_t* a, bst_t* b, unsigned threads)
+{
+	return set_combine(a, b, SET_UNION, threads);
+}
+
+bst_t* bst_intersection(bst_t* a, bst_t* b, unsigned threads)
+{
+	return set_combine(a, b, SET_INTERSECTION, threads);
+}
+
+bst_t* bst_difference(bst_t* a, bst_t* b, unsigned threads)
+{
+	return set_combine(a, b, SET_DIFFERENCE, threads);
+}
+
+
+
+/*==============================================================================
+	SPLIT AND JOIN
+==============================================================================*/
+
+/* Modes whose nodes can not be moved to another tree as they are. */
+#define SPLIT_UNSUPPORTED	(BST_SLAB | BST_NODELESS |		\
+				 BST_CONCURRENT | BST_PERSISTENT)
+
+/* Join the trees `left` and `right`, whose keys are all smaller than those of
+ * `right`, with the node `mid` in between, and return the result. For BST_AVL
+ * (Adams' join), `mid` goes down the spine of the taller tree to where the
+ * heights differ by at most one, and the spine is rebalanced on the way back,
+ * in O(difference of the heights); otherwise it simply becomes the root. */
+static node_t* tree_join(bst_t* bst, node_t* left, node_t* mid, node_t* right)
+{
+	if (bst->mode & BST_AVL) {
+		if (node_height(left) > node_height(right) + 1) {
+			left->right = tree_join(bst, left->right, mid, right);
+			return node_fix(bst, left);
+		}
+		if (node_height(right) > node_height(left) + 1) {
+			right->left = tree_join(bst, left, mid, right->left);
+			return node_fix(bst, right);
+		}
+	}
+	mid->left	= left;
+	mid->right	= right;
+	return node_fix(bst, mid);
+}
+
+/* Remove the smallest node of the BST_AVL tree `node` into `min`, and return
+ * the rest of the tree. */
+static node_t* tree_pop_min(bst_t* bst, node_t* node, node_t** min)
+{
+	if (node->left == NULL) {
+		*min = node;
+		return node->right;
+	}
+	node->left = tree_pop_min(bst, node->left, min);
+	return node_fix(bst, node);
+}
+
+/* Like `tree_join`, without a node in between. `pivot` is a key not smaller
+ * than any in `left`. */
+static node_t* tree_join2(bst_t*	bst,
+			  node_t*	left,
+			  node_t*	right,
+			  const void*	pivot)
+{
+	size_t	unused;
+	node_t*	node;
+
+	if (left == NULL || right == NULL) {
+		return left == NULL ? right : left;
+	}
+	if (bst->mode & BST_AVL) {
+		right = tree_pop_min(bst, right, &node);
+		return tree_join(bst, left, node, right);
+	}
+	/* The greatest node of `left` is splayed to its root, which then has
+	 * no right child. */
+	if (bst->mode & BST_SPLAYING) {
+		splay(bst, &left, pivot, &unused);
+		left->right = right;
+		return node_fix(bst, left);
+	}
+	for (node = left; ; node = node->right) {
+		if (bst->mode & BST_RANKED) {
+			node->count += node_count(right);
+		}
+		if (node->right == NULL) {
+			node->right = right;
+			return left;
+		}
+	}
+}
+
+/* Split the tree `node` into the keys smaller than `key` (or not greater, if
+ * `inclusive`), stored at `left`, and the others, stored at `right`. */
+static void tree_split(bst_t*		bst,
+		       node_t*		node,
+		       const void*	key,
+		       bool		inclusive,
+		       node_t**		left,
+		       node_t**		right)
+{
+	/* Every node on the search path is joined with the half of its
+	 * subtree on its side, which makes O(log n) in total. */
+	if (bst->mode & BST_AVL) {
+		if (node == NULL) {
+			*left	= NULL;
+			*right	= NULL;
+			return;
+		}
+
+		int	cmp_result = bst->cmp(key, node->data);
+		node_t*	half;
+
+		if (cmp_result > 0 || (cmp_result == 0 && inclusive)) {
+			tree_split(bst, node->right, key, inclusive, &half,
+				   right);
+			*left = tree_join(bst, node->left, node, half);
+		} else {
+			tree_split(bst, node->left, key, inclusive, left,
+				   &half);
+			*right = tree_join(bst, half, node, node->right);
+		}
+		return;
+	}
+
+	/* The splayed root has the keys on either side of it in its
+	 * subtrees. */
+	if (bst->mode & BST_SPLAYING) {
+		size_t	unused;
+		int	cmp_result = splay(bst, &node, key, &unused);
+
+		if (node == NULL) {
+			*left	= NULL;
+			*right	= NULL;
+		} else if (cmp_result > 0 || (cmp_result == 0 && inclusive)) {
+			*left		= node;
+			*right		= node->right;
+			node->right	= NULL;
+			node_fix(bst, node);
+		} else {
+			*left		= node->left;
+			*right		= node;
+			node->left	= NULL;
+			node_fix(bst, node);
+		}
+		return;
+	}
+
+	/* Otherwise, the nodes on the search path are hung on two chains, as
+	 * by `splay`, in O(height) and without recursion. */
+	node_t	header	= { .left = NULL, .right = NULL };
+	node_t*	last[2]	= { &header, &header };
+
+	while (node != NULL) {
+		int cmp_result = bst->cmp(key, node->data);
+		if (cmp_result > 0 || (cmp_result == 0 && inclusive)) {
+			last[0]->right	= node;
+			last[0]		= node;
+			node		= node->right;
+		} else {
+			last[1]->left	= node;
+			last[1]		= node;
+			node		= node->left;
+		}
+	}
+	last[0]->right	= NULL;
+	last[1]->left	= NULL;
+	*left		= header.right;
+	*right		= header.left;
+	if (bst->mode & BST_RANKED) {
+		if (last[0] != &header) {
+			splay_recount(*left, last[0], true);
+		}
+		if (last[1] != &header) {
+			splay_recount(*right, last[1], false);
+		}
+	}
+}
+
+static bool split_check(bst_t* bst)
+{
+	if (bst->mode & SPLIT_UNSUPPORTED) {
+		ERROR(return false, "Trees with BST_SLAB, BST_BTREE, "
+				    "BST_CONCURRENT, BST_PERSISTENT or "
+				    "BST_COMPACT can not be split or "
+				    "joined.\n");
+	}
+	return true;
+}
+
+bst_t* bst_split(bst_t* bst, const void* key)
+{
+	if (bst == NULL || key == NULL) {
+		ERROR(return NULL, "`bst` or `key` argument is NULL.\n");
+	}
+	if (!split_check(bst)) {
+		return NULL;
+	}
+
+	bst_t*	right = bst_new_like(bst);
+
+	if (right == NULL) {
+		return NULL;
+	}
+	tree_split(bst, bst->root, key, false, &bst->root, &right->root);
+	right->size	= rebuild_count(bst, right->root);
+	bst->size	-= right->size;
+	filter_deleted(bst, right->size);
+#ifdef BST_STATS
+	right->stats.height	= bst->stats.height;
+	right->stats.max_height	= bst->stats.height;
+#endif
+	return right;
+}
+
+bool bst_join(bst_t* a, bst_t* b)
+{
+	if (a == NULL || b == NULL || a == b) {
+		ERROR(return false, "`a` or `b` argument is NULL, or both are "
+				    "the same tree.\n");
+	}
+	if (!split_check(a)) {
+		return false;
+	}
+	if (a->mode != b->mode || a->type != b->type || a->cmp != b->cmp ||
+	    a->elem_size != b->elem_size || a->key_size != b->key_size) {
+		ERROR(return false, "`a` and `b` are not alike.\n");
+	}
+
+	node_t* max = a->root;
+	node_t* min = b->root;
+
+	if (max == NULL || min == NULL) {
+		a->root = max == NULL ? min : max;
+	} else {
+		while (max->right != NULL) {
+			max = max->right;
+		}
+		while (min->left != NULL) {
+			min = min->left;
+		}
+		if (a->cmp(max->data, min->data) >= 0) {
+			ERROR(return false, "The keys of `a` are not all "
+					    "smaller than those of `b`.\n");
+		}
+		a->root = tree_join2(a, a->root, b->root, min->data);
+	}
+#ifdef BST_STATS
+	a->stats.height += b->stats.height;
+	if (a->stats.height > a->stats.max_height) {
+		a->stats.max_height = a->stats.height;
+	}
+#endif
+	a->size	+= b->size;
+	filter_deleted(b, b->size);
+	b->root	= NULL;
+	b->size	= 0;
+	/* The keys of `b` can not be added without visiting them. */
+	if (a->filter != NULL) {
+		filter_rebuild(a);
+	}
+	return true;
+}
+
+typedef struct {
+	bst_t*		bst;
+	const void*	lo;
+	const void*	hi;
+	char*		keys;
+	size_t		len;
+	size_t		cap;
+	bool		failed;
+} range_keys_t;
+
+/* Copy the key of `data` to `range->keys` if it is in the range. */
+static void range_visit(void* ctx, void* data)
+{
+	range_keys_t*	range	= ctx;
+	bst_t*		bst	= range->bst;
+
+	if (range->failed || bst->cmp(data, range->lo) < 0 ||
+	    bst->cmp(data, range->hi) > 0) {
+		return;
+	}
+	if (range->len == range->cap) {
+		size_t	cap	= range->cap == 0 ? 64 : range->cap * 2;
+		char*	keys	= realloc(range->keys, cap * bst->key_size);
+		if (keys == NULL) {
+			range->failed = true;
+			ERROR(return, MALLOC_FAIL);
+		}
+		range->keys	= keys;
+		range->cap	= cap;
+	}
+	memcpy(range->keys + range->len++ * bst->key_size, data, bst->key_size);
+}
+
+/* For the trees that can not be split: the keys in the range are copied while
+ * writers are held off, and then deleted one by one. */
+static size_t delete_range_each(bst_t* bst, const void* lo, const void* hi)
+{
+	range_keys_t	range	= { bst, lo, hi, NULL, 0, 0, false };
+	size_t		size;
+
+	if (!rcu_write_begin(bst, 0)) {
+		return 0;
+	}
+	if (bst->mode & BST_NODELESS) {
+		nodeless_walk(bst, ORDER_IN, range_visit, &range);
+	} else {
+		bst_cursor_t cursor;
+
+		for (bool ok = bst_cursor_lower_bound(&cursor, bst, lo);
+		     ok && bst->cmp(bst_cursor_data(&cursor), hi) <= 0 &&
+		     !range.failed;
+		     ok = bst_cursor_next(&cursor)) {
+			range_visit(&range, bst_cursor_data(&cursor));
+		}
+	}
+	size = bst->size;
+	rcu_write_end(bst);
+
+	for (size_t i = 0; i < range.len && !range.failed; ++i) {
+		bst_delete(bst, range.keys + i * bst->key_size);
+	}
+	free(range.keys);
+	return range.failed || size < bst->size ? 0 : size - bst->size;
+}
+
+size_t bst_delete_range(bst_t* bst, const void* lo, const void* hi)
+{
+	if (bst == NULL || lo == NULL || hi == NULL) {
+		ERROR(return 0, "`bst`, `lo` or `hi` argument is NULL.\n");
+	}
+	if (bst->cmp(lo, hi) > 0) {
+		return 0;
+	}
+	if (bst->mode & (BST_NODELESS | BST_CONCURRENT | BST_PERSISTENT)) {
+		return delete_range_each(bst, lo, hi);
+	}
+
+	node_t*	left;
+	node_t*	mid;
+	node_t*	right;
+	size_t	count;
+
+	tree_split(bst, bst->root, lo, false, &left, &mid);
+	tree_split(bst, mid, hi, true, &mid, &right);
+	count		= bst_free_nodes(bst, mid, true);
+	bst->root	= tree_join2(bst, left, right, lo);
+	bst->size	-= count;
+	filter_deleted(bst, count);
+	return count;
+}
+
+
+
+/*==============================================================================
+	STATS
+==============================================================================*/
+
+bool bst_stats(bst_t* bst, bst_stats_t* stats)
+{
+	if (bst == NULL) {
+		ERROR(return false, "`bst` argument is NULL.\n");
+	}
+	if (stats == NULL) {
+		ERROR(return false, "`stats` argument is NULL.\n");
+	}
+	memset(stats, 0, sizeof *stats);
+#ifndef BST_STATS
+	return false;
+#else
+#define STATS_LOAD(FIELD)						\
+	(stats->FIELD = __atomic_load_n(&bst->stats.FIELD, __ATOMIC_RELAXED))
+
+	STATS_LOAD(adds);
+	STATS_LOAD(deletes);
+	STATS_LOAD(lookups);
+	STATS_LOAD(add_comparisons);
+	STATS_LOAD(delete_comparisons);
+	STATS_LOAD(lookup_comparisons);
+	STATS_LOAD(filtered);
+	for (size_t i = 0; i < BST_STATS_DEPTHS; ++i) {
+		STATS_LOAD(lookup_depths[i]);
+	}
+	STATS_LOAD(max_height);
+	STATS_LOAD(rebalances);
+	STATS_LOAD(rebuilds);
+
+	size_t elems = bst->size;
+
+	if (bst->mode & BST_BTREE) {
+		stats->height		= btree_height(bst->btree);
+		stats->height_exact	= true;
+		stats->node_bytes	= btree_bytes(bst->btree);
+	} else if (bst->mode & BST_COMPACT) {
+		stats->height		= compact_height(bst);
+		stats->height_exact	= true;
+		stats->node_bytes	= bst->compact.cap *
+					  sizeof(compact_node_t);
+		if (stats->height > stats->max_height) {
+			stats->max_height = stats->height;
+			__atomic_store_n(&bst->stats.max_height,
+					 stats->height, __ATOMIC_RELAXED);
+		}
+	} else if (bst->mode & BST_AVL) {
+		unsigned	token	= bst_read_begin(bst);
+		node_t*		root	= LOAD(bst->root);
+
+		stats->height		= (size_t)node_height(root);
+		stats->height_exact	= true;
+		bst_read_end(bst, token);
+	} else if (bst->mode & BST_SPLAYING) {
+		stats->height		= bst_height(bst);
+		stats->height_exact	= true;
+		if (stats->height > stats->max_height) {
+			stats->max_height = stats->height;
+			__atomic_store_n(&bst->stats.max_height,
+					 stats->height, __ATOMIC_RELAXED);
+		}
+	} else {
+		STATS_LOAD(height);
+		stats->height_exact	= elems <= 1;
+	}
+	if (bst->type == BST_COPIED) {
+		stats->payload_bytes = elems * bst->elem_size;
+	}
+	if (bst->mode & BST_SLAB) {
+		stats->node_bytes = bst->slab.bytes -
+				    stats->payload_bytes;
+	} else if (!(bst->mode & BST_NODELESS)) {
+		stats->node_bytes = elems * node_size(bst);
+		if ((bst->mode & BST_PERSISTENT) && bst->type == BST_COPIED) {
+			stats->node_bytes -= stats->payload_bytes;
+		}
+	}
+#undef STATS_LOAD
+	return true;
+#endif
+}
+
+#ifdef BST_STATS
+/* Note an add that put a node at `depth` (counting the root as 1). */
+static void stats_height(bst_t* bst, size_t depth)
+{
+	size_t height = depth;
+
+	if ((bst->mode & (BST_AVL | BST_COMPACT)) == BST_AVL) {
+		height = (size_t)bst->root->height;
+	} else if (!(bst->mode & BST_BTREE) && depth > bst->stats.height) {
+		__atomic_store_n(&bst->stats.height, depth, __ATOMIC_RELAXED);
+	}
+	if (height > bst->stats.max_height) {
+		__atomic_store_n(&bst->stats.max_height, height,
+				 __ATOMIC_RELAXED);
+	}
+}
+
+/* Note that the tree has been rebuilt into one of minimal height. */
+static void stats_rebuilt(bst_t* bst)
+{
+	size_t height = 0;
+
+	for (size_t size = bst->size; size > 0; size /= 2) {
+		height += 1;
+	}
+	__atomic_store_n(&bst->stats.height, height, __ATOMIC_RELAXED);
+	if (height > bst->stats.max_height) {
+		__atomic_store_n(&bst->stats.max_height, height,
+				 __ATOMIC_RELAXED);
+	}
+}
+#endif
+
+
+
+/*==============================================================================
+	FILTER
+==============================================================================*/
+
+/* Keys a filter is sized for at least, and the most bits set per key. */
+#define FILTER_MIN_KEYS		1024
+#define FILTER_MAX_HASHES	16
+
+bool bst_filter(bst_t* bst, uint64_t (*hash)(const void* key), double fp_rate)
+{
+	if (bst == NULL) {
+		ERROR(return false, "`bst` argument is NULL.\n");
+	}
+	if (hash != NULL && !(fp_rate > 0 && fp_rate < 1)) {
+		ERROR(return false, "`fp_rate` must be between 0 and 1.\n");
+	}
+	if (!rcu_write_begin(bst, 0)) {
+		return false;
+	}
+
+	bool ok = true;
+
+	if (hash == NULL) {
+		filter_t* old = bst->filter;
+
+		PUBLISH(bst->filter, NULL);
+		if (old != NULL && bst->rcu != NULL) {
+			rcu_synchronize(bst->rcu);
+		}
+		filter_free(old);
+	} else {
+		ok = filter_build(bst, hash, fp_rate);
+	}
+	rcu_write_end(bst);
+	return ok;
+}
+
+/* A finalizer (from SplitMix64), so that weak hashes like the identity still
+ * spread over the filter. */
+static uint64_t filter_mix(uint64_t h)
+{
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9u;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebu;
+	return h ^ (h >> 31);
+}
+
+/* The bits of a key are `a + i * b` for i in [0, hashes), as in Kirsch and
+ * Mitzenmacher's double hashing. */
+#define FILTER_BITS(FILTER, KEY, BIT, BODY)				\
+do {									\
+	uint64_t a_ = filter_mix((FILTER)->hash(KEY));			\
+	uint64_t b_ = filter_mix(a_) | 1;				\
+	for (unsigned i_ = 0; i_ < (FILTER)->hashes; ++i_) {		\
+		size_t BIT = (size_t)(a_ + i_ * b_) & (FILTER)->mask;	\
+		BODY							\
+	}								\
+} while (0)
+
+static void filter_set(filter_t* filter, const void* key)
+{
+	FILTER_BITS(filter, key, bit,
+		__atomic_fetch_or(&filter->bits[bit / 64],
+				  (uint64_t)1 << bit % 64, __ATOMIC_RELAXED);
+	);
+}
+
+/* True if `key` is certainly not in the tree. */
+static bool filter_excludes(bst_t* bst, const void* key)
+{
+	filter_t* filter = LOAD(bst->filter);
+
+	if (filter == NULL) {
+		return false;
+	}
+	FILTER_BITS(filter, key, bit,
+		uint64_t word = __atomic_load_n(&filter->bits[bit / 64],
+						__ATOMIC_RELAXED);
+		if (!(word >> bit % 64 & 1)) {
+			STATS_ADD(bst, filtered, 1);
+			return true;
+		}
+	);
+	return false;
+}
+
+static void filter_add(bst_t* bst, const void* key)
+{
+	if (bst->filter != NULL) {
+		filter_set(bst->filter, key);
+	}
+}
+
+static void filter_added(bst_t* bst)
+{
+	filter_t* filter = bst->filter;
+
+	if (filter != NULL && ++filter->count > filter->capacity) {
+		filter_rebuild(bst);
+	}
+}
+
+/* Deleted keys keep their bits, so lookups of them still descend the tree.
+ * Once a quarter of the keys of the filter are such, it is rebuilt. */
+static void filter_deleted(bst_t* bst, size_t count)
+{
+	filter_t* filter = bst->filter;
+
+	if (filter != NULL && (filter->deleted += count) * 4 > filter->count) {
+		filter_rebuild(bst);
+	}
+}
+
+static void filter_visit(void* ctx, void* data)
+{
+	filter_set(ctx, data);
+}
+
+/* Replace the filter of `bst` with one built from its keys, with room for as
+ * many more. With k = log2(1 / fp_rate) bits per key, about k / ln 2 bits of
+ * filter per key give the rate. If memory runs out, the old filter stays; it
+ * is still correct, if less selective. */
+static bool filter_build(bst_t*		bst,
+			 uint64_t	(*hash)(const void* key),
+			 double		fp_rate)
+{
+	filter_t*	old	= bst->filter;
+	filter_t*	filter	= malloc(sizeof *filter);
+	size_t		bits	= 64;
+	size_t		want;
+
+	if (filter == NULL) {
+		ERROR(return false, MALLOC_FAIL);
+	}
+	filter->hashes = 1;
+	for (double p = 0.5; p > fp_rate && filter->hashes < FILTER_MAX_HASHES;
+	     p /= 2) {
+		filter->hashes += 1;
+	}
+	filter->capacity = bst->size < FILTER_MIN_KEYS / 2 ? FILTER_MIN_KEYS
+							    : 2 * bst->size;
+	want = filter->capacity * filter->hashes / 2 * 3;
+	while (bits < want) {
+		bits *= 2;
+	}
+	filter->bits = calloc(bits / 64, sizeof *filter->bits);
+	if (filter->bits == NULL) {
+		free(filter);
+		ERROR(return false, MALLOC_FAIL);
+	}
+	filter->mask	= bits - 1;
+	filter->hash	= hash;
+	filter->fp_rate	= fp_rate;
+	filter->count	= bst->size;
+	filter->deleted	= 0;
+
+	if (bst->mode & BST_NODELESS) {
+		nodeless_walk(bst, ORDER_IN, filter_visit, filter);
+	} else {
+		bst_cursor_t cursor;
+
+		for (bool ok = bst_cursor_first(&cursor, bst); ok;
+		     ok = bst_cursor_next(&cursor)) {
+			filter_set(filter, bst_cursor_data(&cursor));
+		}
+	}
+
+	/* Readers may still be testing the old bits. */
+	PUBLISH(bst->filter, filter);
+	if (old != NULL && bst->rcu != NULL) {
+		rcu_synchronize(bst->rcu);
+	}
+	filter_free(old);
+	return true;
+}
+
+static bool filter_rebuild(bst_t* bst)
+{
+	return filter_build(bst, bst->filter->hash, bst->filter->fp_rate);
+}
+
+static void filter_free(filter_t* filter)
+{
+	if (filter != NULL) {
+		free(filter->bits);
+		free(filter);
+	}
+}
+
+
+
+/*==============================================================================
+	CURSOR
+==============================================================================*/
+
+typedef enum { SEEK_GE, SEEK_GT, SEEK_LT, } seek_t;
+
+static void cursor_push(bst_cursor_t* cursor, node_t* node)
+{
+	if (cursor->depth < BST_CURSOR_DEPTH) {
+		cursor->path[cursor->depth++] = node;
+	} else {
+		cursor->lost = true;
+	}
+}
+
+/* Position the cursor on the first node that satisfies `seek` relative to
+ * `key`, recording the path from the root on the way. */
+static bool cursor_seek(bst_cursor_t* cursor, const void* key, seek_t seek)
+{
+	node_t*	node		= LOAD(cursor->bst->root);
+	node_t*	best		= NULL;
+	size_t	best_depth	= 0;
+	bool	best_lost	= false;
+
+	cursor->depth	= 0;
+	cursor->lost	= false;
+
+	while (node != NULL) {
+		int	cmp_result = cursor->bst->cmp(key, node->data);
+		bool	match;
+
+		cursor_push(cursor, node);
+		switch (seek) {
+		case SEEK_GE:	match = cmp_result <= 0; break;
+		case SEEK_GT:	match = cmp_result <  0; break;
+		default:	match = cmp_result >  0; break;
+		}
+		if (match) {
+			best		= node;
+			best_depth	= cursor->depth;
+			best_lost	= cursor->lost;
+			if (cmp_result == 0 && seek == SEEK_GE) {
+				break;
+			}
+		}
+		if (seek == SEEK_LT) {
+			node = match ? LOAD(node->right) : LOAD(node->left);
+		} else {
+			node = match ? LOAD(node->left) : LOAD(node->right);
+		}
+	}
+
+	cursor->node	= best;
+	cursor->depth	= best_depth;
+	cursor->lost	= best_lost;
+	return best != NULL;
+}
+
+static bool cursor_init(bst_cursor_t* cursor, bst_t* bst)
+{
+	if (cursor == NULL) {
+		ERROR(return false, "`cursor` argument is NULL.\n");
+	}
+	cursor->bst	= bst;
+	cursor->node	= NULL;
+	cursor->depth	= 0;
+	cursor->lost	= false;
+	if (bst == NULL) {
+		ERROR(return false, "`bst` argument is NULL.\n");
+	}
+	if (bst->mode & BST_NODELESS) {
+		ERROR(return false, "Cursors do not support BST_BTREE or "
+				    "BST_COMPACT.\n");
+	}
+	return true;
+}
+
+/* Descend from `node` to the extreme left (or right) of its subtree. */
+static void cursor_descend(bst_cursor_t* cursor, node_t* node, bool left)
+{
+	while (node != NULL) {
+		cursor_push(cursor, node);
+		cursor->node	= node;
+		node		= left ? LOAD(node->left) : LOAD(node->right);
+	}
+}
+
+bool bst_cursor_first(bst_cursor_t* cursor, bst_t* bst)
+{
+	if (!cursor_init(cursor, bst)) {
+		return false;
+	}
+	cursor_descend(cursor, LOAD(bst->root), true);
+	return cursor->node != NULL;
+}
+
+bool bst_cursor_last(bst_cursor_t* cursor, bst_t* bst)
+{
+	if (!cursor_init(cursor, bst)) {
+		return false;
+	}
+	cursor_descend(cursor, LOAD(bst->root), false);
+	return cursor->node != NULL;
+}
+
+bool bst_cursor_lower_bound(bst_cursor_t* cursor, bst_t* bst, const void* key)
+{
+	if (!cursor_init(cursor, bst)) {
+		return false;
+	}
+	if (key == NULL) {
+		ERROR(return false, "`key` argument is NULL.\n");
+	}
+	return cursor_seek(cursor, key, SEEK_GE);
+}
+
+bool bst_cursor_upper_bound(bst_cursor_t* cursor, bst_t* bst, const void* key)
+{
+	if (!cursor_init(cursor, bst)) {
+		return false;
+	}
+	if (key == NULL) {
+		ERROR(return false, "`key` argument is NULL.\n");
+	}
+	return cursor_seek(cursor, key, SEEK_GT);
+}
+
+/* Step to the in-order neighbour in direction `right`. When the path to the
+ * current node did not fit in the cursor, the neighbour is looked up from the
+ * root instead. */
+static bool cursor_move(bst_cursor_t* cursor, bool right)
+{
+	if (cursor == NULL || cursor->node == NULL) {
+		return false;
+	}
+	if (cursor->lost) {
+		return cursor_seek(cursor, cursor->node->data,
+				   right ? SEEK_GT : SEEK_LT);
+	}
+
+	node_t* child = right ? LOAD(cursor->node->right)
+			      : LOAD(cursor->node->left);
+
+	if (child != NULL) {
+		cursor_push(cursor, child);
+		cursor->node = child;
+		cursor_descend(cursor, right ? LOAD(child->left)
+					     : LOAD(child->right), right);
+		return true;
+	}
+
+	/* Climb for as long as we come from the side we are moving to. With
+	 * BST_CONCURRENT, the parent may have been given a copy of the child
+	 * since, so the side is found by comparing instead. */
+	while (cursor->depth >= 2) {
+		node_t*	parent = cursor->path[cursor->depth - 2];
+		node_t*	node   = cursor->path[cursor->depth - 1];
+		bool	left;
+		cursor->depth -= 1;
+		if (cursor->bst->rcu != NULL) {
+			left = cursor->bst->cmp(node->data, parent->data) < 0;
+		} else {
+			left = parent->left == node;
+		}
+		if (left == right) {
+			cursor->node = parent;
+			return true;
+		}
+	}
+	cursor->depth	= 0;
+	cursor->node	= NULL;
+	return false;
+}
+
+/* With BST_CONCURRENT, the cursor may walk from nodes that have since been
+ * removed into nodes added after it was positioned, and so meet an element
+ * again that was deleted and added back. Such elements are skipped, so that
+ * every step moves strictly forward. */
+static bool cursor_step(bst_cursor_t* cursor, bool right)
+{
+	if (cursor == NULL || cursor->node == NULL) {
+		return false;
+	}
+	if (cursor->bst->rcu == NULL) {
+		return cursor_move(cursor, right);
+	}
+
+	const void* from = cursor->node->data;
+
+	while (cursor_move(cursor, right)) {
+		int cmp_result = cursor->bst->cmp(cursor->node->data, from);
+		if (right ? cmp_result > 0 : cmp_result < 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool bst_cursor_next(bst_cursor_t* cursor)
+{
+	return cursor_step(cursor, true);
+}
+
+bool bst_cursor_prev(bst_cursor_t* cursor)
+{
+	return cursor_step(cursor, false);
+}
+
+void* bst_cursor_data(bst_cursor_t* cursor)
+{
+	if (cursor == NULL || cursor->node == NULL) {
+		return NULL;
+	}
+	return cursor->node->data;
+}
+
+
+
+/*==============================================================================
+	KEY KINDS
+==============================================================================*/
+
+int bst_cmp_int32(const void* a, const void* b)
+{
+	int32_t x = *(const int32_t*)a, y = *(const int32_t*)b;
+	return (x > y) - (x < y);
+}
+
+int bst_cmp_int64(const void* a, const void* b)
+{
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+int bst_cmp_uint64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+int bst_cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static key_kind_t key_kind(int (*cmp)(const void*, const void*),
+			   size_t elem_size)
+{
+	if (cmp == bst_cmp_int32 && elem_size == sizeof(int32_t)) {
+		return KIND_INT32;
+	}
+	if (cmp == bst_cmp_int64 && elem_size == sizeof(int64_t)) {
+		return KIND_INT64;
+	}
+	if (cmp == bst_cmp_uint64 && elem_size == sizeof(uint64_t)) {
+		return KIND_UINT64;
+	}
+	if (cmp == bst_cmp_double && elem_size == sizeof(double)) {
+		return KIND_DOUBLE;
+	}
+	return KIND_NONE;
+}
+
+/* Descend the binary tree comparing keys of type TYPE inline, instead of
+ * calling `cmp` through a pointer at every level. */
+#define KIND_FIND(TYPE)							\
+do {									\
+	TYPE key = *(const TYPE*)data;					\
+	while (node != NULL) {						\
+		TYPE other = *(const TYPE*)node->data;			\
+		depth += 1;						\
+		if (key == other) {					\
+			goto done;					\
+		}							\
+		node = key < other ? LOAD(node->left)			\
+				   : LOAD(node->right);			\
+	}								\
+	goto done;							\
+} while (0)
+
+static node_t* node_find(bst_t* bst, const void* data)
+{
+	node_t* node	= LOAD(bst->root);
+	size_t	depth	= 0;
+
+	/* The splay is the search. */
+	if ((bst->mode & BST_SPLAYING) == BST_SPLAY) {
+		node = splay_find(bst, data, &depth);
+		goto done;
+	}
+	switch (bst->kind) {
+	case KIND_INT32:	KIND_FIND(int32_t);
+	case KIND_INT64:	KIND_FIND(int64_t);
+	case KIND_UINT64:	KIND_FIND(uint64_t);
+	case KIND_DOUBLE:	KIND_FIND(double);
+	default:
+		break;
+	}
+	while (node != NULL) {
+		int cmp_result = bst->cmp(data, node->data);
+		depth += 1;
+		if (cmp_result == 0) {
+			break;
+		}
+		node = cmp_result < 0 ? LOAD(node->left) : LOAD(node->right);
+	}
+done:
+	STATS_ADD(bst, lookups, 1);
+	STATS_ADD(bst, lookup_comparisons, depth);
+	STATS_ADD(bst, lookup_depths[depth < BST_STATS_DEPTHS ? depth
+						: BST_STATS_DEPTHS - 1], 1);
+	if ((bst->mode & BST_SPLAY_LAZY) && splay_due(bst, depth)) {
+		node = splay_find(bst, data, &depth);
+	}
+	return node;
+}
+
+/* Compare two keys like `cmp`, but inline for the built-in key kinds. */
+#define KIND_CMP(TYPE)							\
+do {									\
+	TYPE x = *(const TYPE*)a;					\
+	TYPE y = *(const TYPE*)b;					\
+	return (x > y) - (x < y);					\
+} while (0)
+
+static inline int key_cmp(bst_t* bst, const void* a, const void* b)
+{
+	switch (bst->kind) {
+	case KIND_INT32:	KIND_CMP(int32_t);
+	case KIND_INT64:	KIND_CMP(int64_t);
+	case KIND_UINT64:	KIND_CMP(uint64_t);
+	case KIND_DOUBLE:	KIND_CMP(double);
+	default:
+		return bst->cmp(a, b);
+	}
+}
+
+static inline int popcount(unsigned mask)
+{
+#ifdef __GNUC__
+	return __builtin_popcount(mask);
+#else
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		count += 1;
+	}
+	return count;
+#endif
+}
+
+/* The kernels below return how many of the keys in a 64-byte block are smaller
+ * than `x`, i.e. the index of the child to descend into. */
+
+static int count_less_int32(const void* block, const void* key)
+{
+	const int32_t*	keys	= block;
+	int32_t		x	= *(const int32_t*)key;
+#if defined(__AVX2__)
+	__m256i	vx	= _mm256_set1_epi32(x);
+	__m256i	lo	= _mm256_loadu_si256((const __m256i*)keys);
+	__m256i	hi	= _mm256_loadu_si256((const __m256i*)(keys + 8));
+	unsigned mask	= (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpgt_epi32(vx, lo)))
+			| (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpgt_epi32(vx, hi))) << 8;
+	return popcount(mask);
+#elif defined(__SSE2__)
+	__m128i	vx	= _mm_set1_epi32(x);
+	__m128i	c0	= _mm_cmpgt_epi32(vx, _mm_loadu_si128(
+					(const __m128i*)keys));
+	__m128i	c1	= _mm_cmpgt_epi32(vx, _mm_loadu_si128(
+					(const __m128i*)(keys + 4)));
+	__m128i	c2	= _mm_cmpgt_epi32(vx, _mm_loadu_si128(
+					(const __m128i*)(keys + 8)));
+	__m128i	c3	= _mm_cmpgt_epi32(vx, _mm_loadu_si128(
+					(const __m128i*)(keys + 12)));
+	__m128i	packed	= _mm_packs_epi16(_mm_packs_epi32(c0, c1),
+					  _mm_packs_epi32(c2, c3));
+	return popcount((unsigned)_mm_movemask_epi8(packed));
+#else
+	int count = 0;
+	for (int i = 0; i < 16; ++i) {
+		count += keys[i] < x;
+	}
+	return count;
+#endif
+}
+
+static int count_less_int64(const void* block, const void* key)
+{
+	const int64_t*	keys	= block;
+	int64_t		x	= *(const int64_t*)key;
+#if defined(__AVX2__)
+	__m256i	vx	= _mm256_set1_epi64x(x);
+	__m256i	lo	= _mm256_loadu_si256((const __m256i*)keys);
+	__m256i	hi	= _mm256_loadu_si256((const __m256i*)(keys + 4));
+	unsigned mask	= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpgt_epi64(vx, lo)))
+			| (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpgt_epi64(vx, hi))) << 4;
+	return popcount(mask);
+#else
+	int count = 0;
+	for (int i = 0; i < 8; ++i) {
+		count += keys[i] < x;
+	}
+	return count;
+#endif
+}
+
+static int count_less_uint64(const void* block, const void* key)
+{
+	const uint64_t*	keys	= block;
+	uint64_t	x	= *(const uint64_t*)key;
+#if defined(__AVX2__)
+	/* There is no unsigned compare; flipping the sign bits of both sides
+	 * makes the signed one give the same answer. */
+	__m256i	sign	= _mm256_set1_epi64x((long long)(1ULL << 63));
+	__m256i	vx	= _mm256_xor_si256(_mm256_set1_epi64x((long long)x),
+					   sign);
+	__m256i	lo	= _mm256_xor_si256(_mm256_loadu_si256(
+					(const __m256i*)keys), sign);
+	__m256i	hi	= _mm256_xor_si256(_mm256_loadu_si256(
+					(const __m256i*)(keys + 4)), sign);
+	unsigned mask	= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpgt_epi64(vx, lo)))
+			| (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpgt_epi64(vx, hi))) << 4;
+	return popcount(mask);
+#else
+	int count = 0;
+	for (int i = 0; i < 8; ++i) {
+		count += keys[i] < x;
+	}
+	return count;
+#endif
+}
+
+static int count_less_double(const void* block, const void* key)
+{
+	const double*	keys	= block;
+	double		x	= *(const double*)key;
+#if defined(__AVX2__)
+	__m256d	vx	= _mm256_set1_pd(x);
+	__m256d	lo	= _mm256_cmp_pd(_mm256_loadu_pd(keys), vx, _CMP_LT_OQ);
+	__m256d	hi	= _mm256_cmp_pd(_mm256_loadu_pd(keys + 4), vx,
+					_CMP_LT_OQ);
+	unsigned mask	= (unsigned)_mm256_movemask_pd(lo)
+			| (unsigned)_mm256_movemask_pd(hi) << 4;
+	return popcount(mask);
+#elif defined(__SSE2__)
+	__m128d	vx	= _mm_set1_pd(x);
+	unsigned mask	= 0;
+	for (int i = 0; i < 4; ++i) {
+		mask |= (unsigned)_mm_movemask_pd(_mm_cmplt_pd(
+				_mm_loadu_pd(keys + 2 * i), vx)) << (2 * i);
+	}
+	return popcount(mask);
+#else
+	int count = 0;
+	for (int i = 0; i < 8; ++i) {
+		count += keys[i] < x;
+	}
+	return count;
+#endif
+}
+
+
+
+/*==============================================================================
+	BATCHED LOOKUPS
+==============================================================================*/
+
+/* Descents in flight at once. Enough to keep the memory system busy, few enough
+ * that their nodes stay in the L1 cache until they are used. */
+#define MANY_LANES	16
+
+typedef struct {
+	node_t*		node;
+	const void*	data;		/* `node->data`, once it is loaded. */
+	size_t		index;		/* Of the key. */
+	size_t		depth;
+} many_lane_t;
+
+/* Note the result of the lookup of key `i`: its element, or NULL. */
+static size_t many_report(bst_t*	bst,
+			  size_t	i,
+			  void*		elem,
+			  bool		found[],
+			  void*		results[])
+{
+	if (found != NULL) {
+		found[i] = elem != NULL;
+	}
+	if (results != NULL) {
+		results[i] = elem == NULL ? NULL
+					  : (char*)elem + bst->value_offset;
+	}
+	return elem != NULL;
+}
+
+/* Look the keys up one at a time, for the trees that do not take part in the
+ * interleaving. */
+static size_t many_each(bst_t*		bst,
+			const char*	keys,
+			size_t		count,
+			bool		found[],
+			void*		results[])
+{
+	size_t hits = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		const void*	key	= keys + i * bst->key_size;
+		void*		elem	= NULL;
+
+		if (filter_excludes(bst, key)) {
+			elem = NULL;
+		} else if (bst->mode & BST_BTREE) {
+			elem = btree_find(bst, key);
+		} else if (bst->mode & BST_COMPACT) {
+			elem = compact_find(bst, key);
+		} else {
+			node_t* node = node_find(bst, key);
+			elem = node == NULL ? NULL : node->data;
+		}
+		hits += many_report(bst, i, elem, found, results);
+	}
+	return hits;
+}
+
+/* Interleave the descents for up to MANY_LANES keys. Every lane takes two steps
+ * per node: the first loads the node, which has been prefetched, and prefetches
+ * its element, and the second compares the element, which has arrived by then,
+ * and prefetches the child to go to. In between, the other lanes take theirs,
+ * so that the misses of all lanes overlap. A lane that is done takes on the
+ * next key at once (as with asynchronous memory access chaining), so lanes do
+ * not wait for the longest descent of a group. */
+static size_t many_interleaved(bst_t*		bst,
+			       const char*	keys,
+			       size_t		count,
+			       bool		found[],
+			       void*		results[])
+{
+	many_lane_t	lanes[MANY_LANES];
+	size_t		active	= 0;
+	size_t		next	= 0;
+	size_t		hits	= 0;
+	node_t*		root	= LOAD(bst->root);
+
+	for (;;) {
+		while (active < MANY_LANES && next < count) {
+			const void* key = keys + next * bst->key_size;
+
+			if (root == NULL || filter_excludes(bst, key)) {
+				many_report(bst, next++, NULL, found, results);
+				continue;
+			}
+			PREFETCH(root);
+			lanes[active++] = (many_lane_t){ root, NULL, next, 0 };
+			next += 1;
+		}
+		if (active == 0) {
+			break;
+		}
+
+		for (size_t i = 0; i < active; ) {
+			many_lane_t*	lane = &lanes[i];
+			node_t*		node = lane->node;
+			const void*	key;
+			node_t*		child;
+			int		cmp_result;
+
+			if (lane->data == NULL) {
+				lane->data = node->data;
+				PREFETCH(lane->data);
+				i += 1;
+				continue;
+			}
+
+			key		= keys + lane->index * bst->key_size;
+			cmp_result	= key_cmp(bst, key, lane->data);
+			lane->depth	+= 1;
+			child		= cmp_result == 0 ? NULL
+					: cmp_result < 0  ? LOAD(node->left)
+							  : LOAD(node->right);
+			if (child != NULL) {
+				PREFETCH(child);
+				lane->node = child;
+				lane->data = NULL;
+				i += 1;
+				continue;
+			}
+
+			STATS_ADD(bst, lookups, 1);
+			STATS_ADD(bst, lookup_comparisons, lane->depth);
+			STATS_ADD(bst, lookup_depths[
+				lane->depth < BST_STATS_DEPTHS
+				? lane->depth : BST_STATS_DEPTHS - 1], 1);
+			hits += many_report(bst, lane->index,
+					    cmp_result == 0 ? node->data : NULL,
+					    found, results);
+			*lane = lanes[--active];
+		}
+	}
+	return hits;
+}
+
+static size_t bst_lookup_many(bst_t*		bst,
+			      const void*	keys,
+			      size_t		count,
+			      bool		found[],
+			      void*		results[])
+{
+	if (bst == NULL) {
+		ERROR(return 0, "`bst` argument is NULL: nothing to search.\n");
+	}
+	if (keys == NULL && count > 0) {
+		ERROR(return 0,
+			"`keys` argument is NULL: nothing to search for.\n");
+	}
+
+	unsigned	token	= bst_read_begin(bst);
+	size_t		hits;
+
+	/* A splay tree changes with every lookup, a B-tree node is searched
+	 * in several steps, and BST_COMPACT links by index. */
+	if (bst->mode & (BST_NODELESS | BST_SPLAYING)) {
+		hits = many_each(bst, keys, count, found, results);
+	} else {
+		hits = many_interleaved(bst, keys, count, found, results);
+	}
+	bst_read_end(bst, token);
+	return hits;
+}
+
+size_t bst_contains_many(bst_t*		bst,
+			 const void*	keys,
+			 size_t		count,
+			 bool		found[])
+{
+	return bst_lookup_many(bst, keys, count, found, NULL);
+}
+
+size_t bst_find_many(bst_t*		bst,
+		     const void*	keys,
+		     size_t		count,
+		     void*		results[])
+{
+	return bst_lookup_many(bst, keys, count, NULL, results);
+}
+
+
+
+/*==============================================================================
+	FROZEN
+==============================================================================*/
+
+/* Prefetch this many levels ahead; with 4-byte keys the 16 descendants four
+ * levels down share a cache line. */
+#define FROZEN_PREFETCH_LEVELS	4
+
+static inline void* frozen_elem(bst_frozen_t* frozen, size_t k)
+{
+	return frozen->elems + k * frozen->elem_size;
+}
+
+/* In-order successor of slot `k`, or 0 past the end. */
+static size_t frozen_next(bst_frozen_t* frozen, size_t k)
+{
+	if (frozen->kind != KIND_NONE) {
+		return k < frozen->size ? k + 1 : 0;
+	}
+	if (2 * k + 1 <= frozen->size) {
+		k = 2 * k + 1;
+		while (2 * k <= frozen->size) {
+			k = 2 * k;
+		}
+		return k;
+	}
+	while (k & 1) {
+		k >>= 1;
+	}
+	return k >> 1;
+}
+
+static size_t frozen_first(bst_frozen_t* frozen)
+{
+	size_t k = frozen->size == 0 ? 0 : 1;
+
+	while (frozen->kind == KIND_NONE && k != 0 && 2 * k <= frozen->size) {
+		k = 2 * k;
+	}
+	return k;
+}
+
+/* For the built-in key kinds, the frozen snapshot keeps its elements sorted and
+ * searches them through a static B-tree of 64-byte blocks (an "S-tree"): the
+ * children of block `k` are the blocks `k * (B + 1) + i + 1` for i in [0, B],
+ * and a whole block is compared against the key at once by a SIMD kernel.
+ * `ranks` maps every slot to the position of its key in the sorted array; the
+ * unused slots of the last blocks are padded with the largest key and rank
+ * `size`. */
+
+#define STREE_BLOCK_BYTES	64
+
+static void stree_build(bst_frozen_t* frozen, size_t k, size_t* t)
+{
+	if (k >= frozen->blocks) {
+		return;
+	}
+
+	size_t b = frozen->block_keys;
+
+	for (size_t i = 0; i <= b; ++i) {
+		stree_build(frozen, k * (b + 1) + i + 1, t);
+		if (i == b) {
+			break;
+		}
+
+		size_t	slot	= k * b + i;
+		char*	dst	= frozen->keys + slot * frozen->elem_size;
+
+		if (*t < frozen->size) {
+			memcpy(dst, frozen_elem(frozen, *t + 1),
+			       frozen->elem_size);
+			frozen->ranks[slot] = *t;
+		} else {
+			memcpy(dst, frozen_elem(frozen, frozen->size),
+			       frozen->elem_size);
+			frozen->ranks[slot] = frozen->size;
+		}
+		*t += 1;
+	}
+}
+
+static void stree_kernel(bst_frozen_t* frozen)
+{
+	switch (frozen->kind) {
+	case KIND_INT32:  frozen->count_less = count_less_int32;  break;
+	case KIND_INT64:  frozen->count_less = count_less_int64;  break;
+	case KIND_UINT64: frozen->count_less = count_less_uint64; break;
+	default:	  frozen->count_less = count_less_double; break;
+	}
+}
+
+static bool stree_new(bst_frozen_t* frozen)
+{
+	size_t b	 = STREE_BLOCK_BYTES / frozen->elem_size;
+	size_t t	 = 0;
+
+	frozen->block_keys	= b;
+	frozen->blocks		= (frozen->size + b - 1) / b;
+	frozen->keys_raw	= malloc(frozen->blocks * STREE_BLOCK_BYTES +
+					 STREE_BLOCK_BYTES);
+	frozen->ranks		= malloc(frozen->blocks * b *
+					 sizeof *frozen->ranks);
+	if (frozen->keys_raw == NULL || frozen->ranks == NULL) {
+		free(frozen->keys_raw);
+		free(frozen->ranks);
+		ERROR(return false, MALLOC_FAIL);
+	}
+	/* Align the blocks to cache lines. */
+	frozen->keys = frozen->keys_raw + (STREE_BLOCK_BYTES -
+		(uintptr_t)frozen->keys_raw % STREE_BLOCK_BYTES);
+
+	stree_kernel(frozen);
+	stree_build(frozen, 0, &t);
+	return true;
+}
+
+/* Return the sorted position of the first key not smaller than `key`. */
+static size_t stree_lower_bound(bst_frozen_t* frozen, const void* key)
+{
+	size_t b	= frozen->block_keys;
+	size_t k	= 0;
+	size_t rank	= frozen->size;
+
+	while (k < frozen->blocks) {
+		const char*	block	= frozen->keys + k * STREE_BLOCK_BYTES;
+		size_t		i	= frozen->count_less(block, key);
+
+		if (i < b) {
+			rank = frozen->ranks[k * b + i];
+		}
+		k = k * (b + 1) + i + 1;
+	}
+	return rank;
+}
+
+typedef struct {
+	bst_frozen_t*	frozen;
+	size_t		k;
+} frozen_fill_t;
+
+static void frozen_visit(void* ctx, void* data)
+{
+	frozen_fill_t* fill = ctx;
+
+	memcpy(frozen_elem(fill->frozen, fill->k), data,
+	       fill->frozen->elem_size);
+	fill->k = frozen_next(fill->frozen, fill->k);
+}
+
+bst_frozen_t* bst_freeze(bst_t* bst)
+{
+	if (bst == NULL) {
+		ERROR(return NULL,
+			"`bst` argument is NULL: nothing to freeze.\n");
+	}
+	if (bst->elem_size == 0) {
+		ERROR(return NULL, "`bst` has no element size.\n");
+	}
+	/* With BST_CONCURRENT, writers are held off while the tree is read. */
+	if (!rcu_write_begin(bst, 0)) {
+		return NULL;
+	}
+
+	bst_frozen_t* frozen = malloc(sizeof *frozen);
+
+	if (frozen == NULL) {
+		rcu_write_end(bst);
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	frozen->size		= bst->size;
+	frozen->elem_size	= bst->elem_size;
+	frozen->cmp		= bst->cmp;
+	frozen->kind		= bst->size > 0 && bst->value_offset == 0
+				  ? bst->kind : KIND_NONE;
+	frozen->keys		= NULL;
+	frozen->keys_raw	= NULL;
+	frozen->ranks		= NULL;
+	frozen->blocks		= 0;
+	frozen->block_keys	= 0;
+	frozen->map		= NULL;
+	frozen->elems		= malloc((bst->size + 1) * bst->elem_size);
+	if (frozen->elems == NULL) {
+		free(frozen);
+		rcu_write_end(bst);
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+
+	/* Walking the slots in order while walking the tree in order puts every
+	 * element in its place. */
+	frozen_fill_t fill = { frozen, frozen_first(frozen) };
+
+	if (bst->mode & BST_NODELESS) {
+		nodeless_walk(bst, ORDER_IN, frozen_visit, &fill);
+	} else {
+		bst_cursor_t cursor;
+
+		for (bool ok = bst_cursor_first(&cursor, bst); ok;
+		     ok = bst_cursor_next(&cursor)) {
+			frozen_visit(&fill, bst_cursor_data(&cursor));
+		}
+	}
+	rcu_write_end(bst);
+
+	if (frozen->kind != KIND_NONE && !stree_new(frozen)) {
+		free(frozen->elems);
+		free(frozen);
+		return NULL;
+	}
+	return frozen;
+}
+
+void bst_frozen_free(bst_frozen_t* frozen)
+{
+	if (frozen == NULL) {
+		ERROR(return, "`frozen` argument is NULL: nothing to free.\n");
+	}
+	if (frozen->map != NULL) {
+		munmap(frozen->map, frozen->map_size);
+	} else {
+		free(frozen->elems);
+		free(frozen->keys_raw);
+		free(frozen->ranks);
+	}
+	free(frozen);
+}
+
+size_t bst_frozen_size(bst_frozen_t* frozen)
+{
+	if (frozen == NULL) {
+		ERROR(return 0, "`frozen` argument is NULL.\n");
+	}
+	return frozen->size;
+}
+
+/* The descent has no data-dependent branches: every level is visited, the
+ * comparison result only decides the next index. Afterwards, the right turns
+ * taken after the last left turn are undone to find the lower bound. */
+size_t bst_frozen_lower_bound(bst_frozen_t* frozen, const void* key)
+{
+	if (frozen == NULL) {
+		ERROR(return 0, "`frozen` argument is NULL.\n");
+	}
+	if (key == NULL) {
+		ERROR(return 0, "`key` argument is NULL.\n");
+	}
+	if (frozen->kind != KIND_NONE) {
+		size_t rank = stree_lower_bound(frozen, key);
+		return rank < frozen->size ? rank + 1 : 0;
+	}
+
+	size_t k = 1;
+
+	while (k <= frozen->size) {
+		size_t ahead = k << FROZEN_PREFETCH_LEVELS;
+		if (ahead <= frozen->size) {
+			PREFETCH(frozen_elem(frozen, ahead));
+		}
+		k = 2 * k + (frozen->cmp(key, frozen_elem(frozen, k)) > 0);
+	}
+	while (k & 1) {
+		k >>= 1;
+	}
+	return k >> 1;
+}
+
+bool bst_frozen_contains(bst_frozen_t* frozen, const void* key)
+{
+	size_t k = bst_frozen_lower_bound(frozen, key);
+
+	return k != 0 && frozen->cmp(key, frozen_elem(frozen, k)) == 0;
+}
+
+size_t bst_frozen_first(bst_frozen_t* frozen)
+{
+	if (frozen == NULL) {
+		ERROR(return 0, "`frozen` argument is NULL.\n");
+	}
+	return frozen_first(frozen);
+}
+
+size_t bst_frozen_next(bst_frozen_t* frozen, size_t pos)
+{
+	if (frozen == NULL) {
+		ERROR(return 0, "`frozen` argument is NULL.\n");
+	}
+	if (pos == 0 || pos > frozen->size) {
+		return 0;
+	}
+	return frozen_next(frozen, pos);
+}
+
+void* bst_frozen_data(bst_frozen_t* frozen, size_t pos)
+{
+	if (frozen == NULL || pos == 0 || pos > frozen->size) {
+		return NULL;
+	}
+	return frozen_elem(frozen, pos);
+}
+
+/* The file written by `bst_save` is this header followed by the arrays of a
+ * frozen snapshot, each at an offset that is a multiple of STREE_BLOCK_BYTES,
+ * so that once the file is mapped (at a page boundary), the arrays can be used
+ * where they are: positions in them are indices, never addresses. The numbers
+ * are stored as the machine that saved them represents them; `order` and
+ * `word_size` reject files from machines that differ. */
+#define FROZEN_MAGIC	"BSTFROZ1"
+#define FROZEN_ORDER	0x01020304u
+
+typedef struct {
+	char		magic[8];
+	uint32_t	order;
+	uint32_t	word_size;	/* `sizeof(size_t)`, for the ranks. */
+	uint64_t	kind;
+	uint64_t	elem_size;
+	uint64_t	size;
+	uint64_t	blocks;
+	uint64_t	block_keys;
+	uint64_t	elems;		/* Offsets of the arrays. */
+	uint64_t	keys;
+	uint64_t	ranks;
+	uint64_t	end;
+} frozen_header_t;
+
+static uint64_t frozen_align(uint64_t offset)
+{
+	return (offset + STREE_BLOCK_BYTES - 1) / STREE_BLOCK_BYTES *
+	       STREE_BLOCK_BYTES;
+}
+
+/* Write `len` bytes of `data`, preceded by zeros up to `offset`. */
+static bool frozen_write(FILE* file, uint64_t offset, const void* data,
+			 uint64_t len)
+{
+	static const char zeros[STREE_BLOCK_BYTES];
+	long pos = ftell(file);
+
+	if (pos < 0 || (uint64_t)pos > offset ||
+	    fwrite(zeros, 1, offset - (uint64_t)pos, file) !=
+	    offset - (uint64_t)pos) {
+		return false;
+	}
+	return len == 0 || fwrite(data, 1, len, file) == len;
+}
+
+/* The file is written next to `path` and then renamed, so that processes that
+ * have mapped an earlier version keep seeing it whole. */
+bool bst_save(bst_t* bst, const char* path)
+{
+	if (path == NULL) {
+		ERROR(return false, "`path` argument is NULL.\n");
+	}
+
+	bst_frozen_t*	frozen	= bst_freeze(bst);
+	frozen_header_t	header	= { FROZEN_MAGIC, FROZEN_ORDER, 0, 0, 0, 0,
+				    0, 0, 0, 0, 0, 0 };
+	char*		tmp;
+	FILE*		file;
+	bool		ok;
+
+	if (frozen == NULL) {
+		return false;
+	}
+	header.word_size	= sizeof(size_t);
+	header.kind		= frozen->kind;
+	header.elem_size	= frozen->elem_size;
+	header.size		= frozen->size;
+	header.blocks		= frozen->blocks;
+	header.block_keys	= frozen->block_keys;
+	header.elems		= frozen_align(sizeof header);
+	header.keys		= frozen_align(header.elems +
+					       (header.size + 1) *
+					       header.elem_size);
+	header.ranks		= frozen_align(header.keys + header.blocks *
+					       STREE_BLOCK_BYTES);
+	header.end		= header.ranks + header.blocks *
+				  header.block_keys * sizeof(size_t);
+
+	if ((tmp = malloc(strlen(path) + sizeof ".tmp")) == NULL) {
+		bst_frozen_free(frozen);
+		ERROR(return false, MALLOC_FAIL);
+	}
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+
+	if ((file = fopen(tmp, "wb")) == NULL) {
+		free(tmp);
+		bst_frozen_free(frozen);
+		ERROR(return false, "Could not open \"%s\".\n", path);
+	}
+	ok = frozen_write(file, 0, &header, sizeof header) &&
+	     frozen_write(file, header.elems, frozen->elems,
+			  (header.size + 1) * header.elem_size) &&
+	     frozen_write(file, header.keys, frozen->keys,
+			  header.blocks * STREE_BLOCK_BYTES) &&
+	     frozen_write(file, header.ranks, frozen->ranks,
+			  header.end - header.ranks);
+	ok = fclose(file) == 0 && ok;
+	ok = ok && rename(tmp, path) == 0;
+	if (!ok) {
+		remove(tmp);
+	}
+	free(tmp);
+	bst_frozen_free(frozen);
+	if (!ok) {
+		ERROR(return false, "Could not write \"%s\".\n", path);
+	}
+	return true;
+}
+
+/* Check that `header` describes a file of `file_size` bytes that was saved on a
+ * machine like this one, by a tree with elements like those `cmp` takes. */
+static bool frozen_check(const frozen_header_t* header, uint64_t file_size,
+			 int (*cmp)(const void*, const void*))
+{
+	uint64_t elems_len;
+
+	if (memcmp(header->magic, FROZEN_MAGIC, sizeof header->magic) != 0 ||
+	    header->order != FROZEN_ORDER ||
+	    header->word_size != sizeof(size_t) ||
+	    header->elem_size == 0 || header->elem_size > SIZE_MAX ||
+	    header->size >= UINT64_MAX / header->elem_size ||
+	    header->end > file_size) {
+		return false;
+	}
+	elems_len = (header->size + 1) * header->elem_size;
+	if (header->elems % STREE_BLOCK_BYTES != 0 ||
+	    header->elems < sizeof *header ||
+	    header->elems > header->end ||
+	    elems_len > header->end - header->elems) {
+		return false;
+	}
+	if (header->kind != (header->size == 0 ? KIND_NONE :
+			     key_kind(cmp, (size_t)header->elem_size))) {
+		return false;
+	}
+	/* Without a search tree, `keys` and `ranks` are not used: see
+	 * `bst_load`. */
+	if (header->kind == KIND_NONE) {
+		return header->blocks == 0;
+	}
+	/* The number of blocks follows from the size, which is bounded by the
+	 * size of the file, so none of this overflows. */
+	return header->block_keys ==
+	       STREE_BLOCK_BYTES / header->elem_size &&
+	       header->blocks ==
+	       (header->size + header->block_keys - 1) / header->block_keys &&
+	       header->keys % STREE_BLOCK_BYTES == 0 &&
+	       header->keys >= header->elems + elems_len &&
+	       header->ranks >= header->keys &&
+	       header->ranks - header->keys >=
+	       header->blocks * STREE_BLOCK_BYTES &&
+	       header->ranks % sizeof(size_t) == 0 &&
+	       header->end >= header->ranks &&
+	       header->end - header->ranks ==
+	       header->blocks * header->block_keys * sizeof(size_t);
+}
+
+bst_frozen_t* bst_load(const char* path, int (*cmp)(const void*, const void*))
+{
+	if (path == NULL) {
+		ERROR(return NULL, "`path` argument is NULL.\n");
+	}
+	if (cmp == NULL) {
+		ERROR(return NULL, "`cmp` argument may not be NULL.\n");
+	}
+
+	int		fd	= open(path, O_RDONLY);
+	struct stat	st;
+	char*		map;
+	bst_frozen_t*	frozen;
+
+	if (fd < 0) {
+		ERROR(return NULL, "Could not open \"%s\".\n", path);
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(frozen_header_t)
+	    || (uint64_t)st.st_size > SIZE_MAX) {
+		close(fd);
+		ERROR(return NULL, "\"%s\" is not a saved BST.\n", path);
+	}
+	/* The mapping outlives the descriptor. */
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ERROR(return NULL, "Could not map \"%s\".\n", path);
+	}
+
+	frozen_header_t header;
+
+	memcpy(&header, map, sizeof header);
+	if (!frozen_check(&header, (uint64_t)st.st_size, cmp)) {
+		munmap(map, (size_t)st.st_size);
+		ERROR(return NULL, "\"%s\" is not a BST saved on this machine "
+				   "with elements like `cmp` takes.\n", path);
+	}
+	if ((frozen = malloc(sizeof *frozen)) == NULL) {
+		munmap(map, (size_t)st.st_size);
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	frozen->elems		= map + header.elems;
+	frozen->size		= (size_t)header.size;
+	frozen->elem_size	= (size_t)header.elem_size;
+	frozen->cmp		= cmp;
+	frozen->kind		= (key_kind_t)header.kind;
+	frozen->keys		= NULL;
+	frozen->keys_raw	= NULL;
+	frozen->ranks		= NULL;
+	frozen->blocks		= 0;
+	frozen->block_keys	= 0;
+	frozen->map		= map;
+	frozen->map_size	= (size_t)st.st_size;
+	/* The offsets of the search tree were only checked if there is one. */
+	if (frozen->kind != KIND_NONE) {
+		frozen->keys		= map + header.keys;
+		frozen->ranks		= (size_t*)(map + header.ranks);
+		frozen->blocks		= (size_t)header.blocks;
+		frozen->block_keys	= (size_t)header.block_keys;
+		stree_kernel(frozen);
+	}
+	return frozen;
+}
+
+
+
+/*==============================================================================
+	B-TREE
+==============================================================================*/
+
+/* Minimum degree: every node but the root holds between BTREE_MIN - 1 and
+ * 2 * BTREE_MIN - 1 keys. With 15 keys and 16 children an inner node spans
+ * four cache lines; a leaf, which has no child array, spans two. */
+#define BTREE_MIN	8
+#define BTREE_MAX_KEYS	(2 * BTREE_MIN - 1)
+
+struct btree_node_t {
+	int		count;
+	bool		leaf;
+	void*		keys[BTREE_MAX_KEYS];
+	btree_node_t*	children[];	/* BTREE_MAX_KEYS + 1, if not a leaf. */
+};
+
+static btree_node_t* btree_node_new(bool leaf)
+{
+	size_t		size = sizeof(btree_node_t);
+	btree_node_t*	node;
+
+	if (!leaf) {
+		size += (BTREE_MAX_KEYS + 1) * sizeof(btree_node_t*);
+	}
+	node = malloc(size);
+	if (node == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	node->count	= 0;
+	node->leaf	= leaf;
+	return node;
+}
+
+/* Return the index of the first key in `node` not smaller than `data`, and
+ * whether that key is equal to it. A binary search keeps the number of calls
+ * to `cmp` at about log2(BTREE_MAX_KEYS) per node; they are added to `cmps`. */
+static int btree_search(bst_t* bst, btree_node_t* node, const void* data,
+			bool* found, size_t* cmps)
+{
+	int lo = 0, hi = node->count;
+
+	*found = false;
+	while (lo < hi) {
+		int mid		= (lo + hi) / 2;
+		int cmp_result	= bst->cmp(data, node->keys[mid]);
+		*cmps += 1;
+		if (cmp_result == 0) {
+			*found = true;
+			return mid;
+		} else if (cmp_result < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+static void* btree_find(bst_t* bst, const void* data)
+{
+	btree_node_t*	node	= bst->btree;
+	void*		key	= NULL;
+	size_t		depth	= 0;
+	size_t		cmps	= 0;
+
+	while (node != NULL) {
+		bool	found;
+		int	i = btree_search(bst, node, data, &found, &cmps);
+		depth += 1;
+		if (found) {
+			key = node->keys[i];
+			break;
+		}
+		node = node->leaf ? NULL : node->children[i];
+	}
+	STATS_ADD(bst, lookups, 1);
+	STATS_ADD(bst, lookup_comparisons, cmps);
+	STATS_ADD(bst, lookup_depths[depth < BST_STATS_DEPTHS ? depth
+						: BST_STATS_DEPTHS - 1], 1);
+	return key;
+}
+
+/* Split the full child `i` of `parent` in two, moving its median key up. */
+static bool btree_split_child(btree_node_t* parent, int i)
+{
+	btree_node_t* child = parent->children[i];
+	btree_node_t* right = btree_node_new(child->leaf);
+
+	if (right == NULL) {
+		return false;
+	}
+	right->count = BTREE_MIN - 1;
+	memcpy(right->keys, child->keys + BTREE_MIN,
+	       (BTREE_MIN - 1) * sizeof(void*));
+	if (!child->leaf) {
+		memcpy(right->children, child->children + BTREE_MIN,
+		       BTREE_MIN * sizeof(btree_node_t*));
+	}
+	child->count = BTREE_MIN - 1;
+
+	memmove(parent->children + i + 2, parent->children + i + 1,
+		(parent->count - i) * sizeof(btree_node_t*));
+	memmove(parent->keys + i + 1, parent->keys + i,
+		(parent->count - i) * sizeof(void*));
+	parent->children[i + 1]	= right;
+	parent->keys[i]		= child->keys[BTREE_MIN - 1];
+	parent->count		+= 1;
+	return true;
+}
+
+/* Single top-down pass: full nodes are split on the way down, so that there is
+ * always room for the key that may be pushed up from below. */
+/* Like `bst_insert`, in a single descent that splits the full nodes on the
+ * way down. */
+static void* btree_insert(bst_t*	bst,
+			  const void*	key,
+			  const void*	value,
+			  bool		replace,
+			  bool*		added)
+{
+	if (bst->btree == NULL && (bst->btree = btree_node_new(true)) == NULL) {
+		return NULL;
+	}
+	if (bst->btree->count == BTREE_MAX_KEYS) {
+		btree_node_t* root = btree_node_new(false);
+		if (root == NULL) {
+			return NULL;
+		}
+		root->children[0] = bst->btree;
+		if (!btree_split_child(root, 0)) {
+			free(root);
+			return NULL;
+		}
+		bst->btree = root;
+		STATS_ADD(bst, rebalances, 1);
+	}
+
+	btree_node_t*	node	= bst->btree;
+	size_t		depth	= 0;
+	size_t		cmps	= 0;
+
+	for (;;) {
+		bool	found;
+		int	i = btree_search(bst, node, key, &found, &cmps);
+
+		depth += 1;
+		if (!found && node->leaf) {
+			void* copy = elem_new(bst, key, value);
+			if (copy == NULL) {
+				return NULL;
+			}
+			memmove(node->keys + i + 1, node->keys + i,
+				(node->count - i) * sizeof(void*));
+			node->keys[i]	= copy;
+			node->count	+= 1;
+			bst->size	+= 1;
+			STATS_ADD(bst, adds, 1);
+			STATS_ADD(bst, add_comparisons, cmps);
+			STATS_HEIGHT(bst, depth);
+			*added = true;
+			return copy;
+		}
+		if (!found && node->children[i]->count == BTREE_MAX_KEYS) {
+			if (!btree_split_child(node, i)) {
+				return NULL;
+			}
+			STATS_ADD(bst, rebalances, 1);
+
+			int cmp_result = bst->cmp(key, node->keys[i]);
+			cmps += 1;
+			found = cmp_result == 0;
+			i += cmp_result > 0;
+		}
+		if (found) {
+			STATS_ADD(bst, adds, 1);
+			STATS_ADD(bst, add_comparisons, cmps);
+			if (replace) {
+				elem_replace(bst, &node->keys[i], key, value);
+			}
+			return node->keys[i];
+		}
+		node = node->children[i];
+	}
+}
+
+/* Merge child `i + 1` of `parent` and the key between them into child `i`. */
+static void btree_merge(btree_node_t* parent, int i)
+{
+	btree_node_t* left  = parent->children[i];
+	btree_node_t* right = parent->children[i + 1];
+
+	left->keys[left->count] = parent->keys[i];
+	memcpy(left->keys + left->count + 1, right->keys,
+	       right->count * sizeof(void*));
+	if (!left->leaf) {
+		memcpy(left->children + left->count + 1, right->children,
+		       (right->count + 1) * sizeof(btree_node_t*));
+	}
+	left->count += right->count + 1;
+
+	memmove(parent->keys + i, parent->keys + i + 1,
+		(parent->count - i - 1) * sizeof(void*));
+	memmove(parent->children + i + 1, parent->children + i + 2,
+		(parent->count - i - 1) * sizeof(btree_node_t*));
+	parent->count -= 1;
+	free(right);
+}
+
+/* Make sure child `i` of `parent` has at least BTREE_MIN keys before the
+ * deletion descends into it, by borrowing from a sibling or merging with one.
+ * Return the index of the child to descend into. */
+static int btree_fill_child(btree_node_t* parent, int i)
+{
+	btree_node_t* child = parent->children[i];
+
+	if (i > 0 && parent->children[i - 1]->count >= BTREE_MIN) {
+		btree_node_t* left = parent->children[i - 1];
+		memmove(child->keys + 1, child->keys,
+			child->count * sizeof(void*));
+		if (!child->leaf) {
+			memmove(child->children + 1, child->children,
+				(child->count + 1) * sizeof(btree_node_t*));
+			child->children[0] = left->children[left->count];
+		}
+		child->keys[0]		= parent->keys[i - 1];
+		parent->keys[i - 1]	= left->keys[left->count - 1];
+		child->count		+= 1;
+		left->count		-= 1;
+		return i;
+	}
+	if (i < parent->count && parent->children[i + 1]->count >= BTREE_MIN) {
+		btree_node_t* right = parent->children[i + 1];
+		child->keys[child->count] = parent->keys[i];
+		if (!child->leaf) {
+			child->children[child->count + 1] = right->children[0];
+			memmove(right->children, right->children + 1,
+				right->count * sizeof(btree_node_t*));
+		}
+		parent->keys[i] = right->keys[0];
+		memmove(right->keys, right->keys + 1,
+			(right->count - 1) * sizeof(void*));
+		child->count		+= 1;
+		right->count		-= 1;
+		return i;
+	}
+	if (i == parent->count) {
+		i -= 1;
+	}
+	btree_merge(parent, i);
+	return i;
+}
+
+/* Single top-down pass, as in CLRS: every node descended into has a key to
+ * spare, so the removal at the bottom never has to propagate upwards. A key
+ * found in an inner node is replaced by its predecessor or successor, which
+ * is then removed from the subtree it came from. */
+static bool btree_delete(bst_t* bst, const void* data)
+{
+	btree_node_t*	node	= bst->btree;
+	const void*	key	= data;
+	void*		victim	= NULL;
+	size_t		cmps	= 0;
+
+	while (node != NULL) {
+		bool	found;
+		int	i = btree_search(bst, node, key, &found, &cmps);
+
+		if (found && victim == NULL) {
+			victim = node->keys[i];
+		}
+		if (node->leaf) {
+			if (!found) {
+				break;
+			}
+			memmove(node->keys + i, node->keys + i + 1,
+				(node->count - i - 1) * sizeof(void*));
+			node->count -= 1;
+			break;
+		}
+		if (found) {
+			btree_node_t* left  = node->children[i];
+			btree_node_t* right = node->children[i + 1];
+			if (left->count >= BTREE_MIN) {
+				btree_node_t* pred = left;
+				while (!pred->leaf) {
+					pred = pred->children[pred->count];
+				}
+				key = node->keys[i] = pred->keys[pred->count-1];
+				node = left;
+				continue;
+			}
+			if (right->count >= BTREE_MIN) {
+				btree_node_t* succ = right;
+				while (!succ->leaf) {
+					succ = succ->children[0];
+				}
+				key = node->keys[i] = succ->keys[0];
+				node = right;
+				continue;
+			}
+			btree_merge(node, i);
+			STATS_ADD(bst, rebalances, 1);
+		} else if (node->children[i]->count < BTREE_MIN) {
+			i = btree_fill_child(node, i);
+			STATS_ADD(bst, rebalances, 1);
+		}
+
+		/* A merge may have emptied the root. */
+		if (node == bst->btree && node->count == 0) {
+			bst->btree = node->children[0];
+			free(node);
+			node = bst->btree;
+			continue;
+		}
+		node = node->children[i];
+	}
+
+	if (bst->btree != NULL && bst->btree->count == 0) {
+		free(bst->btree);
+		bst->btree = NULL;
+	}
+	STATS_ADD(bst, deletes, 1);
+	STATS_ADD(bst, delete_comparisons, cmps);
+	if (victim == NULL) {
+		return false;
+	}
+	elem_free(bst, victim);
+	bst->size -= 1;
+	return true;
+}
+
+static size_t btree_height(btree_node_t* node)
+{
+	size_t height = 0;
+
+	while (node != NULL) {
+		height += 1;
+		node = node->leaf ? NULL : node->children[0];
+	}
+	return height;
+}
+
+/* The depth of a B-tree is logarithmic with a large base, so the walks below
+ * may safely recurse. */
+#ifdef BST_STATS
+static size_t btree_bytes(btree_node_t* node)
+{
+	if (node == NULL) {
+		return 0;
+	}
+	if (node->leaf) {
+		return sizeof *node;
+	}
+
+	size_t bytes = sizeof *node +
+		       (BTREE_MAX_KEYS + 1) * sizeof(btree_node_t*);
+
+	for (int i = 0; i <= node->count; ++i) {
+		bytes += btree_bytes(node->children[i]);
+	}
+	return bytes;
+}
+#endif
+
+static void btree_free_nodes(bst_t* bst, btree_node_t* node)
+{
+	if (node == NULL) {
+		return;
+	}
+	for (int i = 0; i < node->count; ++i) {
+		if (!node->leaf) {
+			btree_free_nodes(bst, node->children[i]);
+		}
+		elem_free(bst, node->keys[i]);
+	}
+	if (!node->leaf) {
+		btree_free_nodes(bst, node->children[node->count]);
+	}
+	free(node);
+}
+
+/* Free the keys and nodes of a B-tree whose filling failed, leaving `bst`
+ * empty. Its elements were never handed to `bst`, so `data_free` is not called
+ * on them; only the copies made for them are freed. */
+static void btree_discard(bst_t* bst)
+{
+	void (*data_free)(void* data) = bst->data_free;
+
+	bst->data_free = bst->type == BST_COPIED ? free : NULL;
+	btree_free_nodes(bst, bst->btree);
+	bst->data_free	= data_free;
+	bst->btree	= NULL;
+	bst->size	= 0;
+}
+
+/* Visit the keys in `order`. For ORDER_PRE and ORDER_POST, the keys of a node
+ * are visited together, before or after all of its children. */
+static void btree_walk(btree_node_t*		node,
+		       traversal_order_t	order,
+		       void			(*visit)(void* ctx, void* data),
+		       void*			ctx)
+{
+	if (node == NULL) {
+		return;
+	}
+	if (order == ORDER_PRE) {
+		for (int i = 0; i < node->count; ++i) {
+			visit(ctx, node->keys[i]);
+		}
+	}
+	for (int i = 0; i <= node->count; ++i) {
+		if (!node->leaf) {
+			btree_walk(node->children[i], order, visit, ctx);
+		}
+		if (order == ORDER_IN && i < node->count) {
+			visit(ctx, node->keys[i]);
+		}
+	}
+	if (order == ORDER_POST) {
+		for (int i = 0; i < node->count; ++i) {
+			visit(ctx, node->keys[i]);
+		}
+	}
+}
+
+static void btree_print(btree_node_t*	node,
+			void		(*print)(void* data),
+			int		level)
+{
+	printf("  ");
+	for (int i = 0; i < level; ++i) {
+		printf("%s", i == 0 ? "|——" : "———");
+	}
+	if (node == NULL) {
+		printf("( )\n");
+		return;
+	}
+	printf("(");
+	for (int i = 0; i < node->count; ++i) {
+		printf(i == 0 ? "" : " ");
+		print(node->keys[i]);
+	}
+	printf(")\n");
+	for (int i = 0; !node->leaf && i <= node->count; ++i) {
+		btree_print(node->children[i], print, level + 1);
+	}
+}
+
+
+
+/*==============================================================================
+	COMPACT
+==============================================================================*/
+
+/* The top bit of a link marks the taller side, which leaves 31 bits for the
+ * index; slot 0 is never handed out, as index 0 stands for no node. */
+#define COMPACT_HEAVY	0x80000000u
+#define COMPACT_INDEX	0x7fffffffu
+#define COMPACT_FIRST	64
+
+static inline uint32_t compact_child(compact_node_t*	nodes,
+				     uint32_t		index,
+				     int		dir)
+{
+	return nodes[index].link[dir] & COMPACT_INDEX;
+}
+
+/* Keep the balance bit of the link. */
+static inline void compact_set_child(compact_node_t*	nodes,
+				     uint32_t		index,
+				     int		dir,
+				     uint32_t		child)
+{
+	nodes[index].link[dir] = (nodes[index].link[dir] & COMPACT_HEAVY) |
+				 child;
+}
+
+/* The height of the right subtree less that of the left: -1, 0 or 1. */
+static inline int compact_balance(compact_node_t* nodes, uint32_t index)
+{
+	return (int)(nodes[index].link[1] >> 31) -
+	       (int)(nodes[index].link[0] >> 31);
+}
+
+static inline void compact_set_balance(compact_node_t*	nodes,
+				       uint32_t		index,
+				       int		balance)
+{
+	nodes[index].link[0] = (nodes[index].link[0] & COMPACT_INDEX) |
+			       (balance < 0 ? COMPACT_HEAVY : 0);
+	nodes[index].link[1] = (nodes[index].link[1] & COMPACT_INDEX) |
+			       (balance > 0 ? COMPACT_HEAVY : 0);
+}
+
+/* Make sure that a node can be taken without growing the array, which moves
+ * it: an add grows it before it descends. */
+static bool compact_reserve(bst_t* bst)
+{
+	compact_t* tree = &bst->compact;
+
+	if (tree->free != 0 || tree->used < tree->cap) {
+		return true;
+	}
+	if (tree->cap > COMPACT_INDEX) {
+		ERROR(return false, "A BST_COMPACT tree holds at most 2^31 - 1 "
+				    "elements.\n");
+	}
+
+	/* Doubling, up to the 2^31 slots that 31 bits can tell apart. */
+	uint32_t	cap	= tree->cap == 0 ? COMPACT_FIRST
+				: tree->cap <= COMPACT_INDEX / 2 ? tree->cap * 2
+				: COMPACT_INDEX + 1;
+	compact_node_t*	nodes	= realloc(tree->nodes, cap * sizeof *nodes);
+
+	if (nodes == NULL) {
+		ERROR(return false, MALLOC_FAIL);
+	}
+	tree->nodes	= nodes;
+	tree->cap	= cap;
+	if (tree->used == 0) {
+		tree->used = 1;
+	}
+	return true;
+}
+
+static uint32_t compact_take(compact_t* tree, void* data)
+{
+	uint32_t index = tree->free;
+
+	if (index != 0) {
+		tree->free = tree->nodes[index].link[0];
+	} else {
+		index = tree->used++;
+	}
+	tree->nodes[index].data		= data;
+	tree->nodes[index].link[0]	= 0;
+	tree->nodes[index].link[1]	= 0;
+	return index;
+}
+
+/* The data of a slot not in use is NULL, which `compact_free_nodes` relies
+ * on. */
+static void compact_release(compact_t* tree, uint32_t index)
+{
+	tree->nodes[index].data		= NULL;
+	tree->nodes[index].link[0]	= tree->free;
+	tree->free			= index;
+}
+
+/* Like KIND_FIND. */
+#define COMPACT_FIND(TYPE)						\
+do {									\
+	TYPE key = *(const TYPE*)data;					\
+	while (index != 0) {						\
+		TYPE other = *(const TYPE*)nodes[index].data;		\
+		depth += 1;						\
+		if (key == other) {					\
+			goto done;					\
+		}							\
+		index = compact_child(nodes, index, key < other ? 0 : 1);\
+	}								\
+	goto done;							\
+} while (0)
+
+static void* compact_find(bst_t* bst, const void* data)
+{
+	compact_node_t*	nodes	= bst->compact.nodes;
+	uint32_t	index	= bst->compact.root;
+	size_t		depth	= 0;
+
+	switch (bst->kind) {
+	case KIND_INT32:	COMPACT_FIND(int32_t);
+	case KIND_INT64:	COMPACT_FIND(int64_t);
+	case KIND_UINT64:	COMPACT_FIND(uint64_t);
+	case KIND_DOUBLE:	COMPACT_FIND(double);
+	default:
+		break;
+	}
+	while (index != 0) {
+		int cmp_result = bst->cmp(data, nodes[index].data);
+		depth += 1;
+		if (cmp_result == 0) {
+			break;
+		}
+		index = compact_child(nodes, index, cmp_result > 0);
+	}
+done:
+	STATS_ADD(bst, lookups, 1);
+	STATS_ADD(bst, lookup_comparisons, depth);
+	STATS_ADD(bst, lookup_depths[depth < BST_STATS_DEPTHS ? depth
+						: BST_STATS_DEPTHS - 1], 1);
+	return index == 0 ? NULL : nodes[index].data;
+}
+
+/* Rotate at the node `index`, whose `dir` subtree is two levels taller than
+ * the other, and return the root of the rotated subtree. `shorter` tells
+ * whether that is lower than the subtree was before the add or delete that
+ * unbalanced it, which after a delete means the parent is to be fixed too. */
+static uint32_t compact_rotate(bst_t*	bst,
+			       uint32_t	index,
+			       int	dir,
+			       bool*	shorter)
+{
+	compact_node_t*	nodes	= bst->compact.nodes;
+	int		sign	= dir ? 1 : -1;
+	uint32_t	child	= compact_child(nodes, index, dir);
+	int		balance	= compact_balance(nodes, child);
+
+	if (balance == -sign) {
+		uint32_t	grand	= compact_child(nodes, child, !dir);
+		int		inner	= compact_balance(nodes, grand);
+
+		compact_set_child(nodes, child, !dir,
+				  compact_child(nodes, grand, dir));
+		compact_set_child(nodes, grand, dir, child);
+		compact_set_child(nodes, index, dir,
+				  compact_child(nodes, grand, !dir));
+		compact_set_child(nodes, grand, !dir, index);
+		compact_set_balance(nodes, index, inner == sign ? -sign : 0);
+		compact_set_balance(nodes, child, inner == -sign ? sign : 0);
+		compact_set_balance(nodes, grand, 0);
+		STATS_ADD(bst, rebalances, 2);
+		*shorter = true;
+		return grand;
+	}
+	compact_set_child(nodes, index, dir, compact_child(nodes, child, !dir));
+	compact_set_child(nodes, child, !dir, index);
+	compact_set_balance(nodes, index, balance == 0 ? sign : 0);
+	compact_set_balance(nodes, child, balance == 0 ? -sign : 0);
+	STATS_ADD(bst, rebalances, 1);
+	*shorter = balance != 0;
+	return child;
+}
+
+/* Hang the subtree `index` where `path[depth]` was. */
+static void compact_relink(bst_t*	bst,
+			   uint32_t	path[],
+			   unsigned char dirs[],
+			   size_t	depth,
+			   uint32_t	index)
+{
+	if (depth == 0) {
+		bst->compact.root = index;
+	} else {
+		compact_set_child(bst->compact.nodes, path[depth - 1],
+				  dirs[depth - 1], index);
+	}
+}
+
+/* Walk back up `path`, below which a node has been added (`added`) or removed,
+ * updating the balance factors until the height of a subtree turns out not
+ * to have changed. */
+static void compact_retrace(bst_t*		bst,
+			    uint32_t		path[],
+			    unsigned char	dirs[],
+			    size_t		depth,
+			    bool		added)
+{
+	compact_node_t*	nodes = bst->compact.nodes;
+	bool		shorter;
+
+	while (depth-- > 0) {
+		uint32_t	index	= path[depth];
+		int		sign	= dirs[depth] ? 1 : -1;
+		int		balance	= compact_balance(nodes, index);
+
+		balance += added ? sign : -sign;
+		if (balance == -1 || balance == 1) {
+			compact_set_balance(nodes, index, balance);
+			if (added) {
+				continue;
+			}
+			return;
+		}
+		if (balance == 0) {
+			compact_set_balance(nodes, index, 0);
+			if (added) {
+				return;
+			}
+			continue;
+		}
+		index = compact_rotate(bst, index, balance > 0, &shorter);
+		compact_relink(bst, path, dirs, depth, index);
+		if (added || !shorter) {
+			return;
+		}
+	}
+}
+
+/* Like `bst_insert`. With BST_AVL, the path is kept for `compact_retrace`; an
+ * AVL tree is never deeper than AVL_MAX_HEIGHT. */
+static void* compact_insert(bst_t*	bst,
+			    const void*	key,
+			    const void*	value,
+			    bool	replace,
+			    bool*	added)
+{
+	uint32_t	path[AVL_MAX_HEIGHT];
+	unsigned char	dirs[AVL_MAX_HEIGHT];
+	size_t		depth	= 0;
+	bool		avl	= bst->mode & BST_AVL;
+	uint32_t	parent	= 0;
+	int		dir	= 0;
+	void*		elem;
+
+	if (!compact_reserve(bst)) {
+		return NULL;
+	}
+
+	compact_node_t*	nodes	= bst->compact.nodes;
+	uint32_t	index	= bst->compact.root;
+
+	while (index != 0) {
+		int cmp_result = key_cmp(bst, key, nodes[index].data);
+		if (cmp_result == 0) {
+			STATS_ADD(bst, adds, 1);
+			STATS_ADD(bst, add_comparisons, depth + 1);
+			if (replace) {
+				elem_replace(bst, &nodes[index].data, key,
+					     value);
+			}
+			return nodes[index].data;
+		}
+		dir = cmp_result > 0;
+		if (avl) {
+			path[depth] = index;
+			dirs[depth] = (unsigned char)dir;
+		}
+		depth	+= 1;
+		parent	= index;
+		index	= compact_child(nodes, index, dir);
+	}
+
+	if ((elem = elem_new(bst, key, value)) == NULL) {
+		return NULL;
+	}
+	index = compact_take(&bst->compact, elem);
+	if (parent == 0) {
+		bst->compact.root = index;
+	} else {
+		compact_set_child(nodes, parent, dir, index);
+	}
+	if (avl) {
+		compact_retrace(bst, path, dirs, depth, true);
+	}
+	bst->size += 1;
+	STATS_ADD(bst, adds, 1);
+	STATS_ADD(bst, add_comparisons, depth);
+	STATS_HEIGHT(bst, depth + 1);
+	*added = true;
+	return elem;
+}
+
+/* Like `bst_delete_node`. A node with two children takes the element of its
+ * successor, whose node is removed instead. */
+static bool compact_delete(bst_t* bst, const void* data)
+{
+	uint32_t	path[AVL_MAX_HEIGHT];
+	unsigned char	dirs[AVL_MAX_HEIGHT];
+	size_t		depth	= 0;
+	bool		avl	= bst->mode & BST_AVL;
+	compact_node_t*	nodes	= bst->compact.nodes;
+	uint32_t	index	= bst->compact.root;
+	uint32_t	parent	= 0;
+	int		dir	= 0;
+	size_t		cmps	= 0;
+
+	while (index != 0) {
+		int cmp_result = key_cmp(bst, data, nodes[index].data);
+		cmps += 1;
+		if (cmp_result == 0) {
+			break;
+		}
+		dir = cmp_result > 0;
+		if (avl) {
+			path[depth] = index;
+			dirs[depth] = (unsigned char)dir;
+		}
+		depth	+= 1;
+		parent	= index;
+		index	= compact_child(nodes, index, dir);
+	}
+	STATS_ADD(bst, deletes, 1);
+	STATS_ADD(bst, delete_comparisons, cmps);
+	if (index == 0) {
+		return false;
+	}
+
+	void* victim = nodes[index].data;
+
+	if (compact_child(nodes, index, 0) != 0 &&
+	    compact_child(nodes, index, 1) != 0) {
+		uint32_t target = index;
+
+		for (dir = 1; ; dir = 0) {
+			if (avl) {
+				path[depth] = index;
+				dirs[depth] = (unsigned char)dir;
+			}
+			depth	+= 1;
+			parent	= index;
+			index	= compact_child(nodes, index, dir);
+			if (compact_child(nodes, index, 0) == 0) {
+				break;
+			}
+		}
+		nodes[target].data = nodes[index].data;
+	}
+
+	uint32_t child = compact_child(nodes, index, 0) != 0
+		       ? compact_child(nodes, index, 0)
+		       : compact_child(nodes, index, 1);
+
+	if (parent == 0) {
+		bst->compact.root = child;
+	} else {
+		compact_set_child(nodes, parent, dir, child);
+	}
+	compact_release(&bst->compact, index);
+	if (avl) {
+		compact_retrace(bst, path, dirs, depth, false);
+	}
+	elem_free(bst, victim);
+	bst->size -= 1;
+	return true;
+}
+
+/* Visit the elements in `order` (unless `visit` is NULL). The frames of the
+ * stack hold an index and how far its node has been dealt with instead of a
+ * node: 0 when just reached, 1 when its left subtree is done and 2 when its
+ * right one is, which are also the orders in which it is visited then. Only
+ * ORDER_POST needs a node again after its right subtree; it keeps every node
+ * on the stack with its ancestors, so the height is returned for it. */
+static size_t compact_walk(bst_t*			bst,
+			   traversal_order_t	order,
+			   void			(*visit)(void* ctx, void* data),
+			   void*		ctx)
+{
+	compact_node_t*	nodes	= bst->compact.nodes;
+	uint32_t	index	= bst->compact.root;
+	node_stack_t	stack;
+	size_t		state;
+	node_t*		unused;
+	size_t		height	= 0;
+
+	stack_init(&stack);
+	/* Used by all the functions that flatten the tree, and done like
+	 * `bst_execute_inorder`, with a single frame per node. */
+	if (order == ORDER_IN && visit != NULL) {
+		for (;;) {
+			while (index != 0) {
+				if (!stack_push(&stack, NULL, index)) {
+					stack_free(&stack);
+					return 0;
+				}
+				index = compact_child(nodes, index, 0);
+			}
+			if (!stack_pop(&stack, &unused, &state)) {
+				break;
+			}
+			visit(ctx, nodes[state].data);
+			index = compact_child(nodes, (uint32_t)state, 1);
+		}
+		stack_free(&stack);
+		return 0;
+	}
+	if (index != 0 && !stack_push(&stack, NULL, (size_t)index << 2)) {
+		return 0;
+	}
+	while (stack_pop(&stack, &unused, &state)) {
+		size_t		stage	= state & 3;
+		uint32_t	child;
+
+		if (stack.len + 1 > height) {
+			height = stack.len + 1;
+		}
+		index = (uint32_t)(state >> 2);
+		if (visit != NULL && stage == (size_t)order) {
+			visit(ctx, nodes[index].data);
+		}
+		if (stage == 2) {
+			continue;
+		}
+		child = compact_child(nodes, index, (int)stage);
+		if (stage == 0 || order == ORDER_POST) {
+			if (!stack_push(&stack, NULL,
+					(size_t)index << 2 | (stage + 1))) {
+				break;
+			}
+		}
+		if (child != 0 &&
+		    !stack_push(&stack, NULL, (size_t)child << 2)) {
+			break;
+		}
+	}
+	stack_free(&stack);
+	return height;
+}
+
+/* With BST_AVL, the taller side is known at every node; otherwise every node
+ * is visited. */
+static size_t compact_height(bst_t* bst)
+{
+	compact_node_t*	nodes	= bst->compact.nodes;
+	uint32_t	index	= bst->compact.root;
+	size_t		height	= 0;
+
+	if (!(bst->mode & BST_AVL)) {
+		return compact_walk(bst, ORDER_POST, NULL, NULL);
+	}
+	for (; index != 0; height += 1) {
+		index = compact_child(nodes, index,
+				      compact_balance(nodes, index) > 0);
+	}
+	return height;
+}
+
+static void nodeless_walk(bst_t*		bst,
+			  traversal_order_t	order,
+			  void			(*visit)(void* ctx, void* data),
+			  void*			ctx)
+{
+	if (bst->mode & BST_BTREE) {
+		btree_walk(bst->btree, order, visit, ctx);
+	} else {
+		compact_walk(bst, order, visit, ctx);
+	}
+}
+
+/* The slots in use are those with data, so no walk is needed. */
+static void compact_free_nodes(bst_t* bst)
+{
+	compact_t* tree = &bst->compact;
+
+	for (uint32_t i = 1; bst->data_free != NULL && i < tree->used; ++i) {
+		if (tree->nodes[i].data != NULL) {
+			bst->data_free(tree->nodes[i].data);
+		}
+	}
+	free(tree->nodes);
+	*tree = (compact_t){ NULL, 0, 0, 0, 0 };
+}
+
+/* Link the elements `arr[first..last]` as a perfectly balanced subtree, laid
+ * out in preorder from slot `*next` on, and return the index of its root. The
+ * right half has at most one element more than the left, and so is never the
+ * lower one. */
+static uint32_t compact_link(bst_t*	bst,
+			     void*	arr[],
+			     size_t	first,
+			     size_t	last,
+			     uint32_t*	next)
+{
+	if (first > last) {
+		return 0;
+	}
+
+	compact_node_t*	nodes	= bst->compact.nodes;
+	size_t		mid	= first + (last - first) / 2;
+	uint32_t	index	= (*next)++;
+	size_t		left	= mid - first;
+	size_t		right	= last - mid;
+
+	nodes[index].data	= arr[mid];
+	nodes[index].link[0]	= left == 0 ? 0 : compact_link(bst, arr, first,
+							       mid - 1, next);
+	nodes[index].link[1]	= compact_link(bst, arr, mid + 1, last, next);
+	/* The heights are the bit lengths of the sizes. */
+	if ((bst->mode & BST_AVL) && right > left && (right & left) == 0) {
+		compact_set_balance(nodes, index, 1);
+	}
+	return index;
+}
+
+/* Replace the nodes of `bst` by a perfectly balanced tree of the `count`
+ * elements in `arr`, which are in order and unique, in a new array sized to
+ * fit. With `copy`, the elements are stored as by `bst_add`, otherwise as
+ * they are. The old nodes are freed, but not their elements. */
+static bool compact_build(bst_t* bst, void* arr[], size_t count, bool copy)
+{
+	compact_t	tree	= { NULL, 0, 0, 0, 0 };
+	uint32_t	next	= 1;
+
+	if (count > COMPACT_INDEX) {
+		ERROR(return false, "A BST_COMPACT tree holds at most 2^31 - 1 "
+				    "elements.\n");
+	}
+	if (count > 0) {
+		tree.cap	= (uint32_t)count + 1;
+		tree.used	= tree.cap;
+		tree.nodes	= malloc(tree.cap * sizeof *tree.nodes);
+		if (tree.nodes == NULL) {
+			ERROR(return false, MALLOC_FAIL);
+		}
+	}
+	for (size_t i = 0; copy && i < count; ++i) {
+		void* elem = elem_new(bst, arr[i], (char*)arr[i] +
+						   bst->value_offset);
+		if (elem == NULL) {
+			while (bst->type == BST_COPIED && i-- > 0) {
+				free(arr[i]);
+			}
+			free(tree.nodes);
+			return false;
+		}
+		arr[i] = elem;
+	}
+	free(bst->compact.nodes);
+	bst->compact = tree;
+	if (count > 0) {
+		bst->compact.root = compact_link(bst, arr, 0, count - 1, &next);
+	}
+	return true;
+}
+
+/* Return the elements in order, in an array of `bst->size + 1`. */
+static void** compact_flatten(bst_t* bst, size_t* size)
+{
+	void**	arr = malloc((bst->size + 1) * sizeof *arr);
+	void**	end = arr;
+
+	if (arr == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	compact_walk(bst, ORDER_IN, array_visit, &end);
+	*size = (size_t)(end - arr);
+	return arr;
+}
+
+/* Like `bst_balanced`. */
+static bst_t* compact_balanced(bst_t* bst)
+{
+	size_t	size	= 0;
+	void**	arr	= compact_flatten(bst, &size);
+	bst_t*	new_bst	= arr == NULL ? NULL : bst_new_like(bst);
+
+	if (new_bst != NULL && !compact_build(new_bst, arr, size, true)) {
+		bst_free(new_bst);
+		new_bst = NULL;
+	}
+	if (new_bst != NULL) {
+		new_bst->size = size;
+		STATS_REBUILT(new_bst);
+	}
+	free(arr);
+	return new_bst;
+}
+
+/* Like `bst_balance`. The elements stay where they are, but the nodes move to
+ * a new array, without the slots of deleted nodes. */
+static void compact_rebuild(bst_t* bst)
+{
+	size_t	size	= 0;
+	void**	arr	= compact_flatten(bst, &size);
+
+	if (arr != NULL && compact_build(bst, arr, size, false)) {
+		STATS_ADD(bst, rebuilds, 1);
+		STATS_REBUILT(bst);
+	}
+	free(arr);
+}
+
+/* The depth of a BST_COMPACT tree is that of the binary trees, so this is as
+ * recursive as `bst_print_recursive`. */
+static void compact_print(bst_t*	bst,
+			  uint32_t	index,
+			  void		(*print)(void* data),
+			  int		level)
+{
+	printf("  ");
+	for (int i = 0; i < level; ++i) {
+		printf("%s", i == 0 ? "|——" : "———");
+	}
+	if (index == 0) {
+		printf("( )\n");
+		return;
+	}
+	printf("(");
+	print(bst->compact.nodes[index].data);
+	printf(")\n");
+	compact_print(bst, compact_child(bst->compact.nodes, index, 0), print,
+		      level + 1);
+	compact_print(bst, compact_child(bst->compact.nodes, index, 1), print,
+		      level + 1);
+}
+
+
+
+/*==============================================================================
+	NODE
+==============================================================================*/
+
+static node_t* node_new(bst_t* bst, void* data)
+{
+	node_t*	node;
+
+	if (bst->mode & BST_SLAB) {
+		node = slab_alloc(&bst->slab);
+	} else {
+		node = malloc(node_size(bst));
+	}
+
+	if (node == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	if (!node_init(bst, node, data)) {
+		if (bst->mode & BST_SLAB) {
+			slab_release(&bst->slab, node);
+		} else {
+			free(node);
+		}
+		return NULL;
+	}
+	return node;
+}
+
+/* A new node holding `key`, and `value` for a map. */
+static node_t* node_new_elem(bst_t* bst, const void* key, const void* value)
+{
+	if (bst->value_offset == 0) {
+		return node_new(bst, (void*)key);
+	}
+
+	node_t* node = node_new(bst, NULL);
+
+	if (node != NULL) {
+		elem_set(bst, node->data, key, value);
+	}
+	return node;
+}
+
+/* Initialize the memory at `node` as a leaf holding `data`. */
+static bool node_init(bst_t* bst, node_t* node, void* data)
+{
 	switch (bst->type) {
 
-	/* The BST makes a private copy of the data. */
-	case BST_COPIED:
-		node->data = malloc(bst->elem_size);
-		if (node->data == NULL) {
+	/* The BST makes a private copy of the data. */
+	case BST_COPIED:
+		if (bst->mode & (BST_SLAB | BST_PERSISTENT)) {
+			node->data = (char*)node + slab_round(sizeof *node);
+		} else {
+			node->data = malloc(bst->elem_size);
+		}
+		if (node->data == NULL) {
+			ERROR(return false, MALLOC_FAIL);
+		}
+		/* Otherwise filled in by the caller. */
+		if (data != NULL) {
+			memcpy(node->data, data, bst->elem_size);
+		}
+		break;
+
+	/* The BST does not take ownership of the data. */
+	case BST_POINTED:
+		node->data = data;
+		break;
+
+	default:
+		printf("Invalid bst_type_t argument.\n");
+		exit(1);
+		break;
+	}
+
+	node->left	= NULL;
+	node->right	= NULL;
+	node->height	= 1;
+	node->refs	= 1;
+	node->count	= 1;
+
+	return true;
+}
+
+/* The size of a node, including the copy of the data where it is stored right
+ * after the node. */
+static size_t node_size(bst_t* bst)
+{
+	if ((bst->mode & (BST_SLAB | BST_PERSISTENT)) &&
+	    bst->type == BST_COPIED) {
+		return slab_round(sizeof(node_t)) + bst->elem_size;
+	}
+	return sizeof(node_t);
+}
+
+/* Free `node` and its data. With BST_CONCURRENT, readers may still be looking
+ * at it, so it is only retired, to be freed later. */
+static void node_free(bst_t* bst, node_t* node)
+{
+	if (node != NULL) {
+		if (bst->rcu != NULL) {
+			rcu_retire(bst->rcu, node, true, false);
+		} else {
+			node_release(bst, node, true);
+		}
+	}
+}
+
+static void node_release(bst_t* bst, node_t* node, bool free_data)
+{
+	if (free_data && bst->data_free != NULL) {
+		bst->data_free(node->data);
+	}
+	if (bst->mode & BST_SLAB) {
+		slab_release(&bst->slab, node);
+	} else {
+		free(node);
+	}
+}
+
+/* With BST_PERSISTENT, make sure that the node at `link` belongs to `bst`
+ * alone, so that it may be changed: if other trees hold it as well, it is
+ * replaced by a copy, which holds its children in turn. Returns false, leaving
+ * the link untouched, if memory ran out. */
+static bool node_own(bst_t* bst, node_t** link)
+{
+	node_t*	node = *link;
+	node_t*	copy;
+
+	if (!(bst->mode & BST_PERSISTENT) || node == NULL ||
+	    __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1) {
+		return true;
+	}
+	if ((copy = malloc(node_size(bst))) == NULL) {
+		ERROR(return false, MALLOC_FAIL);
+	}
+	/* Not `*copy = *node`: other trees may be updating `node->refs`. */
+	copy->data	= node->data;
+	copy->left	= node->left;
+	copy->right	= node->right;
+	copy->height	= node->height;
+	copy->refs	= 1;
+	copy->count	= node->count;
+	if (bst->type == BST_COPIED) {
+		copy->data = (char*)copy + slab_round(sizeof *copy);
+		memcpy(copy->data, node->data, bst->elem_size);
+	}
+	if (copy->left != NULL) {
+		__atomic_add_fetch(&copy->left->refs, 1, __ATOMIC_RELAXED);
+	}
+	if (copy->right != NULL) {
+		__atomic_add_fetch(&copy->right->refs, 1, __ATOMIC_RELAXED);
+	}
+	*link = copy;
+	node_put(bst, node);
+	return true;
+}
+
+/* Drop a reference to `node`. The last one frees it and drops its references
+ * to its children in turn. */
+static void node_put(bst_t* bst, node_t* node)
+{
+	node_stack_t	stack;
+	size_t		unused;
+
+	stack_init(&stack);
+	if (node != NULL) {
+		stack_push(&stack, node, 0);
+	}
+	while (stack_pop(&stack, &node, &unused)) {
+		if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+			continue;
+		}
+		if (node->left != NULL) {
+			stack_push(&stack, node->left, 0);
+		}
+		if (node->right != NULL) {
+			stack_push(&stack, node->right, 0);
+		}
+		node_release(bst, node, true);
+	}
+	stack_free(&stack);
+}
+
+/* Return a copy of `node` sharing its data and children. */
+static node_t* node_clone(node_t* node)
+{
+	node_t* clone = malloc(sizeof *clone);
+
+	if (clone == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	*clone = *node;
+	return clone;
+}
+
+/* Fill in the copied element at `elem`: `key` followed by `value` for a map,
+ * otherwise the element `key`. */
+static void elem_set(bst_t* bst, void* elem, const void* key, const void* value)
+{
+	if (bst->value_offset == 0) {
+		memcpy(elem, key, bst->elem_size);
+		return;
+	}
+	memcpy(elem, key, bst->key_size);
+	memcpy((char*)elem + bst->value_offset, value,
+	       bst->elem_size - bst->value_offset);
+}
+
+/* Return the element to store for `key` (and `value`, for a map) in a tree
+ * without `node_t`: `key` itself with BST_POINTED, otherwise a copy. */
+static void* elem_new(bst_t* bst, const void* key, const void* value)
+{
+	if (bst->type == BST_POINTED) {
+		return (void*)key;
+	}
+
+	void* copy = malloc(bst->elem_size);
+
+	if (copy == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	elem_set(bst, copy, key, value);
+	return copy;
+}
+
+static void elem_free(bst_t* bst, void* data)
+{
+	if (bst->data_free != NULL) {
+		bst->data_free(data);
+	}
+}
+
+/* Replace the element at `slot`, which compares equal to `key`, in place. For
+ * a map, the key is left alone and only the value is overwritten. */
+static void elem_replace(bst_t*		bst,
+			 void**		slot,
+			 const void*	key,
+			 const void*	value)
+{
+	if (bst->type == BST_POINTED) {
+		void* old = *slot;
+
+		*slot = (void*)key;
+		if (old != key && bst->data_free != NULL) {
+			bst->data_free(old);
+		}
+	} else if (bst->value_offset != 0) {
+		memcpy((char*)*slot + bst->value_offset, value,
+		       bst->elem_size - bst->value_offset);
+	} else {
+		memcpy(*slot, key, bst->elem_size);
+	}
+}
+
+
+
+
+
+/*==============================================================================
+	SORT
+==============================================================================*/
+
+/* Below this many elements a parallel sort is not worth a thread. */
+#define SORT_PARALLEL_MIN	4096
+
+typedef struct {
+	void**		arr;
+	void**		tmp;
+	size_t		count;
+	int		(*cmp)(const void*, const void*);
+	unsigned	threads;
+} sort_task_t;
+
+/* Merge the sorted runs `arr[0, mid)` and `arr[mid, count)`. */
+static void merge(void* arr[], void* tmp[], size_t mid, size_t count,
+		  int (*cmp)(const void*, const void*))
+{
+	size_t i = 0, j = mid, k = 0;
+
+	/* Already in order: common for presorted input. */
+	if (cmp(arr[mid - 1], arr[mid]) <= 0) {
+		return;
+	}
+	while (i < mid && j < count) {
+		tmp[k++] = cmp(arr[j], arr[i]) < 0 ? arr[j++] : arr[i++];
+	}
+	while (i < mid) {
+		tmp[k++] = arr[i++];
+	}
+	memcpy(arr, tmp, k * sizeof *arr);
+}
+
+static void merge_sort(void* arr[], void* tmp[], size_t count,
+		       int (*cmp)(const void*, const void*))
+{
+	if (count < 2) {
+		return;
+	}
+
+	size_t mid = count / 2;
+
+	merge_sort(arr, tmp, mid, cmp);
+	merge_sort(arr + mid, tmp + mid, count - mid, cmp);
+	merge(arr, tmp, mid, count, cmp);
+}
+
+/* Sort both halves concurrently, one of them on a new thread, until the
+ * thread budget is used up; then merge. */
+static void* sort_task_run(void* arg)
+{
+	sort_task_t*	task = arg;
+	size_t		mid  = task->count / 2;
+
+	if (task->threads < 2 || task->count < SORT_PARALLEL_MIN) {
+		merge_sort(task->arr, task->tmp, task->count, task->cmp);
+		return NULL;
+	}
+
+	sort_task_t	left	= { task->arr, task->tmp, mid, task->cmp,
+				    task->threads / 2 };
+	sort_task_t	right	= { task->arr + mid, task->tmp + mid,
+				    task->count - mid, task->cmp,
+				    task->threads - task->threads / 2 };
+	pthread_t	thread;
+	bool		spawned;
+
+	spawned = pthread_create(&thread, NULL, sort_task_run, &left) == 0;
+	if (!spawned) {
+		sort_task_run(&left);
+	}
+	sort_task_run(&right);
+	if (spawned) {
+		pthread_join(thread, NULL);
+	}
+
+	merge(task->arr, task->tmp, mid, task->count, task->cmp);
+	return NULL;
+}
+
+/* Stable merge sort of an array of pointers, using up to `threads` threads. */
+static bool sort_pointers(void* arr[], size_t count,
+			  int (*cmp)(const void*, const void*),
+			  unsigned threads)
+{
+	void** tmp = malloc(count * sizeof *tmp);
+
+	if (tmp == NULL) {
+		ERROR(return false, MALLOC_FAIL);
+	}
+
+	sort_task_t task = { arr, tmp, count, cmp, threads };
+	sort_task_run(&task);
+
+	free(tmp);
+	return true;
+}
+
+
+
+/*==============================================================================
+	POOL
+==============================================================================*/
+
+/* A worker of a pool owns the tasks [next, end), which other workers may steal
+ * from the top once they run out of their own. */
+typedef struct {
+	pthread_mutex_t	lock;
+	size_t		next;
+	size_t		end;
+} pool_worker_t;
+
+typedef struct {
+	pool_worker_t*	workers;
+	unsigned	count;
+	void		(*run)(void* ctx, size_t task);
+	void*		ctx;
+} pool_t;
+
+typedef struct {
+	pool_t*		pool;
+	unsigned	id;
+} pool_arg_t;
+
+static bool pool_take(pool_worker_t* worker, size_t* task)
+{
+	bool taken;
+
+	pthread_mutex_lock(&worker->lock);
+	taken = worker->next < worker->end;
+	if (taken) {
+		*task = worker->next++;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return taken;
+}
+
+/* Move the upper half of the tasks left to `victim` over to `thief`, whose own
+ * tasks have run out. */
+static bool pool_steal(pool_worker_t* thief, pool_worker_t* victim)
+{
+	size_t first, end;
+
+	pthread_mutex_lock(&victim->lock);
+	end	= victim->end;
+	first	= victim->next + (end - victim->next) / 2;
+	if (first < end) {
+		victim->end = first;
+	}
+	pthread_mutex_unlock(&victim->lock);
+	if (first >= end) {
+		return false;
+	}
+
+	pthread_mutex_lock(&thief->lock);
+	thief->next	= first;
+	thief->end	= end;
+	pthread_mutex_unlock(&thief->lock);
+	return true;
+}
+
+/* Run the worker's own tasks, then steal until no worker has any left. Tasks
+ * never create tasks, so once a full round of stealing fails, all remaining
+ * tasks are being run by someone. */
+static void* pool_work(void* arg)
+{
+	pool_arg_t*	pool_arg = arg;
+	pool_t*		pool	 = pool_arg->pool;
+	pool_worker_t*	self	 = &pool->workers[pool_arg->id];
+	size_t		task;
+	bool		stolen;
+
+	do {
+		while (pool_take(self, &task)) {
+			pool->run(pool->ctx, task);
+		}
+		stolen = false;
+		for (unsigned i = 1; i < pool->count && !stolen; ++i) {
+			unsigned victim = (pool_arg->id + i) % pool->count;
+			stolen = pool_steal(self, &pool->workers[victim]);
+		}
+	} while (stolen);
+	return NULL;
+}
+
+/* Call `run(ctx, task)` for every task in [0, count), on up to `threads`
+ * threads including the calling one, and return once all have been run. The
+ * tasks are dealt out in equal ranges and rebalanced by stealing. If threads
+ * can not be created, the others run their tasks. */
+static void pool_run(unsigned threads, size_t count,
+		     void (*run)(void* ctx, size_t task), void* ctx)
+{
+	if (threads > count) {
+		threads = (unsigned)count;
+	}
+	if (threads < 2) {
+		for (size_t task = 0; task < count; ++task) {
+			run(ctx, task);
+		}
+		return;
+	}
+
+	pool_t		pool	= { NULL, threads, run, ctx };
+	pool_arg_t*	args	= malloc(threads * sizeof *args);
+	pthread_t*	ids	= malloc(threads * sizeof *ids);
+	bool*		spawned	= malloc(threads * sizeof *spawned);
+
+	pool.workers = malloc(threads * sizeof *pool.workers);
+	if (args == NULL || ids == NULL || spawned == NULL ||
+	    pool.workers == NULL) {
+		free(args);
+		free(ids);
+		free(spawned);
+		free(pool.workers);
+		pool_run(1, count, run, ctx);
+		return;
+	}
+	for (unsigned i = 0; i < threads; ++i) {
+		pthread_mutex_init(&pool.workers[i].lock, NULL);
+		pool.workers[i].next	= count * i / threads;
+		pool.workers[i].end	= count * (i + 1) / threads;
+		args[i].pool		= &pool;
+		args[i].id		= i;
+	}
+	for (unsigned i = 1; i < threads; ++i) {
+		spawned[i] = pthread_create(&ids[i], NULL, pool_work,
+					    &args[i]) == 0;
+	}
+	pool_work(&args[0]);
+	for (unsigned i = 1; i < threads; ++i) {
+		if (spawned[i]) {
+			pthread_join(ids[i], NULL);
+		}
+	}
+	for (unsigned i = 0; i < threads; ++i) {
+		pthread_mutex_destroy(&pool.workers[i].lock);
+	}
+	free(args);
+	free(ids);
+	free(spawned);
+	free(pool.workers);
+}
+
+/* Cut the tree rooted at `root` into at least `target` pieces, unless it has
+ * fewer nodes, by replacing subtrees by their left subtree, root and right
+ * subtree. Return the pieces in order, and their number in `count`, or NULL if
+ * out of memory. */
+static piece_t* pool_pieces(node_t* root, size_t target, size_t* count)
+{
+	piece_t*	pieces	= malloc(3 * target * sizeof *pieces);
+	piece_t*	next	= malloc(3 * target * sizeof *next);
+	bool		split	= true;
+
+	if (pieces == NULL || next == NULL) {
+		free(pieces);
+		free(next);
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+
+	*count = 0;
+	if (root != NULL) {
+		pieces[(*count)++] = (piece_t){ root, true, 0 };
+	}
+	while (*count < target && split) {
+		size_t	 len = 0;
+		piece_t* tmp;
+
+		split = false;
+		for (size_t i = 0; i < *count; ++i) {
+			node_t* node	= pieces[i].node;
+			node_t* left;
+			node_t* right;
+			if (!pieces[i].subtree) {
+				next[len++] = pieces[i];
+				continue;
+			}
+			left	= LOAD(node->left);
+			right	= LOAD(node->right);
+			if (left != NULL) {
+				next[len++] = (piece_t){ left, true, 0 };
+			}
+			next[len++] = (piece_t){ node, false, 0 };
+			if (right != NULL) {
+				next[len++] = (piece_t){ right, true, 0 };
+			}
+			split = true;
+		}
+		tmp	= pieces;
+		pieces	= next;
+		next	= tmp;
+		*count	= len;
+	}
+	free(next);
+	return pieces;
+}
+
+
+
+/*==============================================================================
+	REBUILD
+==============================================================================*/
+
+typedef struct {
+	bst_t*		bst;
+	void**		arr;
+	piece_t*	pieces;
+} flatten_t;
+
+/* Return the number of nodes in the subtree rooted at `node`. */
+static size_t rebuild_count(bst_t* bst, node_t* node)
+{
+	node_stack_t	stack;
+	size_t		count = 0;
+	size_t		unused;
+
+	if (bst->mode & BST_RANKED) {
+		return node_count(node);
+	}
+	stack_init(&stack);
+	if (node != NULL) {
+		stack_push(&stack, node, 0);
+	}
+	while (stack_pop(&stack, &node, &unused)) {
+		count += 1;
+		if (node->left != NULL) {
+			stack_push(&stack, node->left, 0);
+		}
+		if (node->right != NULL) {
+			stack_push(&stack, node->right, 0);
+		}
+	}
+	stack_free(&stack);
+	return count;
+}
+
+/* The offsets are first set to the sizes of the pieces. */
+static void flatten_count(void* ctx, size_t task)
+{
+	flatten_t*	flatten	= ctx;
+	piece_t*	piece	= &flatten->pieces[task];
+
+	piece->offset = piece->subtree ? rebuild_count(flatten->bst,
+						       piece->node)
+				       : 1;
+}
+
+static void flatten_fill(void* ctx, size_t task)
+{
+	flatten_t*	flatten	= ctx;
+	piece_t*	piece	= &flatten->pieces[task];
+
+	if (piece->subtree) {
+		bst_to_array(flatten->bst, piece->node,
+			     flatten->arr + piece->offset);
+	} else {
+		flatten->arr[piece->offset] = piece->node->data;
+	}
+}
+
+/* Like `bst_to_array` for the whole tree, on up to `threads` threads: the top
+ * of the tree is cut into pieces in order, which are counted, and then copied
+ * to their offsets, in parallel. */
+static size_t rebuild_flatten(bst_t* bst, void* arr[], unsigned threads)
+{
+	size_t		count;
+	piece_t*	pieces	= pool_pieces(bst->root,
+					      (size_t)threads * POOL_TASKS,
+					      &count);
+
+	if (pieces == NULL) {
+		return bst_to_array(bst, bst->root, arr);
+	}
+
+	flatten_t	flatten	= { bst, arr, pieces };
+	size_t		size	= 0;
+
+	pool_run(threads, count, flatten_count, &flatten);
+	for (size_t i = 0; i < count; ++i) {
+		size_t piece_size	= pieces[i].offset;
+		pieces[i].offset	= size;
+		size			+= piece_size;
+	}
+	pool_run(threads, count, flatten_fill, &flatten);
+
+	free(pieces);
+	return size;
+}
+
+/* A range [first, end) of the sorted array whose subtree is built by one task
+ * and stored at `link`. */
+typedef struct {
+	size_t		first;
+	size_t		end;
+	node_t**	link;
+} build_task_t;
+
+typedef struct {
+	bst_t*		bst;
+	void**		arr;
+	char*		block;		/* BST_SLAB: node `i` is slot `i`. */
+	size_t		grain;
+	build_task_t*	tasks;
+	size_t		task_count;
+	node_t**	top;		/* Built first, in preorder. */
+	size_t		top_count;
+	bool		failed;
+} build_t;
+
+static node_t* build_node(build_t* build, size_t i)
+{
+	bst_t*	bst = build->bst;
+	node_t*	node;
+
+	if (build->block != NULL) {
+		node = (node_t*)(build->block + i * bst->slab.obj_size);
+		node_init(bst, node, build->arr[i]);
+	} else if ((node = node_new(bst, build->arr[i])) == NULL) {
+		__atomic_store_n(&build->failed, true, __ATOMIC_RELAXED);
+	}
+	return node;
+}
+
+/* Build the subtree for [first, end), rooted at its middle element. */
+static node_t* build_range(build_t* build, size_t first, size_t end)
+{
+	if (first >= end) {
+		return NULL;
+	}
+
+	size_t	mid	= first + (end - first - 1) / 2;
+	node_t*	node	= build_node(build, mid);
+
+	if (node == NULL) {
+		return NULL;
+	}
+	node->left	= build_range(build, first, mid);
+	node->right	= build_range(build, mid + 1, end);
+	return node_fix(build->bst, node);
+}
+
+/* Build the top of the tree down to ranges of at most `grain` elements, which
+ * are left to the tasks. */
+static void build_top(build_t* build, size_t first, size_t end, node_t** link)
+{
+	*link = NULL;
+	if (end - first <= build->grain) {
+		build->tasks[build->task_count++] =
+			(build_task_t){ first, end, link };
+		return;
+	}
+
+	size_t	mid	= first + (end - first - 1) / 2;
+	node_t*	node	= build_node(build, mid);
+
+	if (node == NULL) {
+		return;
+	}
+	*link = node;
+	build->top[build->top_count++] = node;
+	build_top(build, first, mid, &node->left);
+	build_top(build, mid + 1, end, &node->right);
+}
+
+static void build_run(void* ctx, size_t task)
+{
+	build_t*	build		= ctx;
+	build_task_t*	build_task	= &build->tasks[task];
+
+	*build_task->link = build_range(build, build_task->first,
+					build_task->end);
+}
+
+/* Build a perfectly balanced tree from the `size` sorted elements in `arr`,
+ * into the empty `bst`, on up to `threads` threads. If memory runs out,
+ * the nodes built so far are freed and `bst` is left empty. */
+static bool rebuild_tree(bst_t* bst, void* arr[], size_t size, unsigned threads)
+{
+	node_t*	root;
+	size_t	target	= (size_t)threads * POOL_TASKS;
+	build_t	build	= { bst, arr, NULL, size / target + 1,
+			    NULL, 0, NULL, 0, false };
+
+	/* Fewer than `size / grain` ranges of each depth are split, which
+	 * halves their size, so fewer than `2 * target` are in total. */
+	build.tasks	= malloc((2 * target + 1) * sizeof *build.tasks);
+	build.top	= malloc(2 * target * sizeof *build.top);
+	if (build.tasks == NULL || build.top == NULL) {
+		free(build.tasks);
+		free(build.top);
+		ERROR(return false, MALLOC_FAIL);
+	}
+	/* Slab nodes are handed out by index, so no thread allocates. */
+	if (bst->mode & BST_SLAB) {
+		if (!slab_reserve(&bst->slab, size)) {
+			free(build.tasks);
+			free(build.top);
+			return false;
+		}
+		build.block = slab_take(&bst->slab, size);
+	}
+
+	build_top(&build, 0, size, &root);
+	pool_run(threads, build.task_count, build_run, &build);
+
+	/* Children come after their parents in preorder. A failed build is
+	 * not fixed up: with BST_AVL, its gaps would set off rotations, which
+	 * the links held by the parents would miss. */
+	for (size_t i = build.top_count; !build.failed && i-- > 0; ) {
+		node_fix(bst, build.top[i]);
+	}
+
+	free(build.tasks);
+	free(build.top);
+	if (build.failed) {
+		rebuild_free(bst, root);
+		return false;
+	}
+	/* Readers of a BST_CONCURRENT tree only ever see it whole. */
+	PUBLISH(bst->root, root);
+	return true;
+}
+
+/* Free a tree that `rebuild_tree` gave up on. Its elements were never handed
+ * to `bst`, so `data_free` is not called on them; only the copies made for
+ * them are freed. */
+static void rebuild_free(bst_t* bst, node_t* node)
+{
+	if (node == NULL) {
+		return;
+	}
+	rebuild_free(bst, node->left);
+	rebuild_free(bst, node->right);
+	if (bst->type == BST_COPIED &&
+	    !(bst->mode & (BST_SLAB | BST_PERSISTENT))) {
+		free(node->data);
+	}
+	node_release(bst, node, false);
+}
+
+
+
+/*==============================================================================
+	STACK
+==============================================================================*/
+
+static void stack_init(node_stack_t* stack)
+{
+	stack->frames	= stack->local;
+	stack->len	= 0;
+	stack->cap	= NODE_STACK_LOCAL;
+}
+
+static bool stack_push(node_stack_t* stack, node_t* node, size_t state)
+{
+	if (stack->len == stack->cap) {
+		size_t		cap	= stack->cap * 2;
+		node_frame_t*	frames;
+
+		if (stack->frames == stack->local) {
+			frames = malloc(cap * sizeof *frames);
+			if (frames != NULL) {
+				memcpy(frames, stack->local,
+				       sizeof stack->local);
+			}
+		} else {
+			frames = realloc(stack->frames, cap * sizeof *frames);
+		}
+		if (frames == NULL) {
+			ERROR(return false, MALLOC_FAIL);
+		}
+		stack->frames	= frames;
+		stack->cap	= cap;
+	}
+	stack->frames[stack->len].node	= node;
+	stack->frames[stack->len].state	= state;
+	stack->len += 1;
+	return true;
+}
+
+static bool stack_pop(node_stack_t* stack, node_t** node, size_t* state)
+{
+	if (stack->len == 0) {
+		return false;
+	}
+	stack->len -= 1;
+	*node	= stack->frames[stack->len].node;
+	*state	= stack->frames[stack->len].state;
+	return true;
+}
+
+static void stack_free(node_stack_t* stack)
+{
+	if (stack->frames != stack->local) {
+		free(stack->frames);
+	}
+}
+
+
+
+/*==============================================================================
+	SLAB
+==============================================================================*/
+
+#define SLAB_FIRST_COUNT	64
+#define SLAB_MAX_COUNT		65536
+
+static size_t slab_round(size_t size)
+{
+	size_t align = sizeof(slab_align_t);
+	return (size + align - 1) / align * align;
+}
+
+static void slab_init(slab_t* slab, size_t obj_size)
+{
+	slab->chunks		= NULL;
+	slab->free_list		= NULL;
+	slab->cursor		= NULL;
+	slab->left		= 0;
+	slab->next_count	= SLAB_FIRST_COUNT;
+	slab->obj_size		= slab_round(obj_size);
+	slab->bytes		= 0;
+}
+
+/* Make sure that the next `count` allocations are served from a single chunk,
+ * allocating it in one go if needed. Objects left over in the current chunk
+ * are kept on the free list. */
+static bool slab_reserve(slab_t* slab, size_t count)
+{
+	if (slab->left >= count) {
+		return true;
+	}
+
+	slab_chunk_t* chunk = malloc(sizeof *chunk + count * slab->obj_size);
+
+	if (chunk == NULL) {
+		ERROR(return false, MALLOC_FAIL);
+	}
+	while (slab->left > 0) {
+		slab_release(slab, slab->cursor);
+		slab->cursor	+= slab->obj_size;
+		slab->left	-= 1;
+	}
+	chunk->next	= slab->chunks;
+	slab->chunks	= chunk;
+	slab->cursor	= (char*)chunk->objects;
+	slab->left	= count;
+	slab->bytes	+= sizeof *chunk + count * slab->obj_size;
+	return true;
+}
+
+/* Hand out `count` consecutive objects at once; they must have been reserved
+ * with `slab_reserve`. */
+static void* slab_take(slab_t* slab, size_t count)
+{
+	void* objects = slab->cursor;
+
+	slab->cursor	+= count * slab->obj_size;
+	slab->left	-= count;
+	return objects;
+}
+
+static void* slab_alloc(slab_t* slab)
+{
+	void* obj;
+
+	if (slab->free_list != NULL) {
+		obj		= slab->free_list;
+		slab->free_list	= *(void**)obj;
+		return obj;
+	}
+	if (slab->left == 0) {
+		slab_chunk_t* chunk = malloc(sizeof *chunk +
+					     slab->next_count * slab->obj_size);
+		if (chunk == NULL) {
 			ERROR(return NULL, MALLOC_FAIL);
 		}
-		memcpy(node->data, data, bst->elem_size);
-		break;
+		chunk->next	= slab->chunks;
+		slab->chunks	= chunk;
+		slab->cursor	= (char*)chunk->objects;
+		slab->left	= slab->next_count;
+		slab->bytes	+= sizeof *chunk +
+				   slab->next_count * slab->obj_size;
+		if (slab->next_count < SLAB_MAX_COUNT) {
+			slab->next_count *= 2;
+		}
+	}
+	obj		= slab->cursor;
+	slab->cursor	+= slab->obj_size;
+	slab->left	-= 1;
+	return obj;
+}
 
-	/* The BST does not take ownership of the data. */
-	case BST_POINTED:
-		node->data = data;
-		break;
+static void slab_release(slab_t* slab, void* obj)
+{
+	*(void**)obj	= slab->free_list;
+	slab->free_list	= obj;
+}
 
-	default:
-		printf("Invalid bst_type_t argument.\n");
-		exit(1);
-		break;
+static void slab_free(slab_t* slab)
+{
+	slab_chunk_t* chunk = slab->chunks;
+
+	while (chunk != NULL) {
+		slab_chunk_t* next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
+	slab_init(slab, slab->obj_size);
+}
 
-	node->left	= NULL;
-	node->right	= NULL;
 
+
+/*==============================================================================
+	RCU
+==============================================================================*/
+
+/* Retired entries that make the writer reclaim memory once it is done. */
+#define RCU_BATCH	256
+
+unsigned bst_read_begin(bst_t* bst)
+{
+	if (bst == NULL) {
+		ERROR(return 0, "`bst` argument is NULL.\n");
+	}
+	return bst->rcu == NULL ? 0 : rcu_read_begin(bst->rcu);
+}
+
+void bst_read_end(bst_t* bst, unsigned token)
+{
+	if (bst == NULL) {
+		ERROR(return, "`bst` argument is NULL.\n");
+	}
+	if (bst->rcu != NULL) {
+		rcu_read_end(bst->rcu, token);
+	}
+}
+
+static rcu_t* rcu_new(void)
+{
+	rcu_t* rcu = calloc(1, sizeof *rcu);
+
+	if (rcu == NULL) {
+		ERROR(return NULL, MALLOC_FAIL);
+	}
+	if (pthread_mutex_init(&rcu->writer, NULL) != 0) {
+		free(rcu);
+		ERROR(return NULL, "`pthread_mutex_init` failed.\n");
+	}
+	return rcu;
+}
+
+/* Pick a stripe from the address of the caller's stack, which differs between
+ * threads in the high bits. */
+static unsigned rcu_stripe(void)
+{
+	char		here;
+	uint64_t	page = (uintptr_t)&here >> 12;
+
+	return (unsigned)((page * UINT64_C(0x9E3779B97F4A7C15)) >> 60) %
+	       RCU_STRIPES;
+}
+
+/* The token holds the stripe and the parity that were used. */
+static unsigned rcu_read_begin(rcu_t* rcu)
+{
+	unsigned stripe = rcu_stripe();
+
+	for (;;) {
+		unsigned epoch	= __atomic_load_n(&rcu->epoch,
+						  __ATOMIC_SEQ_CST);
+		long*	 count	= &rcu->readers[epoch & 1][stripe].count;
+
+		__atomic_fetch_add(count, 1, __ATOMIC_SEQ_CST);
+		/* If the epoch moved on in between, the writer may not have
+		 * seen this reader: register again under the new one. */
+		if (__atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) == epoch) {
+			return stripe * 2 + (epoch & 1);
+		}
+		__atomic_fetch_sub(count, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void rcu_read_end(rcu_t* rcu, unsigned token)
+{
+	__atomic_fetch_sub(&rcu->readers[token & 1][token / 2].count, 1,
+			   __ATOMIC_RELEASE);
+}
+
+/* Wait until every reader that might have seen a node retired so far is
+ * done. Readers that arrive meanwhile register under the new epoch and can
+ * only see the tree as it is now. */
+static void rcu_synchronize(rcu_t* rcu)
+{
+	unsigned epoch = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+
+	for (size_t i = 0; i < RCU_STRIPES; ++i) {
+		while (__atomic_load_n(&rcu->readers[epoch & 1][i].count,
+				       __ATOMIC_ACQUIRE) != 0) {
+			sched_yield();
+		}
+	}
+}
+
+/* Free everything that has been retired. */
+static void rcu_reclaim(bst_t* bst)
+{
+	rcu_t* rcu = bst->rcu;
+
+	rcu_synchronize(rcu);
+	for (size_t i = 0; i < rcu->len; ++i) {
+		retired_t* retired = &rcu->retired[i];
+		if (retired->subtree) {
+			bst_free_nodes(bst, retired->node, retired->free_data);
+		} else {
+			node_release(bst, retired->node, retired->free_data);
+		}
+	}
+	rcu->len = 0;
+}
+
+/* Make room for `retire` more retired nodes, so that retiring can not fail
+ * halfway through a modification. */
+static bool rcu_reserve(rcu_t* rcu, size_t retire)
+{
+	if (rcu->len + retire > rcu->cap) {
+		size_t		cap	= 2 * (rcu->len + retire);
+		retired_t*	retired	= realloc(rcu->retired,
+						  cap * sizeof *retired);
+		if (retired == NULL) {
+			ERROR(return false, MALLOC_FAIL);
+		}
+		rcu->retired	= retired;
+		rcu->cap	= cap;
+	}
+	return true;
+}
+
+/* Take the writer lock of a BST_CONCURRENT tree and reserve room for `retire`
+ * retired nodes. Does nothing for other trees. */
+static bool rcu_write_begin(bst_t* bst, size_t retire)
+{
+	rcu_t* rcu = bst->rcu;
+
+	if (rcu == NULL) {
+		return true;
+	}
+	pthread_mutex_lock(&rcu->writer);
+	if (!rcu_reserve(rcu, retire)) {
+		pthread_mutex_unlock(&rcu->writer);
+		return false;
+	}
+	return true;
+}
+
+static void rcu_write_end(bst_t* bst)
+{
+	rcu_t* rcu = bst->rcu;
+
+	if (rcu == NULL) {
+		return;
+	}
+	if (rcu->len >= RCU_BATCH) {
+		rcu_reclaim(bst);
+	}
+	pthread_mutex_unlock(&rcu->writer);
+}
+
+/* Schedule `node` (and its data if `free_data` is true, and every node below it
+ * if `subtree` is true) to be freed once no reader can see it. Room for it has
+ * been made by `rcu_write_begin`. */
+static void rcu_retire(rcu_t* rcu, node_t* node, bool free_data, bool subtree)
+{
+	retired_t* retired = &rcu->retired[rcu->len++];
+
+	retired->node		= node;
+	retired->free_data	= free_data;
+	retired->subtree	= subtree;
+}
+
+/* Reclaim everything and drop the RCU state; nothing may be reading. */
+static void rcu_free(bst_t* bst)
+{
+	rcu_reclaim(bst);
+	pthread_mutex_destroy(&bst->rcu->writer);
+	free(bst->rcu->retired);
+	free(bst->rcu);
+	bst->rcu = NULL;
+}
+
+
+
+/*==============================================================================
+	AVL
+==============================================================================*/
+
+static int node_height(node_t* node)
+{
+	return node == NULL ? 0 : LOAD_FIELD(node->height);
+}
+
+static size_t node_count(node_t* node)
+{
+	return node == NULL ? 0 : LOAD_FIELD(node->count);
+}
+
+static inline void node_update(node_t* node)
+{
+	STORE_FIELD(node->height, 1 + max(node_height(node->left),
+					  node_height(node->right)));
+	STORE_FIELD(node->count, 1 + node_count(node->left) +
+				 node_count(node->right));
+}
+
+/* With BST_CONCURRENT, the two nodes of a rotation are replaced by copies, as
+ * readers passing through the originals would otherwise be led astray. On
+ * failure, the rotation is skipped: the tree stays a valid BST. */
+static bool node_clone_pair(bst_t* bst, node_t** node, node_t** pivot)
+{
+	node_t* node_copy	= node_clone(*node);
+	node_t* pivot_copy	= node_clone(*pivot);
+
+	if (node_copy == NULL || pivot_copy == NULL) {
+		free(node_copy);
+		free(pivot_copy);
+		return false;
+	}
+	rcu_retire(bst->rcu, *node, false, false);
+	rcu_retire(bst->rcu, *pivot, false, false);
+	*node	= node_copy;
+	*pivot	= pivot_copy;
+	return true;
+}
+
+/* With BST_PERSISTENT, `node` belongs to the tree already, and the pivot is
+ * made to; if that fails, the rotation is skipped as well. */
+static node_t* node_rotate_left(bst_t* bst, node_t* node)
+{
+	if (!node_own(bst, &node->right)) {
+		node_update(node);
+		return node;
+	}
+
+	node_t* pivot = node->right;
+
+	if (bst->rcu != NULL && !node_clone_pair(bst, &node, &pivot)) {
+		node_update(node);
+		return node;
+	}
+	node->right	= pivot->left;
+	pivot->left	= node;
+	STATS_ADD(bst, rebalances, 1);
+	node_update(node);
+	node_update(pivot);
+	return pivot;
+}
+
+static node_t* node_rotate_right(bst_t* bst, node_t* node)
+{
+	if (!node_own(bst, &node->left)) {
+		node_update(node);
+		return node;
+	}
+
+	node_t* pivot = node->left;
+
+	if (bst->rcu != NULL && !node_clone_pair(bst, &node, &pivot)) {
+		node_update(node);
+		return node;
+	}
+	node->left	= pivot->right;
+	pivot->right	= node;
+	STATS_ADD(bst, rebalances, 1);
+	node_update(node);
+	node_update(pivot);
+	return pivot;
+}
+
+/* Restore the invariants of `node` after one of its subtrees has changed, and
+ * return the (possibly new) root of the subtree. For BST_AVL this recomputes
+ * the height and performs at most two rotations; for BST_RANKED it recomputes
+ * the subtree count. */
+static node_t* node_fix(bst_t* bst, node_t* node)
+{
+	if (!(bst->mode & BST_AVL)) {
+		if (bst->mode & BST_RANKED) {
+			STORE_FIELD(node->count, 1 + node_count(node->left) +
+						 node_count(node->right));
+		}
+		return node;
+	}
+
+	int balance = node_height(node->left) - node_height(node->right);
+
+	if (balance > 1) {
+		if (node_height(node->left->left) <
+		    node_height(node->left->right) &&
+		    node_own(bst, &node->left)) {
+			PUBLISH(node->left,
+				node_rotate_left(bst, node->left));
+		}
+		return node_rotate_right(bst, node);
+	}
+	if (balance < -1) {
+		if (node_height(node->right->right) <
+		    node_height(node->right->left) &&
+		    node_own(bst, &node->right)) {
+			PUBLISH(node->right,
+				node_rotate_right(bst, node->right));
+		}
+		return node_rotate_left(bst, node);
+	}
+	node_update(node);
 	return node;
 }
 
-static void node_free(bst_t* bst, node_t* node)
+
+/*==============================================================================
+	SPLAY
+==============================================================================*/
+
+/* BST_SPLAY_LAZY splays one in this many of the lookups that are not deep. */
+#define SPLAY_PERIOD	8
+
+/* Picks those lookups. Per thread, as lookups in different trees may run at the
+ * same time. */
+static __thread uint64_t splay_random = UINT64_C(0x9e3779b97f4a7c15);
+
+/* Recount the nodes that `splay` hung on its left tree (linked through their
+ * right children, if `right`) or its right tree, from `first` down to `last`.
+ * Their other subtrees are intact, so this works top-down: `first` holds all of
+ * them, and every node below holds what is left without the nodes above it. */
+static void splay_recount(node_t* first, node_t* last, bool right)
 {
-	if (node != NULL) {
-		if (bst->data_free != NULL) {
-			bst->data_free(node->data);
+	size_t	total	= node_count(right ? last->right : last->left);
+	node_t*	node;
+
+	for (node = first; ; node = right ? node->right : node->left) {
+		total += 1 + node_count(right ? node->left : node->right);
+		if (node == last) {
+			break;
 		}
-		free(node);
 	}
+	for (node = first; ; node = right ? node->right : node->left) {
+		node->count = total;
+		if (node == last) {
+			break;
+		}
+		total -= 1 + node_count(right ? node->left : node->right);
+	}
+}
+
+/* Top-down splaying (Sleator and Tarjan): search the subtree at `link` for
+ * `key`, and on the way down, split the nodes passed into a left tree of
+ * smaller and a right tree of greater keys, rotating every pair of steps that
+ * go the same way so that the path is about halved. The last node reached,
+ * which holds `key` if it is there, then becomes the root of the subtree with
+ * the two trees as its children. Return how `key` compares to it (nonzero for
+ * an empty subtree), and set `depth` to the number of nodes compared. */
+static int splay(bst_t* bst, node_t** link, const void* key, size_t* depth)
+{
+	node_t	header	= { .left = NULL, .right = NULL };
+	node_t*	left	= &header;	/* Greatest node of the left tree. */
+	node_t*	right	= &header;	/* Smallest node of the right tree. */
+	node_t*	node	= *link;
+	int	cmp_result;
+
+	if (node == NULL) {
+		*depth = 0;
+		return 1;
+	}
+	cmp_result	= bst->cmp(key, node->data);
+	*depth		= 1;
+
+	while (cmp_result != 0) {
+		node_t* child = cmp_result < 0 ? node->left : node->right;
+
+		if (child == NULL) {
+			break;
+		}
+
+		int child_cmp = bst->cmp(key, child->data);
+		*depth += 1;
+
+		if (cmp_result < 0) {
+			if (child_cmp < 0 && child->left != NULL) {
+				node->left	= child->right;
+				child->right	= node_fix(bst, node);
+				right->left	= child;
+				right		= child;
+				node		= child->left;
+			} else if (child_cmp > 0 && child->right != NULL) {
+				right->left	= node;
+				right		= node;
+				left->right	= child;
+				left		= child;
+				node		= child->right;
+			} else {
+				right->left	= node;
+				right		= node;
+				node		= child;
+				cmp_result	= child_cmp;
+				continue;
+			}
+		} else {
+			if (child_cmp > 0 && child->right != NULL) {
+				node->right	= child->left;
+				child->left	= node_fix(bst, node);
+				left->right	= child;
+				left		= child;
+				node		= child->right;
+			} else if (child_cmp < 0 && child->left != NULL) {
+				left->right	= node;
+				left		= node;
+				right->left	= child;
+				right		= child;
+				node		= child->left;
+			} else {
+				left->right	= node;
+				left		= node;
+				node		= child;
+				cmp_result	= child_cmp;
+				continue;
+			}
+		}
+		cmp_result	= bst->cmp(key, node->data);
+		*depth		+= 1;
+	}
+
+	left->right	= node->left;
+	right->left	= node->right;
+	node->left	= header.right;
+	node->right	= header.left;
+	if (bst->mode & BST_RANKED) {
+		if (left != &header) {
+			splay_recount(node->left, left, true);
+		}
+		if (right != &header) {
+			splay_recount(node->right, right, false);
+		}
+		node_fix(bst, node);
+	}
+	*link = node;
+
+	/* As many as a bottom-up splay would make. */
+	STATS_ADD(bst, rebalances, *depth - 1);
+	return cmp_result;
+}
+
+/* Splay `key` to the root of the tree, and return its node, if there. */
+static node_t* splay_find(bst_t* bst, const void* key, size_t* depth)
+{
+	return splay(bst, &bst->root, key, depth) == 0 ? bst->root : NULL;
+}
+
+/* Whether a lookup with BST_SPLAY_LAZY that compared `depth` keys should splay:
+ * always when it went deeper than twice the height of a balanced tree, and
+ * otherwise once in SPLAY_PERIOD times. Lookups ending at the root never do. */
+static bool splay_due(bst_t* bst, size_t depth)
+{
+	size_t bound = 0;
+
+	if (depth <= 1) {
+		return false;
+	}
+	for (size_t size = bst->size; size > 0; size /= 2) {
+		bound += 2;
+	}
+	if (depth > bound) {
+		return true;
+	}
+	/* xorshift64 */
+	splay_random ^= splay_random << 13;
+	splay_random ^= splay_random >> 7;
+	splay_random ^= splay_random << 17;
+	return splay_random % SPLAY_PERIOD == 0;
+}
+
+/* Add `key` as `bst_add_node` does: once splayed, the root is next to where
+ * the key belongs, so a new node for it takes the place of the root, and the
+ * old root becomes its child on one side. */
+static void* splay_insert(bst_t*	bst,
+			  const void*	key,
+			  const void*	value,
+			  bool		replace,
+			  bool*		added)
+{
+	size_t	depth;
+	int	cmp_result	= splay(bst, &bst->root, key, &depth);
+	node_t*	root		= bst->root;
+	node_t*	node;
+
+	STATS_ADD(bst, adds, 1);
+	STATS_ADD(bst, add_comparisons, depth);
+	if (root != NULL && cmp_result == 0) {
+		if (replace) {
+			return bst_replace(bst, &bst->root, key, value);
+		}
+		return root->data;
+	}
+	if ((node = node_new_elem(bst, key, value)) == NULL) {
+		return NULL;
+	}
+	if (root != NULL) {
+		if (cmp_result < 0) {
+			node->left	= root->left;
+			node->right	= root;
+			root->left	= NULL;
+		} else {
+			node->right	= root->right;
+			node->left	= root;
+			root->right	= NULL;
+		}
+		node_fix(bst, root);
+	}
+	bst->root	= node_fix(bst, node);
+	bst->size	+= 1;
+	*added		= true;
+	return node->data;
+}
+
+/* Delete `data` as `bst_delete_node` does: once splayed, it is at the root,
+ * whose subtrees are joined by splaying the left one for `data` as well. That
+ * brings its greatest node to its top, with no right child, and the right
+ * subtree goes there. */
+static node_t* splay_delete(bst_t* bst, const void* data)
+{
+	size_t	depth;
+	size_t	more		= 0;
+	int	cmp_result	= splay(bst, &bst->root, data, &depth);
+	node_t*	node		= bst->root;
+
+	if (node != NULL && cmp_result == 0 && node->left != NULL) {
+		splay(bst, &node->left, data, &more);
+	}
+	STATS_ADD(bst, deletes, 1);
+	STATS_ADD(bst, delete_comparisons, depth + more);
+	if (node == NULL || cmp_result != 0) {
+		return bst->root;
+	}
+
+	if (node->left == NULL) {
+		bst->root = node->right;
+	} else {
+		node->left->right	= node->right;
+		bst->root		= node_fix(bst, node->left);
+	}
+	node_free(bst, node);
+	bst->size -= 1;
+	return bst->root;
 }
 
 
@@ -518,26 +6848,3 @@ void node_free(bst_t* bst, node_t* node)
 	}
 }
 #endif
-
-//
-// TODO (Possible implementation):
-// 	Eventually I might make a function that takes a pointer to a pointer
-// 	to a `struct bst` and balances it in place. I imagine it would be
-// 	useful if one does not want to keep the old unbalanced tree (it would
-// 	result in less boilerplate API).
-//
-// 	The function declaration would look like the following:
-//
-//		void bst_balance(bst_t** bst);
-//
-//	and its implementation would be very similar (algorithmically)
-//	to the existing `bst_balanced` function.
-//
-
-#if 0
-void bst_balance(bst_t** bst, size_t elem_size)
-{
-	// Implement!
-}
-#endif
-
@@ -2,10 +2,12 @@
 #define BST_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef struct bst_t bst_t;
 typedef struct node_t node_t;
+typedef struct bst_frozen_t bst_frozen_t;
 
 /*==============================================================================
  * This enum decides, when passed as an argument to `bst_new`, how data will be
@@ -15,6 +17,136 @@ typedef struct node_t node_t;
 typedef enum { BST_COPIED, BST_POINTED, } bst_type_t;
 
 
+/*==============================================================================
+ * This enum decides, when passed as an argument to `bst_new`, how the BST will
+ * maintain its shape (and later, which optional features it will use). The
+ * values are bit flags and may be OR'ed together where it makes sense.
+ *
+ * 	- BST_PLAIN:
+ * 		Nodes are inserted and deleted naively. Adding sorted data will
+ * 		degenerate the tree into a linked list; `bst_balanced` has to
+ * 		be called explicitly to restore a logarithmic height.
+ *
+ * 	- BST_AVL:
+ * 		The tree is kept height-balanced (AVL) by rotations on every
+ * 		`bst_add` and `bst_delete`, so the height is always O(log n).
+ *
+ * 	- BST_SLAB:
+ * 		Nodes are carved out of large per-tree chunks instead of being
+ * 		allocated one by one, and deleted nodes are reused. With
+ * 		BST_COPIED, the copy of the data lives in the same slot as its
+ * 		node, so the slab owns it: `data_free` must then only release
+ * 		what the data refers to, never the data itself (passing `free`
+ * 		is accepted and treated as `NULL`). When `data_free` is `NULL`,
+ * 		`bst_free` releases the whole tree in a handful of bulk frees.
+ *
+ * 	- BST_RANKED:
+ * 		Every node keeps the number of nodes in its subtree, which
+ * 		enables `bst_rank`, `bst_select` and `bst_count_range`. Costs
+ * 		one extra word per node and a little work on every update.
+ *
+ * 	- BST_BTREE:
+ * 		Instead of a binary tree, a B-tree is used whose nodes hold up
+ * 		to 15 elements each and span a few cache lines, so a search
+ * 		visits about log16(n) nodes rather than log2(n). The tree is
+ * 		always balanced. `bst_add`, `bst_delete`, `bst_contains`,
+ * 		`bst_execute` and the functions building or copying whole
+ * 		trees behave as usual (ORDER_PRE and ORDER_POST visit the
+ * 		elements of a node together); cursors and the order
+ * 		statistics are not available, and `bst_delete` returns `NULL`.
+ * 		May not be combined with other modes.
+ *
+ * 	- BST_CONCURRENT:
+ * 		Any number of threads may read the tree while another thread
+ * 		modifies it. Readers take no locks: `bst_contains`,
+ * 		`bst_find`, `bst_execute`, `bst_execute_parallel`,
+ * 		`bst_height` and the order statistics may be called at any
+ * 		time (the latter may be off by a modification in progress),
+ * 		and cursors may be used between `bst_read_begin` and
+ * 		`bst_read_end`. Writers (`bst_add`, `bst_upsert`,
+ * 		`bst_get_or_insert`, `bst_delete`, `bst_balance` and
+ * 		`bst_from_array`) are serialized by a mutex, which
+ * 		`bst_balanced` and `bst_freeze` also hold while they read.
+ * 		They never change a node in a way that could mislead a reader
+ * 		(rotations copy the nodes involved instead), and defer
+ * 		freeing removed nodes and their data until every reader that
+ * 		might still see them is done, so a reader observes each
+ * 		modification either completely or not at all. `bst_free` must
+ * 		not race with anything. May not be combined with BST_SLAB or
+ * 		BST_BTREE.
+ *
+ * 	- BST_PERSISTENT:
+ * 		Enables `bst_snapshot`. Nodes are reference counted and may be
+ * 		shared by several trees; a tree copies the shared nodes it is
+ * 		about to change (the O(log n) nodes on the path of an add or a
+ * 		delete, and those of its rotations) instead of changing them,
+ * 		and a node is freed together with the last tree that holds it.
+ * 		As elements are shared as well, `data_free` must be `NULL`
+ * 		(with BST_COPIED, `free` is accepted and treated as `NULL`: the
+ * 		copies are stored in the nodes). May not be combined with
+ * 		BST_SLAB, BST_BTREE or BST_CONCURRENT.
+ *
+ * 	- BST_SPLAY:
+ * 		The tree adjusts itself to the access pattern (a splay tree):
+ * 		every `bst_add`, `bst_delete`, `bst_contains` and `bst_find`
+ * 		rotates the node it reached to the root. Operations take
+ * 		amortized O(log n) time, and keys that are used often stay
+ * 		near the root, where they are found in a few steps. As lookups
+ * 		change the tree, they invalidate cursors and may not run
+ * 		concurrently with anything, lookups included. May not be
+ * 		combined with BST_AVL, BST_BTREE, BST_CONCURRENT or
+ * 		BST_PERSISTENT.
+ *
+ * 	- BST_SPLAY_LAZY:
+ * 		A variant of BST_SPLAY for read-mostly use, which implies it.
+ * 		Adds and deletes splay as before, but a lookup only does so if
+ * 		it had to go deeper than twice the height of a balanced tree,
+ * 		and otherwise once in SPLAY_PERIOD (8) times, picked at random:
+ * 		most lookups leave the tree alone, while the keys used most
+ * 		still move up the most often. The caveats of BST_SPLAY apply
+ * 		to every lookup, as any may splay.
+ *
+ * 	- BST_COMPACT:
+ * 		The nodes live in one array that grows as needed, and link to
+ * 		their children by 32-bit indices instead of pointers. A node
+ * 		takes 16 bytes (the element pointer and two indices) where a
+ * 		`node_t` takes 40 plus the `malloc` overhead, deleted nodes are
+ * 		reused, and the array may be moved as a whole. With BST_AVL,
+ * 		the balance factor is packed into the top bit of each index,
+ * 		which leaves room for 2^31 - 1 elements. Like BST_BTREE, the
+ * 		tree offers no cursors and no order statistics, and
+ * 		`bst_delete` returns `NULL`. May only be combined with BST_AVL.
+ */
+typedef enum {
+	BST_PLAIN	= 0,
+	BST_AVL		= 1 << 0,
+	BST_SLAB	= 1 << 1,
+	BST_RANKED	= 1 << 2,
+	BST_BTREE	= 1 << 3,
+	BST_CONCURRENT	= 1 << 4,
+	BST_PERSISTENT	= 1 << 5,
+	BST_SPLAY	= 1 << 6,
+	BST_SPLAY_LAZY	= 1 << 7,
+	BST_COMPACT	= 1 << 8,
+} bst_mode_t;
+
+
+/*==============================================================================
+ * Compare functions for common key types. They may be passed as `cmp` to
+ * `bst_new` like any other compare function, but when the `elem_size` matches
+ * the key type, the BST recognizes them and compares keys inline instead of
+ * calling `cmp`, and `bst_freeze` lays the keys out in blocks that are searched
+ * with SIMD instructions (SSE2 or AVX2, with a scalar fallback).
+ *
+ * Each element must be exactly one key: an `int32_t`, `int64_t`, `uint64_t`
+ * or `double` (NaN is not supported).
+ */
+int	bst_cmp_int32	(const void* a, const void* b);
+int	bst_cmp_int64	(const void* a, const void* b);
+int	bst_cmp_uint64	(const void* a, const void* b);
+int	bst_cmp_double	(const void* a, const void* b);
+
+
 /*==============================================================================
  * Create a new BST (Binary Search Tree).
  *
@@ -53,6 +185,10 @@ typedef enum { BST_COPIED, BST_POINTED, } bst_type_t;
  * 	freeing) to `bst_new`, you should always use BST_COPIED. When passing
  * 	stack-allocated (automatically deallocated) data, it does not matter.
  *
+ * @arg `mode`
+ * 	A combination of `bst_mode_t` flags dictating how the BST keeps itself
+ * 	in shape. Pass BST_PLAIN for the old, non-balancing behaviour.
+ *
  * @arg `elem_size`
  * 	The size of the elements that will be stored inside the BST. If for
  * 	instance `struct X` is the data type that will be stored, then
@@ -84,12 +220,33 @@ typedef enum { BST_COPIED, BST_POINTED, } bst_type_t;
  * 	bst_? functions.
  */
 bst_t*	bst_new		(bst_type_t	type,
+			 bst_mode_t	mode,
 			 size_t		elem_size,
 			 int		(*cmp)(const void*, const void*),
 			 void		(*data_free)(void*),
 			 void		(*print)(void*));
 
 
+/*==============================================================================
+ * Create a BST that maps keys to values. Keys of `key_size` bytes and values of
+ * `value_size` bytes are copied into the tree (as with BST_COPIED) and freed by
+ * it, and `cmp` compares two keys. `mode` and `print` are as for `bst_new`.
+ *
+ * The elements of a map, as passed to `print` and `bst_execute` or returned by
+ * cursors, are the keys, each followed by its value; `bst_value` returns the
+ * value of such an element. Everything that takes a key (`bst_delete`,
+ * `bst_contains`, `bst_rank`, ...) works as for any tree, but elements are
+ * added with `bst_upsert` and `bst_get_or_insert` instead of `bst_add` and
+ * `bst_from_array`.
+ */
+bst_t*	bst_new_map	(bst_mode_t	mode,
+			 size_t		key_size,
+			 size_t		value_size,
+			 int		(*cmp)(const void*, const void*),
+			 void		(*print)(void*));
+void*	bst_value	(bst_t* bst, void* data);
+
+
 /*==============================================================================
  * Deallocate memory used by the BST.
  *
@@ -121,8 +278,11 @@ bool	bst_add		(bst_t* bst, void* data);
 
 
 /*==============================================================================
- * If found, delete the node containing `data` and return its value, otherwise
- * return `NULL`.
+ * If found, delete the node containing `data` from the BST. The data inside the
+ * node is freed with the `data_free` function passed to `bst_new`.
+ *
+ * @return
+ * 	The root of the BST after the deletion, or `NULL` if the BST is empty.
  */
 node_t*	bst_delete	(bst_t* bst, void* data);
 
@@ -133,17 +293,163 @@ node_t*	bst_delete	(bst_t* bst, void* data);
 bool	bst_contains	(bst_t* bst, void* data);
 
 
+/*==============================================================================
+ * Look up, or add, a key in a single descent of the tree. For a map, these
+ * return a pointer to the value of `key` stored in the tree. For any other
+ * tree, `key` is a whole element, `value` is ignored, and they return the
+ * stored element.
+ *
+ * 	- `bst_find` returns `NULL` if `key` is not in the tree.
+ *
+ * 	- `bst_upsert` adds `key` with `value`, or if `key` is there already,
+ * 	  overwrites its value (for a map) or the whole element (otherwise;
+ * 	  with BST_POINTED, the old element is freed with `data_free`).
+ *
+ * 	- `bst_get_or_insert` adds `key` with `value` unless `key` is there
+ * 	  already, and sets `*inserted` (unless `inserted` is `NULL`) to
+ * 	  whether it did.
+ *
+ * The latter two return `NULL` if memory ran out. The pointer stays valid until
+ * the tree is next changed; with BST_CONCURRENT, readers must be done with
+ * the result of `bst_find` before `bst_read_end`, and values replaced by
+ * `bst_upsert` are put in new nodes so that readers never see them torn.
+ */
+void*	bst_find		(bst_t* bst, const void* key);
+void*	bst_upsert		(bst_t* bst, const void* key,
+				 const void* value);
+void*	bst_get_or_insert	(bst_t* bst, const void* key,
+				 const void* value, bool* inserted);
+
+
+/*==============================================================================
+ * Look up `count` keys at once. `keys` points to an array of them, each taking
+ * `elem_size` bytes (`key_size` for a map).
+ *
+ * 	- `bst_contains_many` sets `found[i]` to whether the i-th key is in the
+ * 	  tree. `found` may be `NULL`, to only count them.
+ *
+ * 	- `bst_find_many` sets `results[i]` to what `bst_find` would return for
+ * 	  the i-th key.
+ *
+ * Both return the number of keys found, and print nothing. Instead of one
+ * descent after the other, which leaves the memory system idle while every
+ * node is fetched in turn, up to 16 descents advance by turns, each
+ * prefetching the node it will visit next, so that their cache misses overlap.
+ * This pays off on trees larger than the cache (as when joining two data sets).
+ * B-trees and splay trees look the keys up one at a time. With BST_CONCURRENT,
+ * the whole batch is one read-side critical section, so very large batches
+ * hold up the reclaiming of memory; the results of `bst_find_many` are valid
+ * as for `bst_find`.
+ */
+size_t	bst_contains_many	(bst_t* bst, const void* keys, size_t count,
+				 bool found[]);
+size_t	bst_find_many		(bst_t* bst, const void* keys, size_t count,
+				 void* results[]);
+
+
+/*==============================================================================
+ * Put a Bloom filter in front of the lookups of `bst`, so that `bst_contains`
+ * and `bst_find` answer most misses without descending the tree. `hash` maps a
+ * key to 64 bits (it may be weak; its result is mixed further), and the filter
+ * is sized for a false positive rate of about `fp_rate`, between 0 and 1.
+ *
+ * Adds update the filter as they go. Deleted keys can not be removed from it
+ * (lookups of them pass it and descend the tree), so it is rebuilt from the
+ * tree, in O(n), once a quarter of the keys it holds have been deleted, and
+ * also once the tree has doubled in size. Trees made from `bst` (by
+ * `bst_balanced`, `bst_snapshot`, ...) do not inherit it.
+ *
+ * Pass `NULL` as `hash` to remove the filter. Returns false if memory ran out,
+ * in which case the tree is left as it was.
+ */
+bool	bst_filter	(bst_t* bst, uint64_t (*hash)(const void* key),
+			 double fp_rate);
+
+
 /*==============================================================================
  * Return the number of nodes in `bst`. The lookup is performed in O(1) time. */
 size_t	bst_size	(bst_t* bst);
 
 
 /*==============================================================================
- * Recursively return the height (or depth) of `bst`.
+ * Return the height (or depth) of `bst`. For a tree created with BST_AVL this
+ * is an O(1) lookup, otherwise every node of the tree is visited (and 0 is
+ * returned if memory for the walk ran out).
  * */
 size_t	bst_height	(bst_t* bst);
 
 
+/*==============================================================================
+ * Per-tree counters. They are only kept when the library is compiled with
+ * `-DBST_STATS` (e.g. `make CPPFLAGS=-DBST_STATS`); otherwise they cost
+ * nothing, and `bst_stats` zeroes `stats` and returns false.
+ *
+ * 	- `adds`, `deletes` and `lookups` count calls of `bst_add`,
+ * 	  `bst_delete` and `bst_contains` that got as far as searching the
+ * 	  tree, and the `_comparisons` fields the keys they compared.
+ *
+ * 	- `filtered` counts the lookups answered by the filter of
+ * 	  `bst_filter`, which are not counted in `lookups`.
+ *
+ * 	- `lookup_depths[d]` counts the lookups that compared `d` keys (`d`
+ * 	  nodes for a B-tree), the last bucket also those that compared more.
+ *
+ * 	- `height` is exact for BST_AVL and BST_BTREE, and for BST_SPLAY and
+ * 	  BST_COMPACT, whose nodes are walked for it (with BST_AVL, only
+ * 	  along the taller side). Otherwise it is an upper bound: the
+ * 	  deepest add since the last `bst_balance`. `height_exact` tells
+ * 	  which. `max_height` is the most it has been (for BST_SPLAY, seen
+ * 	  to have been).
+ *
+ * 	- `node_bytes` and `payload_bytes` are the bytes taken by the nodes and
+ * 	  by the copies of the elements (0 for BST_POINTED), not counting
+ * 	  `malloc` overhead. With BST_SLAB and BST_COMPACT, the slots not in
+ * 	  use count as nodes. For BST_BTREE the nodes are walked, otherwise
+ * 	  this is O(1).
+ *
+ * 	- `rebalances` counts rotations, or B-tree node splits and merges, and
+ * 	  `rebuilds` the calls of `bst_balance` that rebuilt the tree.
+ */
+#define BST_STATS_DEPTHS	64
+
+typedef struct {
+	size_t	adds;
+	size_t	deletes;
+	size_t	lookups;
+	size_t	add_comparisons;
+	size_t	delete_comparisons;
+	size_t	lookup_comparisons;
+	size_t	filtered;
+	size_t	lookup_depths[BST_STATS_DEPTHS];
+	size_t	height;
+	size_t	max_height;
+	bool	height_exact;
+	size_t	node_bytes;
+	size_t	payload_bytes;
+	size_t	rebalances;
+	size_t	rebuilds;
+} bst_stats_t;
+
+bool	bst_stats	(bst_t* bst, bst_stats_t* stats);
+
+
+/*==============================================================================
+ * Order statistics. These require the BST to be created with BST_RANKED and
+ * run in O(height) time, i.e. O(log n) for a balanced tree.
+ *
+ * 	- `bst_rank` returns the number of elements smaller than `key`.
+ *
+ * 	- `bst_select` returns the data of the `k`-th smallest element,
+ * 	  counting from 0, or `NULL` if `k` is not smaller than the size.
+ *
+ * 	- `bst_count_range` returns the number of elements `x` such that
+ * 	  `lo` <= `x` <= `hi`.
+ */
+size_t	bst_rank	(bst_t* bst, const void* key);
+void*	bst_select	(bst_t* bst, size_t k);
+size_t	bst_count_range	(bst_t* bst, const void* lo, const void* hi);
+
+
 /*==============================================================================
  * The order in which the BST shall be traversed. Pass one of these as an
  * argument to the `bst_execute` function declared below.
@@ -168,6 +474,126 @@ void	bst_execute	(bst_t*			bst,
 			 traversal_order_t	order);
 
 
+/*==============================================================================
+ * Call `execute` on the data of every node in `bst`, on up to `threads`
+ * threads including the calling one (0 or 1 means the calling thread only).
+ * `execute` must therefore be safe to call from several threads at once.
+ *
+ * The tree is cut into a few dozen disjoint subtrees per thread. The threads
+ * start with equal shares of them, and those that finish early take subtrees
+ * over from the others.
+ *
+ * If `emit` is `NULL`, the elements are visited in no particular order and
+ * whatever `execute` returns is ignored. Otherwise, the results of `execute`
+ * are kept in a buffer per subtree, and `emit` is called on them by the
+ * calling thread, in the order of the elements (as ORDER_IN), once all
+ * subtrees are done. For example, to serialize every element in order:
+ *
+ * 	void* format(void* data)	{ return to_string(data); }
+ * 	void  write(void* result)	{ fputs(result, out); free(result); }
+ *
+ * 	bst_execute_parallel(bst, format, write, 8);
+ *
+ * Neither function may modify `bst`. A BST_BTREE or BST_COMPACT tree is always
+ * visited by the calling thread.
+ */
+void	bst_execute_parallel	(bst_t*		bst,
+				 void*		(*execute)(void* data),
+				 void		(*emit)(void* result),
+				 unsigned	threads);
+
+
+/*==============================================================================
+ * A cursor for walking the BST in order, one element at a time, starting from
+ * either end or from an arbitrary key. A range scan over k elements costs
+ * O(log n + k) and does not allocate: all state lives in the cursor, which is
+ * typically a local variable of the caller:
+ *
+ * 	bst_cursor_t cursor;
+ *
+ * 	for (bool ok = bst_cursor_lower_bound(&cursor, bst, &lo);
+ * 	     ok && cmp(bst_cursor_data(&cursor), &hi) <= 0;
+ * 	     ok = bst_cursor_next(&cursor)) {
+ * 		...
+ * 	}
+ *
+ * The members are private. A cursor is invalidated by any modification of the
+ * BST it points into, except with BST_CONCURRENT inside a read-side critical
+ * section (see `bst_read_begin`): the cursor then stays usable, but may or may
+ * not see modifications made after it was positioned.
+ */
+#define BST_CURSOR_DEPTH	128
+
+typedef struct {
+	bst_t*	bst;
+	node_t*	node;
+	node_t*	path[BST_CURSOR_DEPTH];
+	size_t	depth;
+	bool	lost;	/* The path to `node` was too long to record. */
+} bst_cursor_t;
+
+
+/*==============================================================================
+ * Position `cursor` on the smallest (`bst_cursor_first`) or largest
+ * (`bst_cursor_last`) element of `bst`.
+ *
+ * @return
+ * 	`true` if the cursor points to an element, `false` if `bst` is empty.
+ */
+bool	bst_cursor_first	(bst_cursor_t* cursor, bst_t* bst);
+bool	bst_cursor_last		(bst_cursor_t* cursor, bst_t* bst);
+
+
+/*==============================================================================
+ * Position `cursor` on the first element of `bst` that is not smaller than
+ * (`bst_cursor_lower_bound`) or greater than (`bst_cursor_upper_bound`) `key`,
+ * as decided by the compare function of the BST.
+ *
+ * @return
+ * 	`true` if the cursor points to an element, `false` if there is none.
+ */
+bool	bst_cursor_lower_bound	(bst_cursor_t* cursor, bst_t* bst,
+				 const void* key);
+bool	bst_cursor_upper_bound	(bst_cursor_t* cursor, bst_t* bst,
+				 const void* key);
+
+
+/*==============================================================================
+ * Move `cursor` to the next (or previous) element in order. Amortized O(1) on
+ * trees no deeper than BST_CURSOR_DEPTH; on deeper trees every step searches
+ * from the root.
+ *
+ * @return
+ * 	`true` if the cursor points to an element, `false` once it has moved
+ * 	past either end. It then has to be positioned again before use.
+ */
+bool	bst_cursor_next		(bst_cursor_t* cursor);
+bool	bst_cursor_prev		(bst_cursor_t* cursor);
+
+
+/*==============================================================================
+ * Return the data of the element `cursor` points to, or `NULL` if it does not
+ * point to any element.
+ */
+void*	bst_cursor_data		(bst_cursor_t* cursor);
+
+
+/*==============================================================================
+ * Mark the start and end of a read-side critical section of a BST created with
+ * BST_CONCURRENT. No node that can be reached from `bst` when the section is
+ * entered is freed before it is left, so cursors remain safe to use in between
+ * even while another thread modifies the tree. The token returned by
+ * `bst_read_begin` has to be passed to the matching `bst_read_end`. Sections
+ * may be nested, but should be short: writers have to wait for them to end
+ * from time to time to reclaim memory. For the same reason, a thread must not
+ * modify the tree from inside a section.
+ *
+ * Both are no-ops for other trees.
+ */
+unsigned	bst_read_begin	(bst_t* bst);
+void		bst_read_end	(bst_t* bst, unsigned token);
+
+
 /*==============================================================================
  * Balance the BST.
  *
@@ -179,6 +605,242 @@ void	bst_execute	(bst_t*			bst,
 bst_t*	bst_balanced	(bst_t* bst);
 
 
+/*==============================================================================
+ * Like `bst_balanced`, but on up to `threads` threads (including the calling
+ * one; pass 0 or 1 to use the calling thread only). The result is the same.
+ *
+ * Both phases of the rebuild are split into independent tasks, several per
+ * thread: the top of the old tree is cut into subtrees that are flattened in
+ * parallel, and the new tree is built top-down until the remaining ranges of
+ * elements can be built as separate subtrees. The threads start out with equal
+ * shares of the tasks, and those that finish early take over tasks from the
+ * others. Flattening a degenerate (list-like) tree does not parallelize.
+ */
+bst_t*	bst_balanced_parallel	(bst_t* bst, unsigned threads);
+
+
+/*==============================================================================
+ * Take a snapshot of a BST_PERSISTENT tree in O(1): the result is a new BST
+ * holding the same elements, which shares all nodes with `bst`. Afterwards,
+ * changes to either tree are not seen by the other, and each only copies the
+ * nodes it changes. A snapshot is a BST like any other, and is released with
+ * `bst_free`, in any order relative to `bst`.
+ *
+ * A snapshot and its original may be used by different threads at the same
+ * time, for instance to run a long report on a snapshot while the original
+ * keeps being updated. Each tree must still only be used by one thread at a
+ * time.
+ *
+ * @return
+ * 	The snapshot, or `NULL` if `bst` is not BST_PERSISTENT or memory ran
+ * 	out.
+ */
+bst_t*	bst_snapshot	(bst_t* bst);
+
+
+/*==============================================================================
+ * Balance the BST in place.
+ *
+ * Unlike `bst_balanced`, no new tree is created: the existing nodes are
+ * relinked (Day-Stout-Warren) into a tree of minimal height, using O(1) extra
+ * memory and no allocations. The handle pointed to by `bst` stays valid.
+ */
+void	bst_balance	(bst_t** bst);
+
+
+/*==============================================================================
+ * Fill the empty BST `bst` with the `count` elements of size `elem_size` stored
+ * contiguously at `base`, in any order.
+ *
+ * The elements are sorted (on up to `threads` threads; pass 0 or 1 to sort on
+ * the calling thread), duplicates according to `cmp` are dropped keeping the
+ * first occurrence, and a perfectly balanced tree is built directly from the
+ * result. This takes O(n log n) comparisons regardless of the input order. For
+ * a BST created with BST_SLAB, the nodes are allocated in a single block.
+ *
+ * With BST_POINTED, the nodes point into `base`, which is left unmodified.
+ *
+ * @return
+ * 	`true` on success, `false` if `bst` was not empty or memory ran out,
+ * 	in which case `bst` is left as it was.
+ */
+bool	bst_from_array	(bst_t*		bst,
+			 void*		base,
+			 size_t		count,
+			 unsigned	threads);
+
+
+/*==============================================================================
+ * Set operations on two BSTs holding the same kind of elements (of the same
+ * size, and compared by the same `cmp`; for maps, with keys of the same size).
+ * Each returns a new BST configured like `a` (but without its filter), which
+ * holds:
+ *
+ * 	- `bst_union`: the elements of both trees.
+ *
+ * 	- `bst_intersection`: the elements of `a` whose keys are in `b`.
+ *
+ * 	- `bst_difference`: the elements of `a` whose keys are not in `b`.
+ *
+ * Where both trees hold a key, the element of `a` is kept. Instead of adding
+ * elements one by one, which takes O(m log n) comparisons and may degenerate a
+ * plain tree, the in-order sequences of the trees are merged in O(m + n)
+ * comparisons, and the result is built perfectly balanced from the merged
+ * sequence (as by `bst_balanced`; a BST_BTREE result is filled in order).
+ *
+ * On up to `threads` threads (pass 0 or 1 for the calling thread only), both
+ * trees are flattened and the result is built as by `bst_balanced_parallel`,
+ * and the merge is divide-and-conquer: the larger sequence is cut into equal
+ * ranges, the other one where their first keys would go, and the pairs of
+ * ranges are merged independently.
+ *
+ * With BST_COPIED, the result holds copies of the elements. With BST_POINTED,
+ * it points to the elements the trees point to (or, for elements taken from a
+ * BST_COPIED `b`, into `b`, which must then outlive it). With BST_CONCURRENT,
+ * writers of both trees are held off until the result is built.
+ *
+ * @return
+ * 	The new BST, or `NULL` if the trees do not match or memory ran out.
+ */
+bst_t*	bst_union		(bst_t* a, bst_t* b, unsigned threads);
+bst_t*	bst_intersection	(bst_t* a, bst_t* b, unsigned threads);
+bst_t*	bst_difference		(bst_t* a, bst_t* b, unsigned threads);
+
+
+/*==============================================================================
+ * Split `bst` at `key`: the elements whose keys are not smaller than `key` are
+ * moved, without copying, into a new BST configured like `bst` (but without a
+ * filter), and the others stay in `bst`.
+ *
+ * Unless `bst` is BST_RANKED, the moved elements have to be counted, so the
+ * split takes O(log n + moved) even with BST_AVL; the bounds below are for
+ * BST_RANKED trees. With BST_AVL, both halves stay balanced and the split
+ * takes O(log n). Splay trees (BST_SPLAY and BST_SPLAY_LAZY) split at the root
+ * after splaying `key`, in O(log n) amortized. Other trees are cut along the
+ * search path in O(height), which may leave the halves less balanced than
+ * `bst` was.
+ *
+ * BST_SLAB, BST_BTREE, BST_CONCURRENT, BST_PERSISTENT and BST_COMPACT trees
+ * can not be split.
+ *
+ * @return
+ * 	The new BST, or `NULL` on error.
+ */
+bst_t*	bst_split		(bst_t* bst, const void* key);
+
+/*==============================================================================
+ * Concatenate `b` to `a`, whose keys must all be smaller than those of `b`.
+ * The nodes of `b` are moved into `a`, without copying, and `b` is left empty.
+ * The trees must be configured alike, and neither may be BST_SLAB, BST_BTREE,
+ * BST_CONCURRENT, BST_PERSISTENT or BST_COMPACT.
+ *
+ * With BST_AVL, the shorter tree is hung where the heights match and `a` stays
+ * balanced, in O(log n). For splay trees it takes O(log n) amortized, and for
+ * other trees O(height). If `a` has a filter, it is rebuilt in O(n).
+ *
+ * @return
+ * 	`true` on success, or `false` if the trees can not be joined (both are
+ * 	then unchanged).
+ */
+bool	bst_join		(bst_t* a, bst_t* b);
+
+/*==============================================================================
+ * Delete the elements whose keys are in [`lo`, `hi`] from `bst`, freeing them
+ * as `bst_delete` does.
+ *
+ * The range is split off and rejoined as by `bst_split` and `bst_join`, so
+ * that apart from freeing the k deleted elements it takes O(log n) with
+ * BST_AVL (and amortized for splay trees), and O(height) otherwise. BST_SLAB
+ * is supported. BST_BTREE, BST_CONCURRENT, BST_PERSISTENT and BST_COMPACT
+ * trees copy the keys in the range (while writers are held off) and delete them
+ * one by one, in O(k log n), plus O(n) for BST_BTREE and BST_COMPACT.
+ *
+ * @return
+ * 	The number of elements deleted, which is 0 if `lo` is greater than `hi`.
+ */
+size_t	bst_delete_range	(bst_t* bst, const void* lo, const void* hi);
+
+
+/*==============================================================================
+ * Create a frozen, read-only snapshot of `bst`.
+ *
+ * The elements are copied by value (`elem_size` bytes each, without calling
+ * any function on them) into one contiguous array in Eytzinger order, i.e. the
+ * BST laid out level by level. Searching it touches consecutive memory near the
+ * top, prefetches the levels below and has no unpredictable branches, which
+ * makes lookups considerably faster than in the BST once it no longer fits in
+ * the cache. Later changes to `bst` are not reflected in the snapshot, and the
+ * snapshot does not depend on `bst` (but its copies may share whatever the
+ * elements point to).
+ *
+ * @return
+ * 	A handle to be passed to the `bst_frozen_?` functions below, and
+ * 	eventually to `bst_frozen_free`.
+ */
+bst_frozen_t*	bst_freeze	(bst_t* bst);
+
+void	bst_frozen_free		(bst_frozen_t* frozen);
+
+size_t	bst_frozen_size		(bst_frozen_t* frozen);
+
+bool	bst_frozen_contains	(bst_frozen_t* frozen, const void* key);
+
+
+/*==============================================================================
+ * Iterate over a frozen snapshot in order. Elements are identified by
+ * positions, where 0 means "no element":
+ *
+ * 	- `bst_frozen_lower_bound` returns the position of the first element
+ * 	  not smaller than `key`.
+ *
+ * 	- `bst_frozen_first` returns the position of the smallest element.
+ *
+ * 	- `bst_frozen_next` returns the position following `pos`.
+ *
+ * 	- `bst_frozen_data` returns the element at `pos`, or `NULL`.
+ *
+ * For example:
+ *
+ * 	for (size_t pos = bst_frozen_first(frozen); pos != 0;
+ * 	     pos = bst_frozen_next(frozen, pos)) {
+ * 		print(bst_frozen_data(frozen, pos));
+ * 	}
+ */
+size_t	bst_frozen_lower_bound	(bst_frozen_t* frozen, const void* key);
+size_t	bst_frozen_first	(bst_frozen_t* frozen);
+size_t	bst_frozen_next		(bst_frozen_t* frozen, size_t pos);
+void*	bst_frozen_data		(bst_frozen_t* frozen, size_t pos);
+
+
+/*==============================================================================
+ * Save `bst` to the file at `path` (replacing it), and load it back, possibly
+ * in another process, as a frozen snapshot.
+ *
+ * `bst_save` writes what `bst_freeze` would create: a short header (element
+ * size, count and layout), followed by the arrays of the snapshot, which refer
+ * to each other by index rather than by address. `bst_load` maps the file into
+ * memory and uses the arrays where they are, without reading or copying
+ * anything up front: the snapshot can be searched immediately, the pages that
+ * are touched are read in as needed, and processes that load the same file
+ * share them. The file must not be changed while it is loaded; `bst_save`
+ * itself writes a new file and renames it into place, which leaves earlier
+ * loads intact. `bst_frozen_free` unmaps the file.
+ *
+ * The elements are saved byte for byte, so they must not contain pointers, and
+ * the file can only be loaded on machines with the same byte order and word
+ * size. `cmp` must be the compare function the tree was created with, or at
+ * least one that the tree would treat the same (see `bst_cmp_int32` etc.).
+ *
+ * @return
+ * 	`bst_save` returns whether the file was written. `bst_load` returns the
+ * 	snapshot, or `NULL` if the file could not be mapped or was not saved by
+ * 	`bst_save` on a similar machine with a matching `cmp`.
+ */
+bool		bst_save	(bst_t* bst, const char* path);
+bst_frozen_t*	bst_load	(const char* path,
+				 int (*cmp)(const void*, const void*));
+
+
 /*==============================================================================
  * Print a representation of the BST to `stdout`. The `print` function pointer
  * is is of the same kind as the one used when creating the tree. The reason
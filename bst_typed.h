@@ -0,0 +1,373 @@
+#ifndef BST_TYPED_H
+#define BST_TYPED_H
+
+#include "bst.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*==============================================================================
+ * Generate a typed, self-balancing (AVL) BST for keys of type `key_type`.
+ *
+ * Unlike the `bst_t` declared in bst.h, the generated tree stores its keys by
+ * value inside the nodes and compares them with `cmp`, which is expanded
+ * inline, so no function is called through a pointer and no data lives
+ * outside the nodes. Use `bst_t` when the element type is only known at run
+ * time.
+ *
+ * @arg `name`
+ * 	Prefix of everything that is generated.
+ *
+ * @arg `key_type`
+ * 	The type of the keys; anything that can be assigned.
+ *
+ * @arg `cmp`
+ * 	The name of a function or function-like macro taking two `key_type`
+ * 	values and returning an integer which is == 0, > 0 or < 0, like the
+ * 	`cmp` argument of `bst_new`. For example:
+ *
+ * 		#define INT_CMP(a, b)	(((a) > (b)) - ((a) < (b)))
+ *
+ * 		BST_DEFINE(int_tree, int, INT_CMP)
+ *
+ * This generates, where `T` is `name_t`:
+ *
+ * 	T*	name_new	(void);
+ * 	void	name_free	(T* tree);
+ * 	bool	name_add	(T* tree, key_type key);
+ * 	bool	name_delete	(T* tree, key_type key);
+ * 	bool	name_contains	(T* tree, key_type key);
+ * 	size_t	name_size	(T* tree);
+ * 	size_t	name_height	(T* tree);
+ * 	void	name_balance	(T* tree);
+ * 	void	name_execute	(T* tree, void (*execute)(key_type* key),
+ * 				 traversal_order_t order);
+ *
+ * which behave like their `bst_?` counterparts, except that `name_add` and
+ * `name_delete` return whether the tree changed and nothing is printed.
+ * Everything is `static`, so the macro can be used in any number of
+ * translation units.
+ */
+#define BST_DEFINE(name, key_type, cmp)					\
+									\
+typedef struct name##_node_t name##_node_t;				\
+									\
+struct name##_node_t {							\
+	key_type	key;						\
+	name##_node_t*	left;						\
+	name##_node_t*	right;						\
+	int		height;						\
+};									\
+									\
+typedef struct {							\
+	name##_node_t*	root;						\
+	size_t		size;						\
+} name##_t;								\
+									\
+static inline int name##_node_height(name##_node_t* node)		\
+{									\
+	return node == NULL ? 0 : node->height;				\
+}									\
+									\
+static inline void name##_node_update(name##_node_t* node)		\
+{									\
+	int l = name##_node_height(node->left);				\
+	int r = name##_node_height(node->right);			\
+	node->height = 1 + (l > r ? l : r);				\
+}									\
+									\
+static inline name##_node_t* name##_rotate_left(name##_node_t* node)	\
+{									\
+	name##_node_t* pivot	= node->right;				\
+	node->right		= pivot->left;				\
+	pivot->left		= node;					\
+	name##_node_update(node);					\
+	name##_node_update(pivot);					\
+	return pivot;							\
+}									\
+									\
+static inline name##_node_t* name##_rotate_right(name##_node_t* node)	\
+{									\
+	name##_node_t* pivot	= node->left;				\
+	node->left		= pivot->right;				\
+	pivot->right		= node;					\
+	name##_node_update(node);					\
+	name##_node_update(pivot);					\
+	return pivot;							\
+}									\
+									\
+static inline name##_node_t* name##_node_fix(name##_node_t* node)	\
+{									\
+	int balance = name##_node_height(node->left) -			\
+		      name##_node_height(node->right);			\
+	if (balance > 1) {						\
+		if (name##_node_height(node->left->left) <		\
+		    name##_node_height(node->left->right)) {		\
+			node->left = name##_rotate_left(node->left);	\
+		}							\
+		return name##_rotate_right(node);			\
+	}								\
+	if (balance < -1) {						\
+		if (name##_node_height(node->right->right) <		\
+		    name##_node_height(node->right->left)) {		\
+			node->right = name##_rotate_right(node->right);	\
+		}							\
+		return name##_rotate_left(node);			\
+	}								\
+	name##_node_update(node);					\
+	return node;							\
+}									\
+									\
+static inline void name##_retrace(name##_node_t** path[], size_t depth)	\
+{									\
+	while (depth > 0) {						\
+		name##_node_t**	link	= path[--depth];		\
+		int		height	= (*link)->height;		\
+		*link = name##_node_fix(*link);				\
+		if ((*link)->height == height) {			\
+			break;						\
+		}							\
+	}								\
+}									\
+									\
+static inline name##_t* name##_new(void)				\
+{									\
+	name##_t* tree = malloc(sizeof *tree);				\
+	if (tree == NULL) {						\
+		fprintf(stderr, "`malloc` failed.\n");			\
+		return NULL;						\
+	}								\
+	tree->root = NULL;						\
+	tree->size = 0;							\
+	return tree;							\
+}									\
+									\
+static inline void name##_free(name##_t* tree)				\
+{									\
+	if (tree == NULL) {						\
+		return;							\
+	}								\
+	name##_node_t* node = tree->root;				\
+	while (node != NULL) {						\
+		if (node->left != NULL) {				\
+			name##_node_t* left	= node->left;		\
+			node->left		= left->right;		\
+			left->right		= node;			\
+			node			= left;			\
+		} else {						\
+			name##_node_t* right	= node->right;		\
+			free(node);					\
+			node			= right;		\
+		}							\
+	}								\
+	free(tree);							\
+}									\
+									\
+static inline bool name##_add(name##_t* tree, key_type key)		\
+{									\
+	name##_node_t**	path[BST_TYPED_MAX_HEIGHT];			\
+	size_t		depth	= 0;					\
+	name##_node_t**	link	= &tree->root;				\
+	name##_node_t*	node;						\
+									\
+	while ((node = *link) != NULL) {				\
+		int cmp_result = cmp(key, node->key);			\
+		if (cmp_result == 0) {					\
+			return false;					\
+		}							\
+		path[depth++] = link;					\
+		link = cmp_result < 0 ? &node->left : &node->right;	\
+	}								\
+	if ((node = malloc(sizeof *node)) == NULL) {			\
+		fprintf(stderr, "`malloc` failed.\n");			\
+		return false;						\
+	}								\
+	node->key	= key;						\
+	node->left	= NULL;						\
+	node->right	= NULL;						\
+	node->height	= 1;						\
+	*link		= node;						\
+	tree->size	+= 1;						\
+	name##_retrace(path, depth);					\
+	return true;							\
+}									\
+									\
+static inline bool name##_delete(name##_t* tree, key_type key)		\
+{									\
+	name##_node_t**	path[BST_TYPED_MAX_HEIGHT];			\
+	size_t		depth	= 0;					\
+	name##_node_t**	link	= &tree->root;				\
+	name##_node_t*	node;						\
+									\
+	while ((node = *link) != NULL) {				\
+		int cmp_result = cmp(key, node->key);			\
+		if (cmp_result == 0) {					\
+			break;						\
+		}							\
+		path[depth++] = link;					\
+		link = cmp_result < 0 ? &node->left : &node->right;	\
+	}								\
+	if (node == NULL) {						\
+		return false;						\
+	}								\
+	if (node->left == NULL) {					\
+		*link = node->right;					\
+	} else if (node->right == NULL) {				\
+		*link = node->left;					\
+	} else {							\
+		size_t		top	 = depth;			\
+		name##_node_t**	min_link = &node->right;		\
+		name##_node_t*	min;					\
+		path[depth++] = link;					\
+		while ((*min_link)->left != NULL) {			\
+			path[depth++] = min_link;			\
+			min_link = &(*min_link)->left;			\
+		}							\
+		min		= *min_link;				\
+		*min_link	= min->right;				\
+		min->left	= node->left;				\
+		min->right	= node->right;				\
+		min->height	= node->height;				\
+		*link		= min;					\
+		if (depth > top + 1) {					\
+			path[top + 1] = &min->right;			\
+		}							\
+	}								\
+	free(node);							\
+	tree->size -= 1;						\
+	name##_retrace(path, depth);					\
+	return true;							\
+}									\
+									\
+static inline bool name##_contains(name##_t* tree, key_type key)	\
+{									\
+	name##_node_t* node = tree->root;				\
+	while (node != NULL) {						\
+		int cmp_result = cmp(key, node->key);			\
+		if (cmp_result == 0) {					\
+			return true;					\
+		}							\
+		node = cmp_result < 0 ? node->left : node->right;	\
+	}								\
+	return false;							\
+}									\
+									\
+static inline size_t name##_size(name##_t* tree)			\
+{									\
+	return tree->size;						\
+}									\
+									\
+static inline size_t name##_height(name##_t* tree)			\
+{									\
+	return (size_t)name##_node_height(tree->root);			\
+}									\
+									\
+static inline void name##_fix_all(name##_node_t* node)			\
+{									\
+	if (node != NULL) {						\
+		name##_fix_all(node->left);				\
+		name##_fix_all(node->right);				\
+		name##_node_update(node);				\
+	}								\
+}									\
+									\
+static inline void name##_compress(name##_node_t* scanner, size_t count)\
+{									\
+	for (size_t i = 0; i < count; ++i) {				\
+		name##_node_t* child	= scanner->right;		\
+		scanner->right		= child->right;			\
+		scanner			= scanner->right;		\
+		child->right		= scanner->left;		\
+		scanner->left		= child;			\
+	}								\
+}									\
+									\
+/* Day-Stout-Warren, as in `bst_balance`. */				\
+static inline void name##_balance(name##_t* tree)			\
+{									\
+	name##_node_t	pseudo_root = { .left = NULL };			\
+	name##_node_t*	tail	= &pseudo_root;				\
+	name##_node_t*	rest	= tree->root;				\
+	size_t		size	= 1;					\
+									\
+	pseudo_root.right = tree->root;					\
+	while (rest != NULL) {						\
+		if (rest->left == NULL) {				\
+			tail = rest;					\
+			rest = rest->right;				\
+		} else {						\
+			name##_node_t* tmp	= rest->left;		\
+			rest->left		= tmp->right;		\
+			tmp->right		= rest;			\
+			rest			= tmp;			\
+			tail->right		= tmp;			\
+		}							\
+	}								\
+	while (size * 2 <= tree->size + 1) {				\
+		size *= 2;						\
+	}								\
+	size -= 1;							\
+	name##_compress(&pseudo_root, tree->size - size);		\
+	for (; size > 1; size /= 2) {					\
+		name##_compress(&pseudo_root, size / 2);		\
+	}								\
+	tree->root = pseudo_root.right;					\
+	name##_fix_all(tree->root);					\
+}									\
+									\
+static inline void name##_execute(name##_t*		tree,		\
+				  void			(*execute)(key_type*),\
+				  traversal_order_t	order)		\
+{									\
+	name##_node_t*	stack[2 * BST_TYPED_MAX_HEIGHT];		\
+	bool		done[2 * BST_TYPED_MAX_HEIGHT];			\
+	size_t		len	= 0;					\
+	name##_node_t*	node	= tree->root;				\
+									\
+	if (order == ORDER_IN) {					\
+		for (;;) {						\
+			for (; node != NULL; node = node->left) {	\
+				stack[len++] = node;			\
+			}						\
+			if (len == 0) {					\
+				break;					\
+			}						\
+			node = stack[--len];				\
+			execute(&node->key);				\
+			node = node->right;				\
+		}							\
+		return;							\
+	}								\
+	if (node != NULL) {						\
+		stack[len] = node;					\
+		done[len++] = false;					\
+	}								\
+	while (len > 0) {						\
+		node = stack[--len];					\
+		if (done[len] || order == ORDER_PRE) {			\
+			execute(&node->key);				\
+			if (order == ORDER_POST) {			\
+				continue;				\
+			}						\
+		} else {						\
+			stack[len] = node;				\
+			done[len++] = true;				\
+		}							\
+		if (node->right != NULL) {				\
+			stack[len] = node->right;			\
+			done[len++] = false;				\
+		}							\
+		if (node->left != NULL) {				\
+			stack[len] = node->left;			\
+			done[len++] = false;				\
+		}							\
+	}								\
+}
+
+/* The generated trees are always AVL-balanced, so no path from the root is
+ * longer than this. */
+#define BST_TYPED_MAX_HEIGHT	128
+
+
+#endif /* BST_TYPED_H */
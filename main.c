@@ -1,4 +1,7 @@
 #include "bst.h"
+#include "bst_typed.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -10,6 +13,23 @@ typedef struct {
 void test_person_heap	(void);
 void test_person	(void);
 void test_int		(void);
+void test_int_avl	(void);
+void test_int_slab	(void);
+void test_int_typed	(void);
+void test_int_concurrent(void);
+void test_int_snapshot	(void);
+void test_int_map	(void);
+void test_int_ranked	(void);
+void test_int_frozen	(void);
+void test_int_btree	(void);
+void test_int_kind	(void);
+void test_int_saved	(void);
+void test_int_filter	(void);
+void test_int_splay	(void);
+void test_int_many	(void);
+void test_int_sets	(void);
+void test_int_split	(void);
+void test_int_compact	(void);
 
 person_t*	person_new_heap	(const char* name, int age);
 person_t 	person_new_stack(const char* name, int age);
@@ -19,10 +39,31 @@ void		person_print	(void* data);
 
 int		int_cmp		(const void* a, const void* b);
 void		int_print	(void* data);
+void		int_print_spaced(void* data);
+void*		int_square	(void* data);
+void		int_square_print(void* result);
+uint64_t	int_hash	(const void* key);
 
 int main(void)
 {
 	test_int	();
+	test_int_avl	();
+	test_int_slab	();
+	test_int_typed	();
+	test_int_concurrent();
+	test_int_snapshot();
+	test_int_map	();
+	test_int_ranked	();
+	test_int_frozen	();
+	test_int_btree	();
+	test_int_kind	();
+	test_int_saved	();
+	test_int_filter	();
+	test_int_splay	();
+	test_int_many	();
+	test_int_sets	();
+	test_int_split	();
+	test_int_compact();
 	test_person	();
 	test_person_heap();
 }
@@ -35,7 +76,8 @@ void test_int()
 	bst_t*	bst;
 	int	arr[10];
 
-	bst = bst_new(BST_COPIED, sizeof(int), int_cmp, free, int_print);
+	bst = bst_new(BST_COPIED, BST_PLAIN, sizeof(int), int_cmp, free,
+		      int_print);
 	if (bst == NULL) {
 		exit(EXIT_FAILURE);
 	}
@@ -57,18 +99,717 @@ void test_int()
 	bst_delete	(bst, &arr[5 - 1]);
 	bst_print	(bst, int_print);
 
+	/* The same, with the copy flattened and built on 4 threads. */
+	printf		("\nBalancing the tree on 4 threads...\n");
+	tmp		= bst;
+	bst		= bst_balanced_parallel(tmp, 4);
+	bst_free	(tmp);
+	printf		("Balanced the tree!\n\n");
+
+	bst_print	(bst, int_print);
+
 	bst_free	(bst);
 
 	printf("\n\n");
 }
 
+void test_int_avl()
+{
+	printf( "----------------------------------------\n"
+		" test_int_avl\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	int	arr[10];
+
+	bst = bst_new(BST_COPIED, BST_AVL, sizeof(int), int_cmp, free,
+		      int_print);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sorted input no longer degenerates the tree. */
+	for (int i = 0; i < 10; ++i) {
+		arr[i] = i + 1;
+		bst_add(bst, &arr[i]);
+	}
+
+	bst_print	(bst, int_print);
+	printf		("Height: %zu\n\n", bst_height(bst));
+
+	/* Range scan over [3, 7] without visiting the rest of the tree. */
+	bst_cursor_t	cursor;
+	int		lo = 3, hi = 7;
+
+	printf("Range [%d, %d]:", lo, hi);
+	for (bool ok = bst_cursor_lower_bound(&cursor, bst, &lo);
+	     ok && int_cmp(bst_cursor_data(&cursor), &hi) <= 0;
+	     ok = bst_cursor_next(&cursor)) {
+		printf(" ");
+		int_print(bst_cursor_data(&cursor));
+	}
+	printf("\n\n");
+
+	/* Squares computed on 4 threads, printed in order. */
+	printf("Squares:");
+	bst_execute_parallel(bst, int_square, int_square_print, 4);
+	printf("\n\n");
+
+	for (int i = 0; i < 5; ++i) {
+		bst_delete(bst, &arr[i]);
+	}
+
+	bst_print	(bst, int_print);
+	printf		("Height: %zu\n", bst_height(bst));
+
+	bst_free	(bst);
+
+	printf("\n\n");
+}
+
+void test_int_slab()
+{
+	printf( "----------------------------------------\n"
+		" test_int_slab\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	int	arr[1000];
+
+	/* The slab owns the copied ints, so `free` is never called on them. */
+	bst = bst_new(BST_COPIED, BST_AVL | BST_SLAB, sizeof(int), int_cmp,
+		      free, int_print);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		arr[i] = i + 1;
+		bst_add(bst, &arr[i]);
+	}
+	printf("Size: %zu, height: %zu\n", bst_size(bst), bst_height(bst));
+
+	/* Deleted nodes go back to the slab and are reused by the next adds. */
+	for (int i = 0; i < 1000; i += 2) {
+		bst_delete(bst, &arr[i]);
+	}
+	printf("Size: %zu, height: %zu\n", bst_size(bst), bst_height(bst));
+
+	for (int i = 0; i < 1000; i += 2) {
+		bst_add(bst, &arr[i]);
+	}
+	printf("Size: %zu, height: %zu\n", bst_size(bst), bst_height(bst));
+
+	/* Only the slab chunks are released; the nodes are not walked. */
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+#define INT_CMP(a, b)	(((a) > (b)) - ((a) < (b)))
+
+BST_DEFINE(int_tree, int, INT_CMP)
+
+void int_tree_print(int* key)
+{
+	printf(" %d", *key);
+}
+
+void test_int_typed()
+{
+	printf( "----------------------------------------\n"
+		" test_int_typed\n"
+		"----------------------------------------\n\n" );
+
+	int_tree_t* tree = int_tree_new();
+	if (tree == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Keys are passed and stored by value. */
+	for (int i = 1; i <= 10; ++i) {
+		int_tree_add(tree, i);
+	}
+	int_tree_delete(tree, 5);
+
+	printf("In order:");
+	int_tree_execute(tree, int_tree_print, ORDER_IN);
+	printf("\nContains 5: %s\n", int_tree_contains(tree, 5) ? "yes" : "no");
+	printf("Height: %zu\n", int_tree_height(tree));
+
+	int_tree_free(tree);
+
+	printf("\n\n");
+}
+
+typedef struct {
+	bst_t*	bst;
+	bool	done;
+	size_t	missed;
+} reader_t;
+
+/* Look up the even keys, which are never deleted, until the writer is done. */
+void* reader_run(void* arg)
+{
+	reader_t* reader = arg;
+
+	while (!__atomic_load_n(&reader->done, __ATOMIC_ACQUIRE)) {
+		for (int32_t key = 0; key < 100; key += 2) {
+			if (!bst_contains(reader->bst, &key)) {
+				reader->missed += 1;
+			}
+		}
+	}
+	return NULL;
+}
+
+void test_int_concurrent()
+{
+	printf( "----------------------------------------\n"
+		" test_int_concurrent\n"
+		"----------------------------------------\n\n" );
+
+	/* No `print` function: `bst_contains` would print every lookup. */
+	bst_t* bst = bst_new(BST_COPIED, BST_AVL | BST_CONCURRENT,
+			     sizeof(int32_t), bst_cmp_int32, free, NULL);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int32_t key = 0; key < 100; key += 2) {
+		bst_add(bst, &key);
+	}
+
+	reader_t	reader = { bst, false, 0 };
+	pthread_t	thread;
+
+	if (pthread_create(&thread, NULL, reader_run, &reader) != 0) {
+		exit(EXIT_FAILURE);
+	}
+	/* Meanwhile, rotate the odd keys in and out. */
+	for (int i = 0; i < 10000; ++i) {
+		int32_t key = (i * 37) % 100 | 1;
+		if (i % 2 == 0) {
+			bst_add(bst, &key);
+		} else {
+			bst_delete(bst, &key);
+		}
+	}
+	__atomic_store_n(&reader.done, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	printf("Size: %zu, height: %zu\n", bst_size(bst), bst_height(bst));
+	printf("Lookups missed by the reader: %zu\n", reader.missed);
+
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_snapshot()
+{
+	printf( "----------------------------------------\n"
+		" test_int_snapshot\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	bst_t*	snapshot;
+
+	bst = bst_new(BST_COPIED, BST_AVL | BST_PERSISTENT, sizeof(int),
+		      int_cmp, free, int_print);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 1; i <= 10; ++i) {
+		bst_add(bst, &i);
+	}
+
+	/* The snapshot keeps seeing the tree as it is now. */
+	snapshot = bst_snapshot(bst);
+	for (int i = 1; i <= 10; i += 2) {
+		bst_delete(bst, &i);
+	}
+
+	printf("Tree:    ");
+	bst_execute(bst, int_print_spaced, ORDER_IN);
+	printf("\nSnapshot:");
+	bst_execute(snapshot, int_print_spaced, ORDER_IN);
+	printf("\n");
+
+	bst_free(snapshot);
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_map()
+{
+	printf( "----------------------------------------\n"
+		" test_int_map\n"
+		"----------------------------------------\n\n" );
+	int	digits[]	= { 3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5 };
+	int	zero		= 0;
+	bst_t*	counts;
+
+	counts = bst_new_map(BST_AVL, sizeof(int), sizeof(int), int_cmp,
+			     int_print);
+	if (counts == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Each count is found, or added, in a single descent. */
+	for (size_t i = 0; i < sizeof digits / sizeof *digits; ++i) {
+		int* count = bst_get_or_insert(counts, &digits[i], &zero, NULL);
+		*count += 1;
+	}
+	bst_upsert(counts, &digits[0], &zero);
+
+	for (int digit = 0; digit < 10; ++digit) {
+		int* count = bst_find(counts, &digit);
+		if (count != NULL) {
+			printf("%d: %d\n", digit, *count);
+		}
+	}
+
+	bst_free(counts);
+
+	printf("\n\n");
+}
+
+void test_int_ranked()
+{
+	printf( "----------------------------------------\n"
+		" test_int_ranked\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	int	lo = 25, hi = 75;
+
+	bst = bst_new(BST_COPIED, BST_AVL | BST_RANKED, sizeof(int), int_cmp,
+		      free, int_print);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 10; i <= 100; i += 10) {
+		bst_add(bst, &i);
+	}
+
+	/* Each of these descends the tree once, using the subtree sizes. */
+	printf("Rank of %d: %zu\n", lo, bst_rank(bst, &lo));
+	printf("Median: ");
+	int_print(bst_select(bst, bst_size(bst) / 2));
+	printf("\nElements in [%d, %d]: %zu\n", lo, hi,
+	       bst_count_range(bst, &lo, &hi));
+
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_frozen()
+{
+	printf( "----------------------------------------\n"
+		" test_int_frozen\n"
+		"----------------------------------------\n\n" );
+	bst_t*		bst;
+	bst_frozen_t*	frozen;
+	int		key = 42;
+
+	bst = bst_new(BST_COPIED, BST_PLAIN, sizeof(int), int_cmp, free, NULL);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 100; i += 3) {
+		bst_add(bst, &i);
+	}
+
+	/* The snapshot is a copy: deleting from the tree does not change it. */
+	frozen = bst_freeze(bst);
+	if (frozen == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	bst_delete(bst, &key);
+
+	printf("Size: %zu, contains %d: %d\n", bst_frozen_size(frozen), key,
+	       bst_frozen_contains(frozen, &key));
+	printf("From %d:", key);
+	for (size_t pos = bst_frozen_lower_bound(frozen, &key); pos != 0;
+	     pos = bst_frozen_next(frozen, pos)) {
+		int_print_spaced(bst_frozen_data(frozen, pos));
+	}
+	printf("\n");
+
+	bst_frozen_free(frozen);
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_btree()
+{
+	printf( "----------------------------------------\n"
+		" test_int_btree\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	bst_t*	copy;
+	int	arr[1000];
+	int	key = 501;
+
+	bst = bst_new(BST_COPIED, BST_BTREE, sizeof(int), int_cmp, free, NULL);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		arr[i] = 1000 - i;
+	}
+	if (!bst_from_array(bst, arr, 1000, 1)) {
+		exit(EXIT_FAILURE);
+	}
+	/* Up to 15 keys share a node, so the tree is much shallower. */
+	printf("Size: %zu, height: %zu\n", bst_size(bst), bst_height(bst));
+
+	for (int i = 0; i < 1000; i += 2) {
+		bst_delete(bst, &arr[i]);
+	}
+	printf("Size: %zu, height: %zu, contains %d: %d\n", bst_size(bst),
+	       bst_height(bst), key, bst_contains(bst, &key));
+
+	/* A B-tree is always balanced: this makes a copy. */
+	copy = bst_balanced(bst);
+	if (copy == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	printf("Copy size: %zu\n", bst_size(copy));
+
+	bst_free(copy);
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_kind()
+{
+	printf( "----------------------------------------\n"
+		" test_int_kind\n"
+		"----------------------------------------\n\n" );
+	bst_t*		bst;
+	bst_frozen_t*	frozen;
+	int32_t		arr[10000];
+	size_t		found = 0, frozen_found = 0;
+
+	/* `bst_cmp_int32` is recognized: keys are compared inline, and the
+	 * snapshot is searched a block of keys at a time. */
+	bst = bst_new(BST_COPIED, BST_AVL, sizeof(int32_t), bst_cmp_int32,
+		      free, NULL);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int32_t i = 0; i < 10000; ++i) {
+		arr[i] = 3 * i;
+	}
+	if (!bst_from_array(bst, arr, 10000, 1) ||
+	    (frozen = bst_freeze(bst)) == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	for (int32_t key = 0; key < 30000; ++key) {
+		found		+= bst_contains(bst, &key);
+		frozen_found	+= bst_frozen_contains(frozen, &key);
+	}
+	printf("Found in the tree: %zu, in the snapshot: %zu\n", found,
+	       frozen_found);
+
+	bst_frozen_free(frozen);
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_saved()
+{
+	printf( "----------------------------------------\n"
+		" test_int_saved\n"
+		"----------------------------------------\n\n" );
+	const char*	path = "test_int_saved.bst";
+	bst_t*		bst;
+	bst_frozen_t*	loaded;
+	int32_t		key = 12;
+
+	bst = bst_new(BST_COPIED, BST_AVL, sizeof(int32_t), bst_cmp_int32,
+		      free, NULL);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int32_t i = 0; i < 20; i += 2) {
+		bst_add(bst, &i);
+	}
+
+	/* The file is mapped, not read: lookups use it where it lies. */
+	if (!bst_save(bst, path)) {
+		exit(EXIT_FAILURE);
+	}
+	loaded = bst_load(path, bst_cmp_int32);
+	if (loaded == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	printf("Loaded %zu elements, contains %d: %d\n",
+	       bst_frozen_size(loaded), key, bst_frozen_contains(loaded, &key));
+	printf("Elements:");
+	for (size_t pos = bst_frozen_first(loaded); pos != 0;
+	     pos = bst_frozen_next(loaded, pos)) {
+		printf(" %d", *(int32_t*)bst_frozen_data(loaded, pos));
+	}
+	printf("\n");
+
+	bst_frozen_free(loaded);
+	bst_free(bst);
+	remove(path);
+
+	printf("\n\n");
+}
+
+void test_int_filter()
+{
+	printf( "----------------------------------------\n"
+		" test_int_filter\n"
+		"----------------------------------------\n\n" );
+	bst_t*		bst;
+	bst_stats_t	stats;
+	size_t		found = 0;
+
+	bst = bst_new(BST_COPIED, BST_AVL, sizeof(int), int_cmp, free, NULL);
+	if (bst == NULL || !bst_filter(bst, int_hash, 0.01)) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		bst_add(bst, &i);
+	}
+
+	/* None of these are in the tree: most never reach it. */
+	for (int key = 1000; key < 2000; ++key) {
+		found += bst_contains(bst, &key);
+	}
+	printf("Found %zu of 1000 absent keys\n", found);
+	if (bst_stats(bst, &stats)) {
+		printf("Answered by the filter: %zu\n", stats.filtered);
+	}
+
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_splay()
+{
+	printf( "----------------------------------------\n"
+		" test_int_splay\n"
+		"----------------------------------------\n\n" );
+	bst_mode_t	modes[] = { BST_SPLAY, BST_SPLAY_LAZY };
+	char*		names[] = { "BST_SPLAY", "BST_SPLAY_LAZY" };
+
+	for (int m = 0; m < 2; ++m) {
+		bst_t*	bst;
+		size_t	found = 0;
+
+		bst = bst_new(BST_COPIED, modes[m], sizeof(int), int_cmp, free,
+			      NULL);
+		if (bst == NULL) {
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 1; i <= 1000; ++i) {
+			bst_add(bst, &i);
+		}
+		printf("%s\nHeight after sorted adds: %zu\n", names[m],
+		       bst_height(bst));
+
+		/* Nine lookups in ten are for the same eight keys, which are
+		 * splayed to the root and stay near it. */
+		for (int i = 0; i < 10000; ++i) {
+			int key = i % 10 != 0 ? 1 + i % 8 * 125 : 1 + i % 1000;
+			found += bst_contains(bst, &key);
+		}
+		printf("Found %zu of 10000 keys\n", found);
+		printf("Height after skewed lookups: %zu\n\n",
+		       bst_height(bst));
+
+		bst_free(bst);
+	}
+
+	printf("\n");
+}
+
+void test_int_many()
+{
+	printf( "----------------------------------------\n"
+		" test_int_many\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	int	keys[]	= { 7, 12, 30, 3, 99, 64 };
+	size_t	count	= sizeof keys / sizeof *keys;
+	bool	found[sizeof keys / sizeof *keys];
+	void*	results[sizeof keys / sizeof *keys];
+
+	bst = bst_new(BST_COPIED, BST_AVL, sizeof(int), int_cmp, free, NULL);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 100; i += 3) {
+		bst_add(bst, &i);
+	}
+
+	/* The descents for all keys are interleaved. */
+	printf("Contains %zu of %zu keys:",
+	       bst_contains_many(bst, keys, count, found), count);
+	for (size_t i = 0; i < count; ++i) {
+		printf("%s %d: %s", i > 0 ? "," : "", keys[i],
+		       found[i] ? "yes" : "no");
+	}
+	printf("\n");
+
+	/* The same, but returning the elements found. */
+	bst_find_many(bst, keys, count, results);
+	printf("Found:");
+	for (size_t i = 0; i < count; ++i) {
+		if (results[i] != NULL) {
+			int_print_spaced(results[i]);
+		}
+	}
+	printf("\n");
+
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_sets()
+{
+	printf( "----------------------------------------\n"
+		" test_int_sets\n"
+		"----------------------------------------\n\n" );
+	bst_t*	evens;
+	bst_t*	threes;
+	bst_t*	sets[3];
+	char*	names[] = { "Union:       ", "Intersection:",
+			    "Difference:  " };
+
+	evens	= bst_new(BST_COPIED, BST_AVL, sizeof(int), int_cmp, free,
+			  int_print);
+	threes	= bst_new(BST_COPIED, BST_AVL, sizeof(int), int_cmp, free,
+			  int_print);
+	if (evens == NULL || threes == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i <= 12; ++i) {
+		if (i % 2 == 0) {
+			bst_add(evens, &i);
+		}
+		if (i % 3 == 0) {
+			bst_add(threes, &i);
+		}
+	}
+
+	/* Each merges the two trees in order, in linear time. */
+	sets[0] = bst_union(evens, threes, 1);
+	sets[1] = bst_intersection(evens, threes, 1);
+	sets[2] = bst_difference(evens, threes, 1);
+	for (int i = 0; i < 3; ++i) {
+		if (sets[i] == NULL) {
+			exit(EXIT_FAILURE);
+		}
+		printf("%s", names[i]);
+		bst_execute(sets[i], int_print_spaced, ORDER_IN);
+		printf("\n");
+		bst_free(sets[i]);
+	}
+
+	bst_free(threes);
+	bst_free(evens);
+
+	printf("\n\n");
+}
+
+void test_int_split()
+{
+	printf( "----------------------------------------\n"
+		" test_int_split\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	bst_t*	right;
+	int	key = 10, lo = 3, hi = 6;
+
+	bst = bst_new(BST_COPIED, BST_AVL | BST_RANKED, sizeof(int), int_cmp,
+		      free, int_print);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 1; i <= 15; ++i) {
+		bst_add(bst, &i);
+	}
+
+	/* The nodes are moved, not copied: with BST_RANKED, in O(log n). */
+	right = bst_split(bst, &key);
+	if (right == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	printf("Left: ");
+	bst_execute(bst, int_print_spaced, ORDER_IN);
+	printf("\nRight:");
+	bst_execute(right, int_print_spaced, ORDER_IN);
+	printf("\n");
+
+	printf("Deleted %zu in [%d, %d]\n", bst_delete_range(bst, &lo, &hi),
+	       lo, hi);
+
+	if (!bst_join(bst, right)) {
+		exit(EXIT_FAILURE);
+	}
+	printf("Joined:");
+	bst_execute(bst, int_print_spaced, ORDER_IN);
+	printf("\nSize: %zu, height: %zu\n", bst_size(bst), bst_height(bst));
+
+	bst_free(right);
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
+void test_int_compact()
+{
+	printf( "----------------------------------------\n"
+		" test_int_compact\n"
+		"----------------------------------------\n\n" );
+	bst_t*	bst;
+	int	arr[10];
+
+	/* The nodes live in one array and link to each other by 32-bit
+	 * index, which halves their size on 64-bit machines. */
+	bst = bst_new(BST_COPIED, BST_COMPACT | BST_AVL, sizeof(int), int_cmp,
+		      free, int_print);
+	if (bst == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 10; ++i) {
+		arr[i] = i + 1;
+		bst_add(bst, &arr[i]);
+	}
+
+	bst_print	(bst, int_print);
+	printf		("Height: %zu\n", bst_height(bst));
+
+	for (int i = 0; i < 5; ++i) {
+		bst_delete(bst, &arr[i]);
+	}
+	printf("In order:");
+	bst_execute(bst, int_print_spaced, ORDER_IN);
+	printf("\nHeight: %zu\n", bst_height(bst));
+
+	bst_free(bst);
+
+	printf("\n\n");
+}
+
 void test_person()
 {
 	printf( "----------------------------------------\n"
 		" test_person\n"
 		"----------------------------------------\n\n" );
 
-	bst_t* bst	= bst_new(BST_POINTED,
+	bst_t* bst	= bst_new(BST_POINTED, BST_PLAIN,
 				  sizeof(person_t),
 				  person_cmp, NULL, person_print);
 	bst_t* tmp	= bst;
@@ -99,6 +840,11 @@ void test_person()
 	bst_contains	(bst, &persons[0]);
 	bst_print	(bst, person_print);
 
+	/* Balance in place; no new tree has to be created and freed. */
+	bst_add		(bst, &persons[0]);
+	bst_balance	(&bst);
+	bst_print	(bst, person_print);
+
 	bst_free	(bst);
 
 	printf("\n\n");
@@ -110,8 +856,8 @@ void test_person_heap()
 		" test_person alloc\n"
 		"----------------------------------------\n\n" );
 
-	bst_t* bst	= bst_new(BST_COPIED, sizeof(person_t), person_cmp,
-				  person_free_heap, person_print);
+	bst_t* bst	= bst_new(BST_COPIED, BST_PLAIN, sizeof(person_t),
+				  person_cmp, person_free_heap, person_print);
 	bst_t* tmp	= bst;
 
 	/* Allocate some memory on the heap and store pointers to it inside an
@@ -178,6 +924,33 @@ void int_print(void* data)
 	printf("%d", *((int*)data));
 }
 
+void int_print_spaced(void* data)
+{
+	printf(" ");
+	int_print(data);
+}
+
+void* int_square(void* data)
+{
+	int* square = malloc(sizeof *square);
+
+	if (square != NULL) {
+		*square = *((int*)data) * *((int*)data);
+	}
+	return square;
+}
+
+void int_square_print(void* result)
+{
+	int_print_spaced(result);
+	free(result);
+}
+
+uint64_t int_hash(const void* key)
+{
+	return (uint64_t)*((int*)key);
+}
+
 
 /*==============================================================================
 	PERSON